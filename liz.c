@@ -17,7 +17,11 @@
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "mpc.h"
 #define LASSERT(args, cond, fmt, ...) \
@@ -37,6 +41,11 @@
   LASSERT(args, args->value.cell[index]->count != 0, \
     "Function '%s' passed {} for argument %i.", func, index);
 
+#define LASSERT_MAP(func, args, index) \
+  LASSERT(args, args->value.cell[index]->type == LVAL_MAP || args->value.cell[index]->type == LVAL_SET, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.", \
+    func, index, ltype_name(args->value.cell[index]->type), ltype_name(LVAL_MAP), ltype_name(LVAL_SET))
+
 
 mpc_parser_t *Comment;
 mpc_parser_t *String;
@@ -52,19 +61,45 @@ mpc_parser_t *Lisp64;
 
 struct lval;
 struct lenv;
+struct lir;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lir lir;
+typedef struct lvec lvec;
+typedef struct larr larr;
+typedef struct ltab ltab;
+typedef struct lmat lmat;
+typedef struct lhamt lhamt;
+typedef struct lhleaf lhleaf;
+typedef struct lrtype lrtype;
+typedef struct lrec lrec;
+typedef struct lpq lpq;
+typedef struct lbits lbits;
+typedef struct lseq lseq;
+typedef struct liter liter;
+typedef struct lxf lxf;
+typedef struct lbig lbig;
+typedef struct lrat lrat;
+typedef struct lcells lcells;
 
-enum { LVAL_LONG, LVAL_ERR, LVAL_DOUBLE, LVAL_SYM, LVAL_SEXP, LVAL_QEXP, LVAL_FUN, LVAL_BOOL, LVAL_STR};
+enum { LVAL_LONG, LVAL_ERR, LVAL_DOUBLE, LVAL_SYM, LVAL_SEXP, LVAL_QEXP, LVAL_FUN, LVAL_BOOL, LVAL_STR, LVAL_FORM,
+       LVAL_RECUR, LVAL_VECTOR, LVAL_ARRAY, LVAL_TABLE,
+       LVAL_MATRIX, LVAL_MAP, LVAL_SET,
+       LVAL_RECORD, LVAL_PQUEUE, LVAL_BITSET, LVAL_SEQ,
+       LVAL_XFORM, LVAL_BIGNUM, LVAL_RATIO};
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
+typedef lval*(*lrecop)(lval*, lval*);
+
+/* Lvals are sized by type. Every type has the header up to hash,
+   lists add hash and room for LVAL_CELLS inline cells, functions use
+   the whole struct, and strings, symbols and errors keep their length
+   in count and their bytes right after the header. */
+#define LVAL_CELLS 5
 
 struct lval {
   int type;
   int count;
-  lenv *env;
-  lval *formals;
-  lval *body;
   union {
     char *str;
     long l;
@@ -73,28 +108,304 @@ struct lval {
     char *sym;
     lval **cell;
     lbuiltin builtin;
+    lrecop recop;
+    lvec *vec;
+    larr *arr;
+    ltab *tab;
+    lmat *mat;
+    lhamt *map;
+    lrec *rec;
+    lpq *pq;
+    lbits *bits;
+    lseq *seq;
+    lxf *xf;
+    lbig *big;
+    lrat *rat;
   } value;
+  unsigned long hash;
+  union {
+    struct {
+      lenv *env;
+      lval *formals;
+      lval *body;
+      lir *ir;
+      lrtype *rtype;
+    };
+    lval *cells[LVAL_CELLS];
+  };
+};
+
+#define LVAL_HEAD offsetof(lval, hash)
+
+/* Lists longer than LVAL_CELLS keep their cells in a block shared
+   between copies. Anything about to change a list's cells first calls
+   lval_reserve, which gives it a private block, with copies of the
+   elements, while others still hold the old one. A nonzero hash marks
+   a block interned by lval_freeze. */
+struct lcells {
+  int refs;
+  int cap;
+  unsigned long hash;
+  lval *items[];
+};
+
+#define LCELLS(c) ((lcells*)((char*)(c) - offsetof(lcells, items)))
+
+/* Vector storage is shared between copies, so mutation through one
+   binding is visible through every other. */
+struct lvec {
+  int refs;
+  int count;
+  int cap;
+  lval **items;
+};
+
+/* Homogeneous numeric arrays hold raw values. Like vectors, copies
+   share storage. */
+enum { ARR_F64, ARR_I64 };
+
+struct larr {
+  int refs;
+  int kind;
+  long count;
+  union {
+    double *d;
+    long *l;
+  } data;
+};
+
+/* Tables are immutable sets of equal-length named columns. Numeric
+   columns are arrays and string columns are vectors of strings, so
+   tables share columns instead of copying them. */
+struct ltab {
+  int refs;
+  int ncols;
+  long nrows;
+  char **names;
+  lval **cols;
+};
+
+/* Dense row-major f64 matrix, shared between copies. */
+struct lmat {
+  int refs;
+  long rows;
+  long cols;
+  double *d;
+};
+
+/* Maps and sets are persistent hash array mapped tries. Nodes and
+   leaves are immutable and refcounted, so a copy shares the whole trie
+   and an update copies only the path down to the changed leaf. The
+   lval's count holds the number of entries; set leaves have no val. */
+struct lhleaf {
+  int refs;
+  unsigned long hash;
+  lval *key;
+  lval *val;
+};
+
+typedef struct {
+  lhamt *sub;
+  lhleaf *leaf;
+} lhslot;
+
+struct lhamt {
+  int refs;
+  unsigned int bitmap;
+  int count;
+  lhslot slots[];
+};
+
+/* Records are fixed-size slot arrays tagged with their type. They are
+   immutable, so copies share slots. The constructor, predicate and
+   accessors of a type are builtins carrying it in rtype, with the
+   accessor's field index in count; lval_call runs them as recop,
+   given themselves along with the arguments. */
+struct lrtype {
+  int refs;
+  char *name;
+  int count;
+  char **fields;
+};
+
+struct lrec {
+  int refs;
+  lrtype *type;
+  lval *slots[];
+};
+
+/* Fixed-size bitsets, shared between copies. Bits past count in the
+   last word are kept clear so whole-word kernels need no masking. */
+struct lbits {
+  int refs;
+  long count;
+  long words;
+  unsigned long *w;
+};
+
+/* Bignums are immutable sign-magnitude integers in 32-bit limbs, least
+   significant first, shared between copies. As lvals they only hold
+   values that do not fit in a long. */
+struct lbig {
+  int refs;
+  int neg;
+  int len;
+  unsigned int *d;
+};
+
+/* Rationals are kept in lowest terms with a denominator above one. */
+struct lrat {
+  int refs;
+  lbig *num;
+  lbig *den;
+};
+
+/* Lazy sequences are immutable descriptions of where elements come
+   from. Each traversal builds a matching chain of iterators that
+   produce the elements one at a time, so a sequence can be walked
+   more than once and never holds more than its current elements. */
+enum { SEQ_RANGE, SEQ_LIST, SEQ_ITERATE, SEQ_MAP, SEQ_FILTER, SEQ_TAKE, SEQ_DROP };
+
+struct lseq {
+  int refs;
+  int kind;
+  long a;
+  long b;
+  long step;
+  lval *f;
+  lval *x;
+  lseq *src;
+};
+
+struct liter {
+  lseq *s;
+  long i;
+  lval *x;
+  liter *src;
+};
+
+/* Transducers are immutable lists of stages, each a kind and the
+   function it applies, run in order on every element. XF_COND filters
+   like XF_FILTER but, as lib.liz filter does through cond, takes only
+   a Boolean from its predicate. */
+enum { XF_MAP, XF_FILTER, XF_TAKE_WHILE, XF_COND };
+
+struct lxf {
+  int refs;
+  int count;
+  int *kinds;
+  lval **fns;
+};
+
+/* Priority queues are binary heaps, shared between copies. Long and
+   double priorities are stored unboxed beside their payloads, and an
+   item that is its own numeric priority keeps no payload at all. A
+   queue whose numeric keys mix in bignums or ratios keeps them boxed. */
+enum { PQ_NONE, PQ_LONG, PQ_DOUBLE, PQ_STR, PQ_NUM };
+
+typedef struct {
+  union {
+    long l;
+    double d;
+    lval *s;
+  } k;
+  lval *v;
+} lpq_ent;
+
+struct lpq {
+  int refs;
+  int max;
+  int kind;
+  long count;
+  long cap;
+  lval *key;
+  lpq_ent *ents;
 };
 
 struct lenv {
   lenv *par;
   int count;
+  int frame;
   char **syms;
   lval **vals;
 };
 
+enum { LIR_PARAM, LIR_CONST, LIR_LOOKUP, LIR_CALL, LIR_PCALL, LIR_IF, LIR_LOOP, LIR_SNAP };
+enum { LIR_COLD, LIR_READY, LIR_FAILED };
+enum { LIR_TEST_BOOL, LIR_TEST_TRUTHY, LIR_TEST_ERROR };
+
+typedef struct lir_ins lir_ins;
+typedef struct lir_block lir_block;
+
+struct lir_ins {
+  int op;
+  int dst;
+  int argc;
+  int *args;
+  int index;
+  int dead;
+  int fast;
+  lval *k;
+  lbuiltin pure;
+  lir_block *in;
+  lir_block *then;
+  lir_block *els;
+};
+
+struct lir_block {
+  int count;
+  lir_ins **ins;
+  int result;
+};
+
+struct lir {
+  int refs;
+  int calls;
+  int deopts;
+  int state;
+  char *name;
+  lval *formals;
+  lval *body;
+  int nvals;
+  lir_ins **defs;
+  lir_block *pre;
+  lir_block *loop;
+  int *ptypes;
+  int *types;
+  int unsupported;
+  int cse, dce, licm;
+  int lib;
+};
+
 void lval_print(lval *v);
 lval *lval_eval(lenv *e, lval *v);
 lval *lval_eval_sexp(lenv *e, lval *v);
 lval *builtin_op(lenv *e, lval *a, char *op);
 void lval_del(lval *v);
+void lintern_drop(lcells *b);
+void lval_freeze(lval *v);
 lval *lval_copy(lval *v);
 lval *lval_err(char *fmt, ...);
+lval *lval_apply(lenv *e, lval *v);
+int lval_eq(lval *x, lval *y);
+unsigned long lval_hash(lval *v);
+lval *lval_call(lenv *e, lval *f, lval *a);
+lval *lval_call_with(lenv *e, lval *f, lval *a);
+lval *lval_call1(lenv *e, lval *f, lval *x);
+int lval_framed(lval *f, int n);
+int lval_truthy(lval *x);
+lir *lir_new(void);
+void lir_release(lir *ir);
+int lir_ready(lir *ir, lenv *e, lval *f, lval *a);
+lval *lir_exec(lir *ir, lenv *e);
+
+unsigned long lenv_epoch = 0;
 
 lenv *lenv_new(void) {
   lenv *e = malloc(sizeof(lenv));
   e->par = NULL;
   e->count = 0;
+  e->frame = 0;
   e->syms = NULL;
   e->vals = NULL;
   return e;
@@ -123,10 +434,21 @@ lval *lenv_get(lenv *e, lval *k) {
   }
 }
 
+/* The binding of sym itself, not a copy, or NULL. */
+lval *lenv_peek(lenv *e, char *sym) {
+  for (; e; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], sym) == 0) { return e->vals[i]; }
+    }
+  }
+  return NULL;
+}
+
 lenv *lenv_copy(lenv *e) {
   lenv *n = malloc(sizeof(lenv));
   n->par = e->par;
   n->count = e->count;
+  n->frame = 0;
   n->syms = malloc(sizeof(char*) * n->count);
   n->vals = malloc(sizeof(lval*) * n->count);
   for (int i = 0; i < e->count; i++) {
@@ -137,6 +459,97 @@ lenv *lenv_copy(lenv *e) {
   return n;
 }
 
+/* Frames for let-style forms borrow their slots from a chunked stack
+   region and are popped in LIFO order when the form exits. */
+
+#define LSTACK_CHUNK 4096
+
+typedef struct lstack lstack;
+
+struct lstack {
+  lstack *prev;
+  int top;
+  int cap;
+  char **syms;
+  lval **vals;
+};
+
+lstack *lstack_top = NULL;
+
+void lenv_frame(lenv *f, lenv *par, int n) {
+  if (!lstack_top || lstack_top->top + n > lstack_top->cap) {
+    lstack *s = malloc(sizeof(lstack));
+    s->prev = lstack_top;
+    s->top = 0;
+    s->cap = n > LSTACK_CHUNK ? n : LSTACK_CHUNK;
+    s->syms = malloc(sizeof(char*) * s->cap);
+    s->vals = malloc(sizeof(lval*) * s->cap);
+    lstack_top = s;
+  }
+  f->par = par;
+  f->count = 0;
+  f->frame = n;
+  /* An empty frame is an empty heap env, so set can grow it. */
+  f->syms = n ? lstack_top->syms + lstack_top->top : NULL;
+  f->vals = n ? lstack_top->vals + lstack_top->top : NULL;
+  lstack_top->top += n;
+}
+
+void lenv_frame_release(lenv *f, int n) {
+  for (int i = 0; i < f->count; i++) {
+    lval_del(f->vals[i]);
+  }
+  if (!f->frame) {
+    for (int i = 0; i < f->count; i++) { free(f->syms[i]); }
+    free(f->syms);
+    free(f->vals);
+  }
+  lstack_top->top -= n;
+  if (lstack_top->top == 0 && lstack_top->prev) {
+    lstack *s = lstack_top;
+    lstack_top = s->prev;
+    free(s->syms);
+    free(s->vals);
+    free(s);
+  }
+}
+
+/* Binds into a frame without copying either the value or the symbol,
+   which must outlive the frame. A frame that set has already moved to
+   the heap grows and keeps its own copy of the symbol instead. */
+void lenv_bind(lenv *f, lval *k, lval *v) {
+  for (int i = 0; i < f->count; i++) {
+    if (strcmp(f->syms[i], k->value.sym) == 0) {
+      lval_del(f->vals[i]);
+      f->vals[i] = v;
+      return;
+    }
+  }
+  if (f->frame) {
+    f->syms[f->count] = k->value.sym;
+  } else {
+    f->syms = realloc(f->syms, sizeof(char*) * (f->count + 1));
+    f->vals = realloc(f->vals, sizeof(lval*) * (f->count + 1));
+    f->syms[f->count] = malloc(k->count + 1);
+    strcpy(f->syms[f->count], k->value.sym);
+  }
+  f->vals[f->count++] = v;
+}
+
+/* A frame that gains a binding through set moves to the heap. */
+void lenv_unframe(lenv *e) {
+  char **syms = malloc(sizeof(char*) * (e->count + 1));
+  lval **vals = malloc(sizeof(lval*) * (e->count + 1));
+  for (int i = 0; i < e->count; i++) {
+    syms[i] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(syms[i], e->syms[i]);
+    vals[i] = e->vals[i];
+  }
+  e->syms = syms;
+  e->vals = vals;
+  e->frame = 0;
+}
+
 void lenv_put(lenv *e, lval *k, lval *v) {
    for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->value.sym) == 0) {
@@ -145,11 +558,12 @@ void lenv_put(lenv *e, lval *k, lval *v) {
       return;
     }
   }
+  if (e->frame) { lenv_unframe(e); }
   e->count++;
   e->vals = realloc(e->vals, sizeof(lval*) * e->count);
   e->syms = realloc(e->syms, sizeof(char*) * e->count);
   e->vals[e->count-1] = lval_copy(v);
-  e->syms[e->count-1] = malloc(strlen(k->value.sym)+1);
+  e->syms[e->count-1] = malloc(k->count + 1);
   strcpy(e->syms[e->count-1], k->value.sym);
 }
 
@@ -158,638 +572,6556 @@ void lenv_def(lenv *e, lval *k, lval *v) {
   lenv_put(e, k, v);
 }
 
+#ifndef LIZ_SMALL_MIN
+#define LIZ_SMALL_MIN (-128)
+#endif
+#ifndef LIZ_SMALL_MAX
+#define LIZ_SMALL_MAX 1023
+#endif
+
+/* Immortal values: the booleans, the empty lists and small longs are
+   allocated once and shared by every use. lval_del and lval_copy pass
+   them through, and nothing may change them in place. */
+enum { LFIX_FALSE, LFIX_TRUE, LFIX_SEXP, LFIX_QEXP, LFIX_LONG };
+
+lval lval_fixed[LFIX_LONG + LIZ_SMALL_MAX - LIZ_SMALL_MIN + 1];
+
+#define LVAL_FIXED(v) ((v) >= lval_fixed && (v) < lval_fixed + sizeof(lval_fixed) / sizeof(lval))
+
+void lval_fixed_init(void) {
+  lval_fixed[LFIX_FALSE].type = LVAL_BOOL;
+  lval_fixed[LFIX_TRUE].type = LVAL_BOOL;
+  lval_fixed[LFIX_TRUE].value.l = 1;
+  lval_fixed[LFIX_SEXP].type = LVAL_SEXP;
+  lval_fixed[LFIX_SEXP].value.cell = lval_fixed[LFIX_SEXP].cells;
+  lval_fixed[LFIX_QEXP].type = LVAL_QEXP;
+  lval_fixed[LFIX_QEXP].value.cell = lval_fixed[LFIX_QEXP].cells;
+  for (long i = LIZ_SMALL_MIN; i <= LIZ_SMALL_MAX; i++) {
+    lval_fixed[LFIX_LONG + i - LIZ_SMALL_MIN].type = LVAL_LONG;
+    lval_fixed[LFIX_LONG + i - LIZ_SMALL_MIN].value.l = i;
+  }
+}
+
+lval *lval_nil(void) {
+  return &lval_fixed[LFIX_SEXP];
+}
+
+/* Quoted code retyped for evaluation. The shared empty Q-Expression
+   is swapped for the empty S-Expression rather than changed. */
+lval *lval_unquote(lval *x) {
+  if (x == &lval_fixed[LFIX_QEXP]) { return lval_nil(); }
+  x->type = LVAL_SEXP;
+  return x;
+}
+
+/* Small lvals are bump-allocated from aligned chunks, one size class
+   per chunk, and recycled through per-class free lists. Each top-level
+   form in load or the REPL ends a region: lpool_trim then returns every
+   chunk left without live lvals to the system at once. Values that
+   escape into an env keep their chunk alive, so nothing needs moving.
+   Set LIZ_POOL_CHUNK to 0, or define LIZ_NO_POOL, to give every lval
+   its own malloc. */
+#ifdef LIZ_NO_POOL
+#define LIZ_POOL_CHUNK 0
+#endif
+#ifndef LIZ_POOL_CHUNK
+#define LIZ_POOL_CHUNK (1 << 16)
+#endif
+#define LPOOL_GRAIN 16
+#define LPOOL_CLASSES 8
+#define LPOOL_TRIM 16
+
+typedef struct lpool_chunk lpool_chunk;
+typedef struct lpool_slot lpool_slot;
+
+struct lpool_chunk {
+  lpool_chunk *next;
+  int live;
+  int idle;
+};
+
+struct lpool_slot { lpool_slot *next; };
+
+lpool_slot *lpool_free[LPOOL_CLASSES];
+char *lpool_bump[LPOOL_CLASSES];
+char *lpool_end[LPOOL_CLASSES];
+lpool_chunk *lpool_chunks = NULL;
+int lpool_idle = 0;
+
+#define LPOOL_CHUNK_OF(p) ((lpool_chunk*)((size_t)(p) & ~(size_t)(LIZ_POOL_CHUNK - 1)))
+
+int lpool_class(size_t size) {
+  if (!LIZ_POOL_CHUNK) { return LPOOL_CLASSES; }
+  return (size + LPOOL_GRAIN - 1) / LPOOL_GRAIN - 1;
+}
+
+/* Out of line, so the compiler does not assume every lval it sees
+   was allocated at full size. */
+__attribute__((noinline)) lval *lval_alloc(size_t size) {
+  int k = lpool_class(size);
+  if (k >= LPOOL_CLASSES) { return malloc(size); }
+  void *p = lpool_free[k];
+  if (p) {
+    lpool_free[k] = lpool_free[k]->next;
+  } else {
+    size_t n = (k + 1) * LPOOL_GRAIN;
+    if (!lpool_bump[k] || lpool_bump[k] + n > lpool_end[k]) {
+      lpool_chunk *c = aligned_alloc(LIZ_POOL_CHUNK, LIZ_POOL_CHUNK);
+      c->next = lpool_chunks;
+      c->live = 0;
+      c->idle = 0;
+      lpool_chunks = c;
+      lpool_bump[k] = (char*)c + LPOOL_GRAIN;
+      lpool_end[k] = (char*)c + LIZ_POOL_CHUNK;
+    }
+    p = lpool_bump[k];
+    lpool_bump[k] += n;
+  }
+  lpool_chunk *c = LPOOL_CHUNK_OF(p);
+  if (c->live++ == 0 && c->idle) {
+    c->idle = 0;
+    lpool_idle--;
+  }
+  return p;
+}
+
+void lval_free(lval *v, size_t size) {
+  int k = lpool_class(size);
+  if (k >= LPOOL_CLASSES) {
+    free(v);
+    return;
+  }
+  lpool_slot *s = (lpool_slot*)v;
+  s->next = lpool_free[k];
+  lpool_free[k] = s;
+  lpool_chunk *c = LPOOL_CHUNK_OF(v);
+  if (--c->live == 0) {
+    c->idle = 1;
+    lpool_idle++;
+  }
+}
+
+/* Ends a region. Only worth a pass over the free lists once enough
+   chunks have emptied. */
+void lpool_trim(void) {
+  if (lpool_idle < LPOOL_TRIM) { return; }
+  for (int k = 0; k < LPOOL_CLASSES; k++) {
+    lpool_chunk *bump = lpool_bump[k] ? LPOOL_CHUNK_OF(lpool_bump[k] - 1) : NULL;
+    lpool_slot **s = &lpool_free[k];
+    while (*s) {
+      lpool_chunk *c = LPOOL_CHUNK_OF(*s);
+      if (c->idle && c != bump) { *s = (*s)->next; } else { s = &(*s)->next; }
+    }
+  }
+  lpool_idle = 0;
+  lpool_chunk **c = &lpool_chunks;
+  while (*c) {
+    lpool_chunk *x = *c;
+    int bump = 0;
+    for (int k = 0; k < LPOOL_CLASSES; k++) { bump |= lpool_bump[k] && LPOOL_CHUNK_OF(lpool_bump[k] - 1) == x; }
+    if (!x->idle || bump) {
+      lpool_idle += x->idle;
+      c = &x->next;
+      continue;
+    }
+    *c = x->next;
+    free(x);
+  }
+}
+
+int lval_full(int type) {
+  return type == LVAL_SEXP || type == LVAL_QEXP || type == LVAL_RECUR || type == LVAL_FUN;
+}
+
+lval *lval_new(int type) {
+  lval *v = lval_alloc(lval_full(type) ? sizeof(lval) : LVAL_HEAD);
+  v->type = type;
+  return v;
+}
+
+/* The size v was allocated with. */
+size_t lval_bytes(lval *v) {
+  if (v->type == LVAL_STR || v->type == LVAL_SYM || v->type == LVAL_ERR) { return LVAL_HEAD + v->count + 1; }
+  return lval_full(v->type) ? sizeof(lval) : LVAL_HEAD;
+}
+
 lval *lval_long(long x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_LONG;
+  if (x >= LIZ_SMALL_MIN && x <= LIZ_SMALL_MAX) { return &lval_fixed[LFIX_LONG + x - LIZ_SMALL_MIN]; }
+  lval *v = lval_new(LVAL_LONG);
   v->value.l = x;
   return v;
 }
 
+lval *lval_text(int type, char *s, int n) {
+  lval *v = lval_alloc(LVAL_HEAD + n + 1);
+  v->type = type;
+  v->count = n;
+  v->value.str = (char*)v + LVAL_HEAD;
+  memcpy(v->value.str, s, n);
+  v->value.str[n] = '\0';
+  return v;
+}
+
 lval *lval_err(char *fmt, ...) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  char buf[512];
   va_list va;
   va_start(va, fmt);
-  v->value.err = malloc(512);
-  vsnprintf(v->value.err, 511, fmt, va);
-  v->value.err = realloc(v->value.err, strlen(v->value.err)+1);
+  int n = vsnprintf(buf, sizeof(buf), fmt, va);
   va_end(va);
-  return v;
+  return lval_text(LVAL_ERR, buf, n < (int)sizeof(buf) ? n : sizeof(buf) - 1);
 }
 
 lval *lval_double(double x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_DOUBLE;
+  lval *v = lval_new(LVAL_DOUBLE);
   v->value.d = x;
   return v;
 }
 
 lval *lval_sym(char *x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->value.sym = malloc(strlen(x) + 1);
-  strcpy(v->value.sym, x);
-  return v;
+  return lval_text(LVAL_SYM, x, strlen(x));
 }
 
 lval *lval_sexp(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXP;
+  lval *v = lval_new(LVAL_SEXP);
   v->count = 0;
-  v->value.cell = NULL;
+  v->hash = 0;
+  v->value.cell = v->cells;
   return v;
 }
 
 lval *lval_qexp(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXP;
+  lval *v = lval_new(LVAL_QEXP);
   v->count = 0;
-  v->value.cell = NULL;
+  v->hash = 0;
+  v->value.cell = v->cells;
   return v;
 }
 
 lval *lval_fun(lbuiltin x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval *v = lval_new(LVAL_FUN);
+  v->env = NULL;
+  v->formals = NULL;
+  v->body = NULL;
+  v->ir = NULL;
+  v->rtype = NULL;
+  v->count = 0;
   v->value.builtin = x;
   return v;
 }
 
-lval *lval_bool(char *x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_BOOL;
-  if (strcmp(x, "#false") == 0) {
-    v->value.l = 0L;
-  } else {
-    v->value.l = 1L;
-  }
+lval *lval_form(lbuiltin x) {
+  lval *v = lval_new(LVAL_FORM);
+  v->value.builtin = x;
   return v;
 }
 
+lval *lval_bool(char *x) {
+  return &lval_fixed[strcmp(x, "#false") == 0 ? LFIX_FALSE : LFIX_TRUE];
+}
+
 lval *lval_lambda(lval *formals, lval *body) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval *v = lval_new(LVAL_FUN);
   v->value.builtin = NULL;
   v->env = lenv_new();
   v->formals = formals;
   v->body = body;
+  v->ir = lir_new();
   return v;
 }
 
-lval *lval_str(char *s) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->value.str = malloc(strlen(s) + 1);
-  strcpy(v->value.str, s);
+lval *lval_vec(void) {
+  lval *v = lval_new(LVAL_VECTOR);
+  v->value.vec = malloc(sizeof(lvec));
+  v->value.vec->refs = 1;
+  v->value.vec->count = 0;
+  v->value.vec->cap = 0;
+  v->value.vec->items = NULL;
   return v;
 }
 
-void lval_del(lval *v) {
-  switch (v->type) {
-  case LVAL_STR: free(v->value.str); break;
-  case LVAL_BOOL:
-  case LVAL_LONG:
-  case LVAL_DOUBLE: break;
-  case LVAL_ERR: free(v->value.err); break;
-  case LVAL_SYM: free(v->value.sym); break;
-  case LVAL_QEXP:
-  case LVAL_SEXP:
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->value.cell[i]);
-    }
-    free(v->value.cell);
-    break;
-  case LVAL_FUN:
-    if (!v->value.builtin) {
-      lenv_del(v->env);
-      lval_del(v->formals);
-      lval_del(v->body);
+/* An empty map or set has no trie at all. */
+lval *lval_map(int type) {
+  lval *v = lval_new(type);
+  v->count = 0;
+  v->value.map = NULL;
+  return v;
+}
+
+void lhamt_release(lhamt *n) {
+  if (!n || --n->refs) { return; }
+  for (int i = 0; i < n->count; i++) {
+    lhleaf *x = n->slots[i].leaf;
+    if (n->slots[i].sub) {
+      lhamt_release(n->slots[i].sub);
+    } else if (--x->refs == 0) {
+      lval_del(x->key);
+      if (x->val) { lval_del(x->val); }
+      free(x);
     }
-    break;
   }
-  free(v);
+  free(n);
 }
 
-void lval_print_str(lval *v) {
-  char *escaped = malloc(strlen(v->value.str)+1);
-  strcpy(escaped, v->value.str);
-  escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
-  free(escaped);
+/* Each level of the trie consumes five bits of the key's hash. Past
+   the last one, keys with identical hashes share a collision node
+   that is searched linearly. */
+#define LHAMT_BITS 5
+#define LHAMT_DEPTH 64
+#define LHAMT_FRAG(h, shift) (((h) >> (shift)) & 31)
+
+int lhleaf_match(lhleaf *x, unsigned long h, lval *k) {
+  return x->hash == h && lval_eq(x->key, k);
 }
 
-void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->value.cell[i]);
-    if (i != (v->count-1)) {
-      putchar(' ');
+lhleaf *lhamt_get(lhamt *n, unsigned long h, lval *k) {
+  for (int shift = 0; n; shift += LHAMT_BITS) {
+    if (shift >= LHAMT_DEPTH) {
+      for (int i = 0; i < n->count; i++) {
+	if (lhleaf_match(n->slots[i].leaf, h, k)) { return n->slots[i].leaf; }
+      }
+      return NULL;
     }
+    unsigned int bit = 1u << LHAMT_FRAG(h, shift);
+    if (!(n->bitmap & bit)) { return NULL; }
+    lhslot s = n->slots[__builtin_popcount(n->bitmap & (bit - 1))];
+    if (s.leaf) { return lhleaf_match(s.leaf, h, k) ? s.leaf : NULL; }
+    n = s.sub;
   }
-  putchar(close);
+  return NULL;
 }
 
-void lval_print(lval *v) {
-  switch (v->type) {
-  case LVAL_STR:   lval_print_str(v); break;
-  case LVAL_BOOL:
-    if (v->value.l) {
-      printf("#true");
-    } else {
-      printf("#false");
-    }
-    break;
-  case LVAL_LONG:   printf("%li", v->value.l); break;
-  case LVAL_DOUBLE: printf("%f", v->value.d); break;
-  case LVAL_ERR:   printf("Error: %s", v->value.err); break;
-  case LVAL_SYM:   printf("%s", v->value.sym); break;
-  case LVAL_SEXP: lval_expr_print(v, '(', ')'); break;
-  case LVAL_QEXP: lval_expr_print(v, '{', '}'); break;
-  case LVAL_FUN:
-    if (v->value.builtin) {
-      printf("<builtin>");
-    } else {
-      printf("(lambda "); lval_print(v->formals);
-      putchar(' '); lval_print(v->body); putchar(')');
+/* Every entry of x is in y, with an equal value. */
+int lhamt_within(lhamt *x, lhamt *y) {
+  for (int i = 0; x && i < x->count; i++) {
+    lhleaf *a = x->slots[i].leaf;
+    if (x->slots[i].sub) {
+      if (!lhamt_within(x->slots[i].sub, y)) { return 0; }
+      continue;
     }
-    break;
+    lhleaf *b = lhamt_get(y, a->hash, a->key);
+    if (!b || (a->val && !lval_eq(a->val, b->val))) { return 0; }
   }
+  return 1;
 }
 
-void lval_println(lval *v) { lval_print(v); putchar('\n'); }
+/* Summed, so that the hash does not depend on trie layout. */
+unsigned long lhamt_hash(lhamt *n) {
+  unsigned long h = 0;
+  for (int i = 0; n && i < n->count; i++) {
+    lhleaf *x = n->slots[i].leaf;
+    h += n->slots[i].sub ? lhamt_hash(n->slots[i].sub)
+      : x->hash * 31 + (x->val ? lval_hash(x->val) : 0);
+  }
+  return h;
+}
 
-lval *lval_copy(lval *v) {
-  lval *x = malloc(sizeof(lval));
-  x->type = v->type;
-  switch (v->type) {
-  case LVAL_STR: x->value.str = malloc(strlen(v->value.str) + 1);
-    strcpy(x->value.str, v->value.str); break;
-  case LVAL_BOOL:
-  case LVAL_LONG: x->value.l = v->value.l; break;
-  case LVAL_DOUBLE: x->value.d = v->value.d; break;
-  case LVAL_ERR:
-    x->value.err = malloc(strlen(v->value.err) + 1);
-    strcpy(x->value.err, v->value.err); break;
-  case LVAL_SYM:
-    x->value.sym = malloc(strlen(v->value.sym) + 1);
-    strcpy(x->value.sym, v->value.sym); break;
-  case LVAL_SEXP:
-  case LVAL_QEXP:
-    x->count = v->count;
-    x->value.cell = malloc(sizeof(lval*) * x->count);
-    for (int i = 0; i < x->count; i++) {
-      x->value.cell[i] = lval_copy(v->value.cell[i]);
-    }
-    break;
-  case LVAL_FUN:
-    if (v->value.builtin) {
-      x->value.builtin = v->value.builtin;
-    } else {
-      x->value.builtin = NULL;
-      x->env = lenv_copy(v->env);
-      x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
+void lhamt_print(lhamt *n, int *first) {
+  for (int i = 0; n && i < n->count; i++) {
+    lhleaf *x = n->slots[i].leaf;
+    if (n->slots[i].sub) {
+      lhamt_print(n->slots[i].sub, first);
+      continue;
     }
-    break;
+    if (!*first) { putchar(' '); }
+    *first = 0;
+    lval_print(x->key);
+    if (x->val) { putchar(' '); lval_print(x->val); }
   }
-  return x;
 }
 
-lval *lval_add(lval *v, lval *x) {
-  v->count++;
-  v->value.cell = realloc(v->value.cell, sizeof(lval*) * v->count);
-  v->value.cell[v->count-1] = x;
+void lrtype_release(lrtype *t) {
+  if (!t || --t->refs) { return; }
+  for (int i = 0; i < t->count; i++) { free(t->fields[i]); }
+  free(t->fields);
+  free(t->name);
+  free(t);
+}
+
+lval *lval_rec(lrtype *t) {
+  lval *v = lval_new(LVAL_RECORD);
+  v->value.rec = malloc(sizeof(lrec) + sizeof(lval*) * t->count);
+  v->value.rec->refs = 1;
+  v->value.rec->type = t;
+  t->refs++;
   return v;
 }
 
-lval *lval_read_long(mpc_ast_t *t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ?
-    lval_long(x) : lval_err("invalid number");
+void lpq_release(lpq *q);
+void lseq_release(lseq *s);
+liter *liter_new(lseq *s);
+lval *liter_next(lenv *e, liter *it);
+void liter_free(liter *it);
+void lxf_release(lxf *x);
+lval *lval_fuse(lenv *e, lval *v);
+
+lbig *lbig_new(int len) {
+  lbig *b = malloc(sizeof(lbig));
+  b->refs = 1;
+  b->neg = 0;
+  b->len = len;
+  b->d = calloc(len ? len : 1, sizeof(unsigned int));
+  return b;
 }
 
-lval *lval_read_double(mpc_ast_t *t) {
-  errno = 0;
-  double x = strtod(t->contents, NULL);
-  return errno != ERANGE ?
-    lval_double(x) : lval_err("invalid number");
+void lbig_release(lbig *b) {
+  if (--b->refs) { return; }
+  free(b->d);
+  free(b);
 }
 
-lval *lval_read_str(mpc_ast_t *t) {
-  t->contents[strlen(t->contents)-1] = '\0';
-  char *unescaped = malloc(strlen(t->contents+1)+1);
-  strcpy(unescaped, t->contents+1);
-  unescaped = mpcf_unescape(unescaped);
-  lval *str = lval_str(unescaped);
-  free(unescaped);
-  return str;
+/* Drops leading zero limbs; zero is never negative. */
+lbig *lbig_trim(lbig *b) {
+  while (b->len > 0 && b->d[b->len-1] == 0) { b->len--; }
+  if (b->len == 0) { b->neg = 0; }
+  return b;
 }
 
-lval *lval_read(mpc_ast_t *t) {
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
-  if (strstr(t->tag, "double")) { return lval_read_double(t); }
-  if (strstr(t->tag, "long")) { return lval_read_long(t); }
-  if (strstr(t->tag, "boolean")) { return lval_bool(t->contents); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-  lval *x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexp(); }
-  if (strstr(t->tag, "sexp"))  { x = lval_sexp(); }
-  if (strstr(t->tag, "qexp"))  { x = lval_qexp(); }
-  for (int i = 0; i < t->children_num; i++) {
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+lbig *lbig_from_long(long x) {
+  lbig *b = lbig_new(2);
+  unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+  b->neg = x < 0;
+  b->d[0] = m;
+  b->d[1] = m >> 32;
+  return lbig_trim(b);
+}
+
+/* Decimal digits with an optional leading minus sign. */
+lbig *lbig_parse(char *s) {
+  int neg = *s == '-';
+  if (neg) { s++; }
+  lbig *b = lbig_new(strlen(s) / 9 + 2);
+  b->len = 0;
+  for (; *s; s++) {
+    unsigned long c = *s - '0';
+    for (int i = 0; i < b->len; i++) {
+      c += (unsigned long)b->d[i] * 10;
+      b->d[i] = c;
+      c >>= 32;
+    }
+    if (c) { b->d[b->len++] = c; }
   }
-  return x;
+  b->neg = neg;
+  return lbig_trim(b);
 }
 
-lval *lval_pop(lval *v, int i) {
-  lval *x = v->value.cell[i];
-  memmove(&v->value.cell[i], &v->value.cell[i+1],
-    sizeof(lval*) * (v->count-i-1));
-  v->count--;
-  v->value.cell = realloc(v->value.cell, sizeof(lval*) * v->count);
-  return x;
+int lbig_fits(lbig *b) {
+  if (b->len > 2) { return 0; }
+  unsigned long m = b->len ? b->d[0] | (b->len > 1 ? (unsigned long)b->d[1] << 32 : 0) : 0;
+  return m <= (unsigned long)LONG_MAX + b->neg;
 }
 
-lval *lval_take(lval *v, int i) {
-  lval *x = lval_pop(v, i);
-  lval_del(v);
-  return x;
+long lbig_long(lbig *b) {
+  unsigned long m = b->len ? b->d[0] | (b->len > 1 ? (unsigned long)b->d[1] << 32 : 0) : 0;
+  return b->neg ? (long)(0 - m) : (long)m;
 }
 
-char *ltype_name(int t) {
-  switch(t) {
-  case LVAL_STR: return "String";
-  case LVAL_BOOL: return "Boolean";
-  case LVAL_FUN: return "Function";
-  case LVAL_LONG: return "Long";
-  case LVAL_DOUBLE: return "Double";
-  case LVAL_ERR: return "Error";
-  case LVAL_SYM: return "Symbol";
-  case LVAL_SEXP: return "S-Expression";
-  case LVAL_QEXP: return "Q-Expression";
-  default: return "Unknown";
+double lbig_double(lbig *b) {
+  double r = 0;
+  for (int i = b->len-1; i >= 0; i--) { r = r * 4294967296.0 + b->d[i]; }
+  return b->neg ? -r : r;
+}
+
+int lbig_cmpmag(lbig *a, lbig *b) {
+  if (a->len != b->len) { return a->len < b->len ? -1 : 1; }
+  for (int i = a->len-1; i >= 0; i--) {
+    if (a->d[i] != b->d[i]) { return a->d[i] < b->d[i] ? -1 : 1; }
   }
+  return 0;
 }
 
-lval *builtin_head(lenv *e, lval *a) {
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXP);
-  LASSERT_NOT_EMPTY("head", a, 0);
-  lval *v = lval_take(a, 0);
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-  return v;
+int lbig_cmp(lbig *a, lbig *b) {
+  if (a->neg != b->neg) { return a->neg ? -1 : 1; }
+  int o = lbig_cmpmag(a, b);
+  return a->neg ? -o : o;
 }
 
-lval *builtin_tail(lenv *e, lval *a) {
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXP);
-  LASSERT_NOT_EMPTY("tail", a, 0);
-  lval *v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
+lbig *lbig_addmag(lbig *a, lbig *b) {
+  if (a->len < b->len) { lbig *t = a; a = b; b = t; }
+  lbig *r = lbig_new(a->len + 1);
+  unsigned long c = 0;
+  for (int i = 0; i < a->len; i++) {
+    c += (unsigned long)a->d[i] + (i < b->len ? b->d[i] : 0);
+    r->d[i] = c;
+    c >>= 32;
+  }
+  r->d[a->len] = c;
+  return r;
 }
 
-lval *builtin_list(lenv *e, lval *a) {
-  a->type = LVAL_QEXP;
+/* |a| - |b|, where |a| >= |b|. */
+lbig *lbig_submag(lbig *a, lbig *b) {
+  lbig *r = lbig_new(a->len);
+  long borrow = 0;
+  for (int i = 0; i < a->len; i++) {
+    long t = (long)a->d[i] - (i < b->len ? b->d[i] : 0) - borrow;
+    borrow = t < 0;
+    r->d[i] = t + (borrow << 32);
+  }
+  return r;
+}
+
+/* a + b, or a - b when sub is set. */
+lbig *lbig_add(lbig *a, lbig *b, int sub) {
+  int bneg = b->neg ^ sub;
+  lbig *r;
+  if (a->neg == bneg) {
+    r = lbig_addmag(a, b);
+    r->neg = a->neg;
+  } else if (lbig_cmpmag(a, b) >= 0) {
+    r = lbig_submag(a, b);
+    r->neg = a->neg;
+  } else {
+    r = lbig_submag(b, a);
+    r->neg = bneg;
+  }
+  return lbig_trim(r);
+}
+
+lbig *lbig_mul(lbig *a, lbig *b) {
+  lbig *r = lbig_new(a->len + b->len);
+  for (int i = 0; i < a->len; i++) {
+    unsigned long c = 0;
+    for (int j = 0; j < b->len; j++) {
+      c += (unsigned long)a->d[i] * b->d[j] + r->d[i+j];
+      r->d[i+j] = c;
+      c >>= 32;
+    }
+    r->d[i+b->len] = c;
+  }
+  r->neg = a->neg != b->neg;
+  return lbig_trim(r);
+}
+
+/* Truncating division like C's on longs: the quotient rounds toward
+   zero and the remainder takes the sign of a. b must be nonzero.
+   Multi-limb divisors use Knuth's algorithm D. */
+void lbig_divmod(lbig *a, lbig *b, lbig **q, lbig **r) {
+  int n = b->len, m = a->len - n;
+  if (m < 0 || lbig_cmpmag(a, b) < 0) {
+    *q = lbig_new(0);
+    *r = lbig_add(a, *q, 0);
+    return;
+  }
+  lbig *qq = lbig_new(m + 1), *rr = lbig_new(n);
+  if (n == 1) {
+    unsigned long rem = 0;
+    for (int i = a->len-1; i >= 0; i--) {
+      unsigned long cur = rem << 32 | a->d[i];
+      qq->d[i] = cur / b->d[0];
+      rem = cur % b->d[0];
+    }
+    rr->d[0] = rem;
+  } else {
+    int s = __builtin_clz(b->d[n-1]);
+    unsigned int *v = malloc(sizeof(unsigned int) * n);
+    unsigned int *u = malloc(sizeof(unsigned int) * (a->len + 1));
+    for (int i = n-1; i > 0; i--) { v[i] = b->d[i] << s | (unsigned long)b->d[i-1] >> (32 - s); }
+    v[0] = b->d[0] << s;
+    u[a->len] = (unsigned long)a->d[a->len-1] >> (32 - s);
+    for (int i = a->len-1; i > 0; i--) { u[i] = a->d[i] << s | (unsigned long)a->d[i-1] >> (32 - s); }
+    u[0] = a->d[0] << s;
+    for (int j = m; j >= 0; j--) {
+      unsigned long num = (unsigned long)u[j+n] << 32 | u[j+n-1];
+      unsigned long qhat = num / v[n-1], rhat = num % v[n-1];
+      while (qhat >> 32 || qhat * v[n-2] > (rhat << 32 | u[j+n-2])) {
+	qhat--;
+	rhat += v[n-1];
+	if (rhat >> 32) { break; }
+      }
+      long k = 0, t;
+      for (int i = 0; i < n; i++) {
+	unsigned long p = qhat * v[i];
+	t = u[i+j] - k - (p & 0xffffffff);
+	u[i+j] = t;
+	k = (p >> 32) - (t >> 32);
+      }
+      t = u[j+n] - k;
+      u[j+n] = t;
+      if (t < 0) {
+	qhat--;
+	unsigned long c = 0;
+	for (int i = 0; i < n; i++) {
+	  c += (unsigned long)u[i+j] + v[i];
+	  u[i+j] = c;
+	  c >>= 32;
+	}
+	u[j+n] += c;
+      }
+      qq->d[j] = qhat;
+    }
+    for (int i = 0; i < n; i++) { rr->d[i] = ((unsigned long)u[i+1] << 32 | u[i]) >> s; }
+    free(u);
+    free(v);
+  }
+  qq->neg = a->neg != b->neg;
+  rr->neg = a->neg;
+  *q = lbig_trim(qq);
+  *r = lbig_trim(rr);
+}
+
+lbig *lbig_gcd(lbig *a, lbig *b) {
+  a->refs++;
+  b->refs++;
+  while (b->len) {
+    lbig *q, *r;
+    lbig_divmod(a, b, &q, &r);
+    lbig_release(q);
+    lbig_release(a);
+    a = b;
+    b = r;
+  }
+  lbig_release(b);
+  if (a->neg) {
+    lbig *t = lbig_new(0);
+    b = lbig_add(t, a, 1);
+    lbig_release(t);
+    lbig_release(a);
+    a = b;
+  }
   return a;
 }
 
-lval *builtin_eval(lenv *e, lval *a) {
-  LASSERT_NUM("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXP);
-  lval *x = lval_take(a, 0);
-  x->type = LVAL_SEXP;
-  return lval_eval(e, x);
+/* Results of ^ longer than this many limbs are refused. */
+#ifndef LIZ_BIG_LIMBS
+#define LIZ_BIG_LIMBS (1 << 14)
+#endif
+
+/* Bits in |b|, 0 for zero. */
+unsigned long lbig_bits(lbig *b) {
+  if (!b->len) { return 0; }
+  return (unsigned long)b->len * 32 - __builtin_clz(b->d[b->len-1]);
 }
 
-lval *lval_join(lval *x, lval *y) {
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+lbig *lbig_pow(lbig *b, unsigned long e) {
+  lbig *r = lbig_from_long(1), *t;
+  b->refs++;
+  while (e) {
+    if (e & 1) { t = lbig_mul(r, b); lbig_release(r); r = t; }
+    e >>= 1;
+    if (e) { t = lbig_mul(b, b); lbig_release(b); b = t; }
   }
-  lval_del(y);
-  return x;
+  lbig_release(b);
+  return r;
 }
 
-lval *builtin_join(lenv *e, lval *a) {
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE("join", a, i, LVAL_QEXP);
+char *lbig_str(lbig *b) {
+  int cap = b->len * 10 + 3, len = b->len;
+  char *s = malloc(cap), *p = s + cap - 1;
+  unsigned int *t = malloc(sizeof(unsigned int) * (len ? len : 1));
+  memcpy(t, b->d, sizeof(unsigned int) * len);
+  *p = '\0';
+  if (!len) { *--p = '0'; }
+  while (len) {
+    unsigned long rem = 0;
+    for (int i = len-1; i >= 0; i--) {
+      unsigned long cur = rem << 32 | t[i];
+      t[i] = cur / 1000000000;
+      rem = cur % 1000000000;
+    }
+    while (len && !t[len-1]) { len--; }
+    for (int k = 0; k < 9 && (len || rem); k++) {
+      *--p = '0' + rem % 10;
+      rem /= 10;
+    }
   }
-  lval *x = lval_pop(a, 0);
-  while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
+  if (b->neg) { *--p = '-'; }
+  memmove(s, p, strlen(p) + 1);
+  free(t);
+  return s;
+}
+
+void lbig_print(lbig *b) {
+  char *s = lbig_str(b);
+  printf("%s", s);
+  free(s);
+}
+
+lval *lval_big(lbig *b) {
+  lval *v = lval_new(LVAL_BIGNUM);
+  v->value.big = b;
+  return v;
+}
+
+/* Exact numbers during arithmetic, as an unreduced num/den pair. */
+typedef struct {
+  lbig *n;
+  lbig *d;
+} lq;
+
+lq lq_of_double(double x) {
+  int e;
+  double m = frexp(x, &e);
+  lq q = { lbig_from_long((long)ldexp(m, 53)), lbig_from_long(1) };
+  lbig *two = lbig_from_long(2), *p = lbig_pow(two, abs(e - 53));
+  if (e >= 53) {
+    lbig *t = lbig_mul(q.n, p);
+    lbig_release(q.n);
+    q.n = t;
+  } else {
+    lbig_release(q.d);
+    q.d = p;
+    p = NULL;
   }
-  lval_del(a);
-  return x;
+  lbig_release(two);
+  if (p) { lbig_release(p); }
+  return q;
 }
 
-lval *builtin_lambda(lenv *e, lval *a) {
-  LASSERT_NUM("lambda", a, 2);
-  LASSERT_TYPE("lambda", a, 0, LVAL_QEXP);
-  LASSERT_TYPE("lambda", a, 1, LVAL_QEXP);
-  for (int i = 0; i < a->value.cell[0]->count; i++) {
-    LASSERT(a, (a->value.cell[0]->value.cell[i]->type == LVAL_SYM), "Cannot define non-symbol. Got %s, Expected %s.",
-	    ltype_name(a->value.cell[0]->value.cell[i]->type), ltype_name(LVAL_SYM));
+/* x must be a finite number. */
+lq lq_of(lval *x) {
+  lq q;
+  switch (x->type) {
+  case LVAL_LONG: q.n = lbig_from_long(x->value.l); q.d = lbig_from_long(1); break;
+  case LVAL_DOUBLE: return lq_of_double(x->value.d);
+  case LVAL_BIGNUM: q.n = x->value.big; q.n->refs++; q.d = lbig_from_long(1); break;
+  default:
+    q.n = x->value.rat->num;
+    q.d = x->value.rat->den;
+    q.n->refs++;
+    q.d->refs++;
   }
-  lval *formals = lval_pop(a, 0);
-  lval *body = lval_pop(a, 0);
-  lval_del(a);
+  return q;
+}
 
-  return lval_lambda(formals, body);
+void lq_free(lq q) {
+  lbig_release(q.n);
+  lbig_release(q.d);
 }
 
-lval *lval_booln(long x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_BOOL;
-  v->value.l = x;
+/* Reduces a fresh pair to lowest terms with a positive denominator. */
+lq lq_reduce(lq q) {
+  if (q.d->neg) {
+    q.n->neg = !q.n->neg && q.n->len;
+    q.d->neg = 0;
+  }
+  if (q.d->len == 1 && q.d->d[0] == 1) { return q; }
+  lbig *g = lbig_gcd(q.n, q.d);
+  if (g->len != 1 || g->d[0] != 1) {
+    lbig *x, *r;
+    lbig_divmod(q.n, g, &x, &r);
+    lbig_release(r);
+    lbig_release(q.n);
+    q.n = x;
+    lbig_divmod(q.d, g, &x, &r);
+    lbig_release(r);
+    lbig_release(q.d);
+    q.d = x;
+  }
+  lbig_release(g);
+  return q;
+}
+
+/* Demotes a reduced pair to the narrowest type that holds it exactly. */
+lval *lval_exact(lq q) {
+  if (q.d->len == 1 && q.d->d[0] == 1) {
+    lbig_release(q.d);
+    if (!lbig_fits(q.n)) { return lval_big(q.n); }
+    long l = lbig_long(q.n);
+    lbig_release(q.n);
+    return lval_long(l);
+  }
+  lval *v = lval_new(LVAL_RATIO);
+  v->value.rat = malloc(sizeof(lrat));
+  v->value.rat->refs = 1;
+  v->value.rat->num = q.n;
+  v->value.rat->den = q.d;
   return v;
 }
-  
-enum {GT, GE, EQ, NE, LT, LE};
 
-lval *builtin_comp(lval *x, lval *y, int func) {
-  if (x->type != y->type) { return lval_booln(0); }
-  if (x->type == LVAL_LONG) {
-    switch (func) {
-    case GT:
-      return lval_booln(x->value.l > y->value.l);
-    case GE:
-      return lval_booln(x->value.l >= y->value.l);
-    case EQ:
-      return lval_booln(x->value.l == y->value.l);
-    case NE:
-      return lval_booln(x->value.l != y->value.l);
-    case LT:
-      return lval_booln(x->value.l < y->value.l);
-    case LE:
-      return lval_booln(x->value.l <= y->value.l);
+/* Position in the numeric tower, or -1 for non-numbers. */
+int lnum_rank(int t) {
+  switch (t) {
+  case LVAL_LONG: return 0;
+  case LVAL_BIGNUM: return 1;
+  case LVAL_RATIO: return 2;
+  case LVAL_DOUBLE: return 3;
+  }
+  return -1;
+}
+
+double lnum_double(lval *x) {
+  switch (x->type) {
+  case LVAL_LONG: return x->value.l;
+  case LVAL_DOUBLE: return x->value.d;
+  case LVAL_BIGNUM: return lbig_double(x->value.big);
+  }
+  return lbig_double(x->value.rat->num) / lbig_double(x->value.rat->den);
+}
+
+/* Orders two numbers of any types exactly: -1, 0 or 1, or 2 when a NaN
+   leaves them unordered. */
+int lnum_cmp(lval *x, lval *y) {
+  if ((x->type == LVAL_DOUBLE && !isfinite(x->value.d)) ||
+      (y->type == LVAL_DOUBLE && !isfinite(y->value.d)) ||
+      (x->type == LVAL_LONG && y->type == LVAL_DOUBLE && labs(x->value.l) <= 1L << 53) ||
+      (y->type == LVAL_LONG && x->type == LVAL_DOUBLE && labs(y->value.l) <= 1L << 53)) {
+    double a = lnum_double(x), b = lnum_double(y);
+    if (isnan(a) || isnan(b)) { return 2; }
+    return (a > b) - (a < b);
+  }
+  lq a = lq_of(x), b = lq_of(y);
+  lbig *l = lbig_mul(a.n, b.d), *r = lbig_mul(b.n, a.d);
+  int o = lbig_cmp(l, r);
+  lbig_release(l);
+  lbig_release(r);
+  lq_free(a);
+  lq_free(b);
+  return o;
+}
+
+lval *lval_str(char *s) {
+  return lval_text(LVAL_STR, s, strlen(s));
+}
+
+void lval_del(lval *v) {
+  if (LVAL_FIXED(v)) { return; }
+  switch (v->type) {
+  case LVAL_BOOL:
+  case LVAL_LONG:
+  case LVAL_FORM:
+  case LVAL_DOUBLE: break;
+  case LVAL_QEXP:
+  case LVAL_SEXP:
+  case LVAL_RECUR:
+    if (v->value.cell != v->cells && --LCELLS(v->value.cell)->refs) { break; }
+    for (int i = 0; i < v->count; i++) {
+      lval_del(v->value.cell[i]);
+    }
+    if (v->value.cell != v->cells) {
+      lintern_drop(LCELLS(v->value.cell));
+      free(LCELLS(v->value.cell));
+    }
+    break;
+  case LVAL_FUN:
+    if (!v->value.builtin) {
+      lenv_del(v->env);
+      lval_del(v->formals);
+      lval_del(v->body);
+      lir_release(v->ir);
+    } else {
+      lrtype_release(v->rtype);
+    }
+    break;
+  case LVAL_RECORD:
+    if (--v->value.rec->refs == 0) {
+      for (int i = 0; i < v->value.rec->type->count; i++) {
+	lval_del(v->value.rec->slots[i]);
+      }
+      lrtype_release(v->value.rec->type);
+      free(v->value.rec);
+    }
+    break;
+  case LVAL_VECTOR:
+    if (--v->value.vec->refs == 0) {
+      for (int i = 0; i < v->value.vec->count; i++) {
+	lval_del(v->value.vec->items[i]);
+      }
+      free(v->value.vec->items);
+      free(v->value.vec);
+    }
+    break;
+  case LVAL_ARRAY:
+    if (--v->value.arr->refs == 0) {
+      free(v->value.arr->data.d);
+      free(v->value.arr);
+    }
+    break;
+  case LVAL_TABLE:
+    if (--v->value.tab->refs == 0) {
+      for (int i = 0; i < v->value.tab->ncols; i++) {
+	free(v->value.tab->names[i]);
+	lval_del(v->value.tab->cols[i]);
+      }
+      free(v->value.tab->names);
+      free(v->value.tab->cols);
+      free(v->value.tab);
+    }
+    break;
+  case LVAL_MATRIX:
+    if (--v->value.mat->refs == 0) {
+      free(v->value.mat->d);
+      free(v->value.mat);
+    }
+    break;
+  case LVAL_MAP:
+  case LVAL_SET: lhamt_release(v->value.map); break;
+  case LVAL_PQUEUE: lpq_release(v->value.pq); break;
+  case LVAL_SEQ: lseq_release(v->value.seq); break;
+  case LVAL_XFORM: lxf_release(v->value.xf); break;
+  case LVAL_BIGNUM: lbig_release(v->value.big); break;
+  case LVAL_RATIO:
+    if (--v->value.rat->refs == 0) {
+      lbig_release(v->value.rat->num);
+      lbig_release(v->value.rat->den);
+      free(v->value.rat);
+    }
+    break;
+  case LVAL_BITSET:
+    if (--v->value.bits->refs == 0) {
+      free(v->value.bits->w);
+      free(v->value.bits);
     }
+    break;
   }
-  if (x->type == LVAL_DOUBLE) {
-    switch (func) {
-    case GT:
-      return lval_booln(x->value.d > y->value.d);
-    case GE:
-      return lval_booln(x->value.d >= y->value.d);
-    case EQ:
-      return lval_booln(x->value.d == y->value.d);
-    case NE:
-      return lval_booln(x->value.d != y->value.d);
-    case LT:
-      return lval_booln(x->value.d < y->value.d);
-    case LE:
-      return lval_booln(x->value.d <= y->value.d);
+  lval_free(v, lval_bytes(v));
+}
+
+void lval_print_str(lval *v) {
+  char *escaped = malloc(v->count + 1);
+  memcpy(escaped, v->value.str, v->count + 1);
+  escaped = mpcf_escape(escaped);
+  printf("\"%s\"", escaped);
+  free(escaped);
+}
+
+void lval_expr_print(lval *v, char open, char close) {
+  putchar(open);
+  for (int i = 0; i < v->count; i++) {
+    lval_print(v->value.cell[i]);
+    if (i != (v->count-1)) {
+      putchar(' ');
+    }
+  }
+  putchar(close);
+}
+
+void lval_print(lval *v) {
+  switch (v->type) {
+  case LVAL_STR:   lval_print_str(v); break;
+  case LVAL_BOOL:
+    if (v->value.l) {
+      printf("#true");
+    } else {
+      printf("#false");
+    }
+    break;
+  case LVAL_LONG:   printf("%li", v->value.l); break;
+  case LVAL_DOUBLE: printf("%f", v->value.d); break;
+  case LVAL_ERR:   printf("Error: %s", v->value.err); break;
+  case LVAL_SYM:   printf("%s", v->value.sym); break;
+  case LVAL_SEXP: lval_expr_print(v, '(', ')'); break;
+  case LVAL_QEXP: lval_expr_print(v, '{', '}'); break;
+  case LVAL_RECUR: printf("<recur>"); break;
+  case LVAL_VECTOR:
+    putchar('[');
+    for (int i = 0; i < v->value.vec->count; i++) {
+      lval_print(v->value.vec->items[i]);
+      if (i != (v->value.vec->count-1)) { putchar(' '); }
+    }
+    putchar(']');
+    break;
+  case LVAL_ARRAY:
+    printf(v->value.arr->kind == ARR_F64 ? "#f64[" : "#i64[");
+    for (long i = 0; i < v->value.arr->count; i++) {
+      if (v->value.arr->kind == ARR_F64) {
+	printf("%f", v->value.arr->data.d[i]);
+      } else {
+	printf("%li", v->value.arr->data.l[i]);
+      }
+      if (i != (v->value.arr->count-1)) { putchar(' '); }
+    }
+    putchar(']');
+    break;
+  case LVAL_TABLE:
+    printf("#table[%li]{", v->value.tab->nrows);
+    for (int i = 0; i < v->value.tab->ncols; i++) {
+      printf(i ? " %s" : "%s", v->value.tab->names[i]);
+    }
+    putchar('}');
+    break;
+  case LVAL_MATRIX:
+    printf("#mat{");
+    for (long i = 0; i < v->value.mat->rows; i++) {
+      putchar('{');
+      for (long j = 0; j < v->value.mat->cols; j++) {
+	printf(j ? " %f" : "%f", v->value.mat->d[i * v->value.mat->cols + j]);
+      }
+      putchar('}');
+      if (i != v->value.mat->rows-1) { putchar(' '); }
+    }
+    putchar('}');
+    break;
+  case LVAL_MAP:
+  case LVAL_SET: {
+    int first = 1;
+    printf(v->type == LVAL_MAP ? "#map{" : "#set{");
+    lhamt_print(v->value.map, &first);
+    putchar('}');
+    break;
+  }
+  case LVAL_PQUEUE: printf("#pq[%li]", v->value.pq->count); break;
+  case LVAL_SEQ: printf("<lazy sequence>"); break;
+  case LVAL_XFORM: printf("<transducer>"); break;
+  case LVAL_BIGNUM: lbig_print(v->value.big); break;
+  case LVAL_RATIO:
+    lbig_print(v->value.rat->num);
+    putchar('/');
+    lbig_print(v->value.rat->den);
+    break;
+  case LVAL_BITSET: {
+    int first = 1;
+    printf("#bits[%li]{", v->value.bits->count);
+    for (long i = 0; i < v->value.bits->count; i++) {
+      if (v->value.bits->w[i / 64] >> (i % 64) & 1) {
+	printf(first ? "%li" : " %li", i);
+	first = 0;
+      }
+    }
+    putchar('}');
+    break;
+  }
+  case LVAL_RECORD:
+    printf("#%s{", v->value.rec->type->name);
+    for (int i = 0; i < v->value.rec->type->count; i++) {
+      if (i) { putchar(' '); }
+      lval_print(v->value.rec->slots[i]);
+    }
+    putchar('}');
+    break;
+  case LVAL_FORM: printf("<special form>"); break;
+  case LVAL_FUN:
+    if (v->value.builtin) {
+      printf("<builtin>");
+    } else {
+      printf("(lambda "); lval_print(v->formals);
+      putchar(' '); lval_print(v->body); putchar(')');
+    }
+    break;
+  }
+}
+
+void lval_println(lval *v) { lval_print(v); putchar('\n'); }
+
+lval *lval_copy(lval *v) {
+  if (LVAL_FIXED(v)) { return v; }
+  if (v->type == LVAL_STR || v->type == LVAL_SYM || v->type == LVAL_ERR) {
+    return lval_text(v->type, v->value.str, v->count);
+  }
+  lval *x = lval_new(v->type);
+  switch (v->type) {
+  case LVAL_BOOL:
+  case LVAL_LONG: x->value.l = v->value.l; break;
+  case LVAL_DOUBLE: x->value.d = v->value.d; break;
+  case LVAL_FORM: x->value.builtin = v->value.builtin; break;
+  case LVAL_VECTOR: x->value.vec = v->value.vec; x->value.vec->refs++; break;
+  case LVAL_ARRAY: x->value.arr = v->value.arr; x->value.arr->refs++; break;
+  case LVAL_TABLE: x->value.tab = v->value.tab; x->value.tab->refs++; break;
+  case LVAL_MATRIX: x->value.mat = v->value.mat; x->value.mat->refs++; break;
+  case LVAL_RECORD: x->value.rec = v->value.rec; x->value.rec->refs++; break;
+  case LVAL_PQUEUE: x->value.pq = v->value.pq; x->value.pq->refs++; break;
+  case LVAL_SEQ: x->value.seq = v->value.seq; x->value.seq->refs++; break;
+  case LVAL_XFORM: x->value.xf = v->value.xf; x->value.xf->refs++; break;
+  case LVAL_BIGNUM: x->value.big = v->value.big; x->value.big->refs++; break;
+  case LVAL_RATIO: x->value.rat = v->value.rat; x->value.rat->refs++; break;
+  case LVAL_BITSET: x->value.bits = v->value.bits; x->value.bits->refs++; break;
+  case LVAL_MAP:
+  case LVAL_SET:
+    x->count = v->count;
+    x->value.map = v->value.map;
+    if (x->value.map) { x->value.map->refs++; }
+    break;
+  case LVAL_SEXP:
+  case LVAL_QEXP:
+  case LVAL_RECUR:
+    x->count = v->count;
+    x->hash = v->hash;
+    if (v->value.cell != v->cells) {
+      x->value.cell = v->value.cell;
+      LCELLS(x->value.cell)->refs++;
+      break;
+    }
+    x->value.cell = x->cells;
+    for (int i = 0; i < x->count; i++) {
+      x->value.cell[i] = lval_copy(v->value.cell[i]);
+    }
+    break;
+  case LVAL_FUN:
+    if (v->value.builtin) {
+      x->value.builtin = v->value.builtin;
+      x->ir = NULL;
+      x->count = v->count;
+      x->rtype = v->rtype;
+      if (x->rtype) { x->rtype->refs++; }
+    } else {
+      x->value.builtin = NULL;
+      x->env = lenv_copy(v->env);
+      x->formals = lval_copy(v->formals);
+      x->body = lval_copy(v->body);
+      x->ir = v->ir;
+      x->ir->refs++;
+    }
+    break;
+  }
+  return x;
+}
+
+lval **lcells_new(int cap) {
+  lcells *b = malloc(sizeof(lcells) + sizeof(lval*) * cap);
+  b->refs = 1;
+  b->cap = cap;
+  b->hash = 0;
+  return b->items;
+}
+
+/* Makes v's cells its own, with room for at least n. */
+void lval_reserve(lval *v, int n) {
+  if (v->value.cell == v->cells) {
+    if (n <= LVAL_CELLS) { return; }
+    lval **c = lcells_new(n > 2 * LVAL_CELLS ? n : 2 * LVAL_CELLS);
+    memcpy(c, v->cells, sizeof(lval*) * v->count);
+    v->value.cell = c;
+    return;
+  }
+  lcells *b = LCELLS(v->value.cell);
+  if (b->refs > 1) {
+    lval **c = lcells_new(n > v->count ? n : v->count);
+    for (int i = 0; i < v->count; i++) { c[i] = lval_copy(v->value.cell[i]); }
+    b->refs--;
+    v->value.cell = c;
+    return;
+  }
+  lintern_drop(b);
+  if (n > b->cap) {
+    int cap = n > 2 * b->cap ? n : 2 * b->cap;
+    b = realloc(b, sizeof(lcells) + sizeof(lval*) * cap);
+    b->cap = cap;
+    v->value.cell = b->items;
+  }
+}
+
+lval *lval_add(lval *v, lval *x) {
+  if (LVAL_FIXED(v)) { v = v->type == LVAL_SEXP ? lval_sexp() : lval_qexp(); }
+  v->hash = 0;
+  lval_reserve(v, v->count + 1);
+  v->value.cell[v->count++] = x;
+  return v;
+}
+
+lval *lval_read_long(mpc_ast_t *t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ?
+    lval_long(x) : lval_big(lbig_parse(t->contents));
+}
+
+lval *lval_read_double(mpc_ast_t *t) {
+  errno = 0;
+  double x = strtod(t->contents, NULL);
+  return errno != ERANGE ?
+    lval_double(x) : lval_err("invalid number");
+}
+
+lval *lval_read_str(mpc_ast_t *t) {
+  int n = strlen(t->contents) - 2;
+  char *unescaped = malloc(n + 1);
+  memcpy(unescaped, t->contents + 1, n);
+  unescaped[n] = '\0';
+  unescaped = mpcf_unescape(unescaped);
+  lval *str = lval_str(unescaped);
+  free(unescaped);
+  return str;
+}
+
+lval *lval_read(mpc_ast_t *t) {
+  if (strstr(t->tag, "boolean")) { return lval_bool(t->contents); }
+  if (strstr(t->tag, "string")) { return lval_read_str(t); }
+  if (strstr(t->tag, "double")) { return lval_read_double(t); }
+  if (strstr(t->tag, "long")) { return lval_read_long(t); }
+  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  lval *x = NULL;
+  if (strcmp(t->tag, ">") == 0) { x = lval_sexp(); }
+  if (strstr(t->tag, "sexp"))  { x = lval_sexp(); }
+  if (strstr(t->tag, "qexp"))  { x = lval_qexp(); }
+  for (int i = 0; i < t->children_num; i++) {
+    if (strstr(t->children[i]->tag, "comment")) { continue; }
+    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
+    x = lval_add(x, lval_read(t->children[i]));
+  }
+  if (x->count == 0 && strcmp(t->tag, ">") != 0) {
+    lval_del(x);
+    return &lval_fixed[strstr(t->tag, "sexp") ? LFIX_SEXP : LFIX_QEXP];
+  }
+  return x;
+}
+
+lval *lval_pop(lval *v, int i) {
+  lval_reserve(v, 0);
+  lval *x = v->value.cell[i];
+  memmove(&v->value.cell[i], &v->value.cell[i+1],
+    sizeof(lval*) * (v->count-i-1));
+  v->hash = 0;
+  v->count--;
+  return x;
+}
+
+lval *lval_take(lval *v, int i) {
+  lval *x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+}
+
+char *ltype_name(int t) {
+  switch(t) {
+  case LVAL_STR: return "String";
+  case LVAL_BOOL: return "Boolean";
+  case LVAL_FUN: return "Function";
+  case LVAL_FORM: return "Special Form";
+  case LVAL_LONG: return "Long";
+  case LVAL_DOUBLE: return "Double";
+  case LVAL_ERR: return "Error";
+  case LVAL_SYM: return "Symbol";
+  case LVAL_SEXP: return "S-Expression";
+  case LVAL_QEXP: return "Q-Expression";
+  case LVAL_RECUR: return "Recur";
+  case LVAL_VECTOR: return "Vector";
+  case LVAL_ARRAY: return "Array";
+  case LVAL_TABLE: return "Table";
+  case LVAL_MATRIX: return "Matrix";
+  case LVAL_MAP: return "Map";
+  case LVAL_SET: return "Set";
+  case LVAL_RECORD: return "Record";
+  case LVAL_PQUEUE: return "Priority Queue";
+  case LVAL_BITSET: return "Bitset";
+  case LVAL_SEQ: return "Lazy Sequence";
+  case LVAL_XFORM: return "Transducer";
+  case LVAL_BIGNUM: return "Bignum";
+  case LVAL_RATIO: return "Ratio";
+  default: return "Unknown";
+  }
+}
+
+lval *builtin_head(lenv *e, lval *a) {
+  LASSERT_NUM("head", a, 1);
+  LASSERT_TYPE("head", a, 0, LVAL_QEXP);
+  LASSERT_NOT_EMPTY("head", a, 0);
+  lval *v = lval_take(a, 0);
+  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+  return v;
+}
+
+lval *builtin_tail(lenv *e, lval *a) {
+  LASSERT_NUM("tail", a, 1);
+  LASSERT_TYPE("tail", a, 0, LVAL_QEXP);
+  LASSERT_NOT_EMPTY("tail", a, 0);
+  lval *v = lval_take(a, 0);
+  lval_del(lval_pop(v, 0));
+  return v;
+}
+
+lval *builtin_list(lenv *e, lval *a) {
+  a->type = LVAL_QEXP;
+  a->hash = 0;
+  return a;
+}
+
+lval *builtin_eval(lenv *e, lval *a) {
+  LASSERT_NUM("eval", a, 1);
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXP);
+  lval *x = lval_unquote(lval_take(a, 0));
+  return lval_eval(e, x);
+}
+
+lval *lval_join(lval *x, lval *y) {
+  while (y->count) {
+    x = lval_add(x, lval_pop(y, 0));
+  }
+  lval_del(y);
+  return x;
+}
+
+lval *builtin_join(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("join", a, i, LVAL_QEXP);
+  }
+  lval *x = lval_pop(a, 0);
+  while (a->count) {
+    x = lval_join(x, lval_pop(a, 0));
+  }
+  lval_del(a);
+  return x;
+}
+
+void lval_vec_push(lvec *v, lval *x) {
+  if (v->count == v->cap) {
+    v->cap = v->cap ? v->cap * 2 : 8;
+    v->items = realloc(v->items, sizeof(lval*) * v->cap);
+  }
+  v->items[v->count++] = x;
+}
+
+lval *builtin_vec(lenv *e, lval *a) {
+  lval *v = lval_vec();
+  lval_reserve(a, 0);
+  for (int i = 0; i < a->count; i++) { lval_vec_push(v->value.vec, a->value.cell[i]); }
+  a->count = 0;
+  lval_del(a);
+  return v;
+}
+
+/* (vec) on its own evaluates to the builtin, so sized and empty
+   vectors are made here. */
+lval *builtin_make_vec(lenv *e, lval *a) {
+  LASSERT_NUM("make-vec", a, 2);
+  LASSERT_TYPE("make-vec", a, 0, LVAL_LONG);
+  LASSERT(a, a->value.cell[0]->value.l >= 0,
+    "Function 'make-vec' passed negative length %li.", a->value.cell[0]->value.l);
+  long n = a->value.cell[0]->value.l;
+  lval *v = lval_vec();
+  v->value.vec->cap = n;
+  v->value.vec->items = malloc(sizeof(lval*) * n);
+  for (long i = 0; i < n; i++) { lval_vec_push(v->value.vec, lval_copy(a->value.cell[1])); }
+  lval_del(a);
+  return v;
+}
+
+#define LASSERT_INDEX(func, args, vec, index) \
+  LASSERT(args, index >= 0 && index < vec->count, \
+    "Function '%s' passed index %li out of range for length %li.", \
+    func, index, (long)vec->count)
+
+lval *builtin_vec_ref(lenv *e, lval *a) {
+  LASSERT_NUM("vec-ref", a, 2);
+  LASSERT_TYPE("vec-ref", a, 0, LVAL_VECTOR);
+  LASSERT_TYPE("vec-ref", a, 1, LVAL_LONG);
+  lvec *v = a->value.cell[0]->value.vec;
+  long i = a->value.cell[1]->value.l;
+  LASSERT_INDEX("vec-ref", a, v, i);
+  lval *x = lval_copy(v->items[i]);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_vec_set(lenv *e, lval *a) {
+  LASSERT_NUM("vec-set!", a, 3);
+  LASSERT_TYPE("vec-set!", a, 0, LVAL_VECTOR);
+  LASSERT_TYPE("vec-set!", a, 1, LVAL_LONG);
+  lvec *v = a->value.cell[0]->value.vec;
+  long i = a->value.cell[1]->value.l;
+  LASSERT_INDEX("vec-set!", a, v, i);
+  lval_del(v->items[i]);
+  v->items[i] = lval_pop(a, 2);
+  return lval_take(a, 0);
+}
+
+lval *builtin_vec_push(lenv *e, lval *a) {
+  LASSERT_NUM("vec-push!", a, 2);
+  LASSERT_TYPE("vec-push!", a, 0, LVAL_VECTOR);
+  lval_vec_push(a->value.cell[0]->value.vec, lval_pop(a, 1));
+  return lval_take(a, 0);
+}
+
+lval *builtin_vec_len(lenv *e, lval *a) {
+  LASSERT_NUM("vec-len", a, 1);
+  LASSERT_TYPE("vec-len", a, 0, LVAL_VECTOR);
+  lval *x = lval_long(a->value.cell[0]->value.vec->count);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_vec_to_list(lenv *e, lval *a) {
+  LASSERT_NUM("vec->list", a, 1);
+  LASSERT_TYPE("vec->list", a, 0, LVAL_VECTOR);
+  lvec *v = a->value.cell[0]->value.vec;
+  lval *x = lval_qexp();
+  lval_reserve(x, v->count);
+  x->count = v->count;
+  for (int i = 0; i < v->count; i++) { x->value.cell[i] = lval_copy(v->items[i]); }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_lambda(lenv *e, lval *a) {
+  LASSERT_NUM("lambda", a, 2);
+  LASSERT_TYPE("lambda", a, 0, LVAL_QEXP);
+  LASSERT_TYPE("lambda", a, 1, LVAL_QEXP);
+  for (int i = 0; i < a->value.cell[0]->count; i++) {
+    LASSERT(a, (a->value.cell[0]->value.cell[i]->type == LVAL_SYM), "Cannot define non-symbol. Got %s, Expected %s.",
+	    ltype_name(a->value.cell[0]->value.cell[i]->type), ltype_name(LVAL_SYM));
+  }
+  lval *formals = lval_pop(a, 0);
+  lval *body = lval_pop(a, 0);
+  lval_del(a);
+  lval_freeze(formals);
+  lval_freeze(body);
+
+  return lval_lambda(formals, body);
+}
+
+lval *lval_booln(long x) {
+  return &lval_fixed[x ? LFIX_TRUE : LFIX_FALSE];
+}
+  
+enum {GT, GE, EQ, NE, LT, LE};
+
+int lenv_eq(lenv *x, lenv *y);
+
+/* Structural equality. Values of different types are never equal, and
+   shared storage or a cached hash mismatch settles most cases early. */
+/* Numbers of different types are equal when = says so, as in
+   (= 1 1.0); lval_hash follows. */
+int lval_eq(lval *x, lval *y) {
+  if (x == y) { return 1; }
+  if (x->type != y->type) {
+    return lnum_rank(x->type) >= 0 && lnum_rank(y->type) >= 0 && lnum_cmp(x, y) == 0;
+  }
+  switch (x->type) {
+  case LVAL_BOOL:
+  case LVAL_LONG: return x->value.l == y->value.l;
+  case LVAL_DOUBLE: return x->value.d == y->value.d;
+  case LVAL_STR:
+  case LVAL_SYM:
+  case LVAL_ERR: return x->count == y->count && memcmp(x->value.str, y->value.str, x->count) == 0;
+  case LVAL_FORM: return x->value.builtin == y->value.builtin;
+  case LVAL_FUN:
+    if (x->value.builtin || y->value.builtin) {
+      return x->value.builtin == y->value.builtin && x->rtype == y->rtype && x->count == y->count;
+    }
+    return (x->body == y->body || lval_eq(x->body, y->body)) &&
+      lval_eq(x->formals, y->formals) && lenv_eq(x->env, y->env);
+  case LVAL_SEXP:
+  case LVAL_QEXP:
+  case LVAL_RECUR:
+    if (x->count != y->count) { return 0; }
+    if (x->hash && y->hash && x->hash != y->hash) { return 0; }
+    if (x->value.cell == y->value.cell) { return 1; }
+    for (int i = 0; i < x->count; i++) {
+      if (!lval_eq(x->value.cell[i], y->value.cell[i])) { return 0; }
+    }
+    return 1;
+  case LVAL_VECTOR:
+    if (x->value.vec == y->value.vec) { return 1; }
+    if (x->value.vec->count != y->value.vec->count) { return 0; }
+    for (int i = 0; i < x->value.vec->count; i++) {
+      if (!lval_eq(x->value.vec->items[i], y->value.vec->items[i])) { return 0; }
+    }
+    return 1;
+  case LVAL_ARRAY:
+    if (x->value.arr == y->value.arr) { return 1; }
+    if (x->value.arr->kind != y->value.arr->kind || x->value.arr->count != y->value.arr->count) { return 0; }
+    for (long i = 0; i < x->value.arr->count; i++) {
+      if (x->value.arr->kind == ARR_F64 ? x->value.arr->data.d[i] != y->value.arr->data.d[i]
+	  : x->value.arr->data.l[i] != y->value.arr->data.l[i]) { return 0; }
+    }
+    return 1;
+  case LVAL_MATRIX:
+    if (x->value.mat == y->value.mat) { return 1; }
+    if (x->value.mat->rows != y->value.mat->rows || x->value.mat->cols != y->value.mat->cols) { return 0; }
+    for (long i = 0; i < x->value.mat->rows * x->value.mat->cols; i++) {
+      if (x->value.mat->d[i] != y->value.mat->d[i]) { return 0; }
+    }
+    return 1;
+  case LVAL_TABLE:
+    if (x->value.tab == y->value.tab) { return 1; }
+    if (x->value.tab->ncols != y->value.tab->ncols) { return 0; }
+    for (int i = 0; i < x->value.tab->ncols; i++) {
+      if (strcmp(x->value.tab->names[i], y->value.tab->names[i]) != 0 ||
+	  !lval_eq(x->value.tab->cols[i], y->value.tab->cols[i])) { return 0; }
+    }
+    return 1;
+  case LVAL_MAP:
+  case LVAL_SET:
+    if (x->value.map == y->value.map) { return 1; }
+    return x->count == y->count && lhamt_within(x->value.map, y->value.map);
+  case LVAL_PQUEUE: return x->value.pq == y->value.pq;
+  case LVAL_SEQ: return x->value.seq == y->value.seq;
+  case LVAL_XFORM: return x->value.xf == y->value.xf;
+  case LVAL_BIGNUM: return lbig_cmp(x->value.big, y->value.big) == 0;
+  case LVAL_RATIO:
+    return lbig_cmp(x->value.rat->num, y->value.rat->num) == 0 &&
+      lbig_cmp(x->value.rat->den, y->value.rat->den) == 0;
+  case LVAL_BITSET:
+    if (x->value.bits == y->value.bits) { return 1; }
+    return x->value.bits->count == y->value.bits->count &&
+      memcmp(x->value.bits->w, y->value.bits->w, sizeof(unsigned long) * x->value.bits->words) == 0;
+  case LVAL_RECORD:
+    if (x->value.rec == y->value.rec) { return 1; }
+    if (x->value.rec->type != y->value.rec->type) { return 0; }
+    for (int i = 0; i < x->value.rec->type->count; i++) {
+      if (!lval_eq(x->value.rec->slots[i], y->value.rec->slots[i])) { return 0; }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/* Closures compare their captured (partially applied) bindings too. */
+int lenv_eq(lenv *x, lenv *y) {
+  if (x->count != y->count) { return 0; }
+  for (int i = 0; i < x->count; i++) {
+    if (strcmp(x->syms[i], y->syms[i]) != 0 || !lval_eq(x->vals[i], y->vals[i])) { return 0; }
+  }
+  return 1;
+}
+
+unsigned long lhash_mix(unsigned long h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  return h;
+}
+
+unsigned long lhash_str(char *s) {
+  unsigned long h = 14695981039346656037UL;
+  for (; *s; s++) { h = (h ^ (unsigned char)*s) * 1099511628211UL; }
+  return h;
+}
+
+unsigned long lhash_double(double d) {
+  unsigned long h;
+  if (d == 0) { d = 0; }
+  if (isnan(d)) { d = NAN; }
+  memcpy(&h, &d, sizeof(h));
+  return lhash_mix(h);
+}
+
+/* Numbers hash by value under one tag: integral values as the long
+   they equal, the rest by their nearest double, which is exact
+   whenever some double equals them. */
+unsigned long lhash_num(lval *v) {
+  unsigned long h = lhash_mix(LVAL_LONG + 1);
+  if (v->type == LVAL_LONG) { return h ^ lhash_mix(v->value.l); }
+  double d = lnum_double(v);
+  if (d >= -0x1p63 && d < 0x1p63 && d == (long)d) { return h ^ lhash_mix((long)d); }
+  return h ^ lhash_double(d);
+}
+
+/* Hashes agree with lval_eq. Lists cache theirs until lval_add or
+   lval_pop next changes them; mutable containers are rehashed. */
+unsigned long lval_hash(lval *v) {
+  unsigned long h = lhash_mix(v->type + 1);
+  switch (v->type) {
+  case LVAL_BOOL: return h ^ lhash_mix(v->value.l);
+  case LVAL_LONG:
+  case LVAL_DOUBLE:
+  case LVAL_BIGNUM:
+  case LVAL_RATIO: return lhash_num(v);
+  case LVAL_STR: return h ^ lhash_str(v->value.str);
+  case LVAL_SYM: return h ^ lhash_str(v->value.sym);
+  case LVAL_ERR: return h ^ lhash_str(v->value.err);
+  case LVAL_FORM: return h ^ lhash_mix((unsigned long)v->value.builtin);
+  case LVAL_FUN:
+    if (v->value.builtin) {
+      return h ^ lhash_mix((unsigned long)v->value.builtin ^ (unsigned long)v->rtype ^ v->count);
+    }
+    return h ^ (lval_hash(v->formals) * 31 + lval_hash(v->body));
+  case LVAL_SEXP:
+  case LVAL_QEXP:
+  case LVAL_RECUR:
+    if (v->hash) { return v->hash; }
+    for (int i = 0; i < v->count; i++) { h = h * 31 + lval_hash(v->value.cell[i]); }
+    v->hash = h ? h : 1;
+    return v->hash;
+  case LVAL_VECTOR:
+    for (int i = 0; i < v->value.vec->count; i++) { h = h * 31 + lval_hash(v->value.vec->items[i]); }
+    return h;
+  case LVAL_ARRAY:
+    for (long i = 0; i < v->value.arr->count; i++) {
+      h = h * 31 + (v->value.arr->kind == ARR_F64 ? lhash_double(v->value.arr->data.d[i])
+		    : lhash_mix(v->value.arr->data.l[i]));
+    }
+    return h;
+  case LVAL_MATRIX:
+    h ^= lhash_mix(v->value.mat->rows);
+    for (long i = 0; i < v->value.mat->rows * v->value.mat->cols; i++) {
+      h = h * 31 + lhash_double(v->value.mat->d[i]);
+    }
+    return h;
+  case LVAL_TABLE:
+    for (int i = 0; i < v->value.tab->ncols; i++) {
+      h = h * 31 + (lhash_str(v->value.tab->names[i]) ^ lval_hash(v->value.tab->cols[i]));
+    }
+    return h;
+  case LVAL_MAP:
+  case LVAL_SET: return h ^ lhash_mix(lhamt_hash(v->value.map));
+  case LVAL_PQUEUE: return h ^ lhash_mix((unsigned long)v->value.pq);
+  case LVAL_SEQ: return h ^ lhash_mix((unsigned long)v->value.seq);
+  case LVAL_XFORM: return h ^ lhash_mix((unsigned long)v->value.xf);
+  case LVAL_BITSET:
+    h ^= lhash_mix(v->value.bits->count);
+    for (long i = 0; i < v->value.bits->words; i++) { h = h * 31 + lhash_mix(v->value.bits->w[i]); }
+    return h;
+  case LVAL_RECORD:
+    h ^= lhash_str(v->value.rec->type->name);
+    for (int i = 0; i < v->value.rec->type->count; i++) { h = h * 31 + lval_hash(v->value.rec->slots[i]); }
+    return h;
+  }
+  return h;
+}
+
+/* Frozen code is hash-consed: lval_freeze gives each list the single
+   interned block holding the same elements, so equal subtrees share
+   storage and a function body is copied by reference. The table owns
+   no references; a block leaves it when freed or made private. */
+lcells **lintern = NULL;
+size_t lintern_cap = 0;
+size_t lintern_used = 0;
+
+#define LINTERN_GONE ((lcells*)1)
+
+int lcode_list(lval *x) {
+  return (x->type == LVAL_SEXP || x->type == LVAL_QEXP) && x->count;
+}
+
+/* Elements of interned lists match by block; doubles match by bits so
+   that 0.0 and -0.0 stay apart. */
+int lcode_same(lval *x, lval *y) {
+  if (x->type != y->type) { return 0; }
+  if (lcode_list(x)) { return x->count == y->count && x->value.cell == y->value.cell; }
+  if (x->type == LVAL_DOUBLE) { return memcmp(&x->value.d, &y->value.d, sizeof(double)) == 0; }
+  return lval_eq(x, y);
+}
+
+unsigned long lcode_hash(lval *v) {
+  unsigned long h = lhash_mix(v->count);
+  for (int i = 0; i < v->count; i++) {
+    lval *x = v->value.cell[i];
+    h = h * 31 + (lcode_list(x) ? lhash_mix(x->type) ^ LCELLS(x->value.cell)->hash : lval_hash(x));
+  }
+  return h ? h : 1;
+}
+
+void lintern_grow(void) {
+  lcells **old = lintern;
+  size_t n = lintern_cap, live = 0;
+  for (size_t i = 0; i < n; i++) { live += old[i] && old[i] != LINTERN_GONE; }
+  lintern_cap = n < 64 ? 64 : 4 * live >= n ? 2 * n : n;
+  lintern = calloc(lintern_cap, sizeof(lcells*));
+  lintern_used = live;
+  for (size_t i = 0; i < n; i++) {
+    if (!old[i] || old[i] == LINTERN_GONE) { continue; }
+    size_t j = old[i]->hash & (lintern_cap - 1);
+    while (lintern[j]) { j = (j + 1) & (lintern_cap - 1); }
+    lintern[j] = old[i];
+  }
+  free(old);
+}
+
+void lintern_drop(lcells *b) {
+  if (!b->hash) { return; }
+  size_t i = b->hash & (lintern_cap - 1);
+  while (lintern[i] != b) { i = (i + 1) & (lintern_cap - 1); }
+  lintern[i] = LINTERN_GONE;
+  b->hash = 0;
+}
+
+void lval_freeze(lval *v) {
+  if ((v->type != LVAL_SEXP && v->type != LVAL_QEXP) || !v->count) { return; }
+  if (v->value.cell != v->cells && LCELLS(v->value.cell)->hash) { return; }
+  lval_reserve(v, 0);
+  for (int i = 0; i < v->count; i++) { lval_freeze(v->value.cell[i]); }
+  unsigned long h = lcode_hash(v);
+  if (2 * (lintern_used + 1) > lintern_cap) { lintern_grow(); }
+  size_t i = h & (lintern_cap - 1);
+  lcells **slot = NULL;
+  for (; lintern[i]; i = (i + 1) & (lintern_cap - 1)) {
+    lcells *b = lintern[i];
+    if (b == LINTERN_GONE) {
+      if (!slot) { slot = &lintern[i]; }
+      continue;
+    }
+    if (b->hash != h || b->cap != v->count) { continue; }
+    int j = 0;
+    while (j < v->count && lcode_same(b->items[j], v->value.cell[j])) { j++; }
+    if (j < v->count) { continue; }
+    for (j = 0; j < v->count; j++) { lval_del(v->value.cell[j]); }
+    if (v->value.cell != v->cells) { free(LCELLS(v->value.cell)); }
+    b->refs++;
+    v->value.cell = b->items;
+    return;
+  }
+  if (!slot) {
+    slot = &lintern[i];
+    lintern_used++;
+  }
+  lval **c = lcells_new(v->count);
+  memcpy(c, v->value.cell, sizeof(lval*) * v->count);
+  if (v->value.cell != v->cells) { free(LCELLS(v->value.cell)); }
+  v->value.cell = c;
+  LCELLS(c)->hash = h;
+  *slot = LCELLS(c);
+}
+
+/* Numbers of different types compare by value across the tower. */
+lval *builtin_comp(lval *x, lval *y, int func) {
+  int nx = lnum_rank(x->type), ny = lnum_rank(y->type);
+  if (nx >= 0 && ny >= 0 && (nx != ny || nx == 1 || nx == 2)) {
+    int o = lnum_cmp(x, y);
+    switch (func) {
+    case GT: return lval_booln(o == 1);
+    case GE: return lval_booln(o == 1 || o == 0);
+    case EQ: return lval_booln(o == 0);
+    case NE: return lval_booln(o != 0);
+    case LT: return lval_booln(o == -1);
+    case LE: return lval_booln(o == -1 || o == 0);
+    }
+  }
+  if (func == EQ) { return lval_booln(lval_eq(x, y)); }
+  if (func == NE) { return lval_booln(!lval_eq(x, y)); }
+  if (x->type != y->type) { return lval_booln(0); }
+  if (x->type == LVAL_LONG) {
+    switch (func) {
+    case GT:
+      return lval_booln(x->value.l > y->value.l);
+    case GE:
+      return lval_booln(x->value.l >= y->value.l);
+    case LT:
+      return lval_booln(x->value.l < y->value.l);
+    case LE:
+      return lval_booln(x->value.l <= y->value.l);
+    }
+  }
+  if (x->type == LVAL_DOUBLE) {
+    switch (func) {
+    case GT:
+      return lval_booln(x->value.d > y->value.d);
+    case GE:
+      return lval_booln(x->value.d >= y->value.d);
+    case LT:
+      return lval_booln(x->value.d < y->value.d);
+    case LE:
+      return lval_booln(x->value.d <= y->value.d);
+    }
+  }
+  if (x->type == LVAL_STR) {
+    int o = strcmp(x->value.str, y->value.str);
+    switch (func) {
+    case GT:
+      return lval_booln(o > 0);
+    case GE:
+      return lval_booln(o >= 0);
+    case LT:
+      return lval_booln(o < 0);
+    case LE:
+      return lval_booln(o <= 0);
+    }
+  }
+  
+  return lval_err("Type %s is not comparable.", ltype_name(x->type));
+}
+
+lval *builtin_compn(lval *a, int func) {
+  lval *x = builtin_comp(a->value.cell[0], a->value.cell[1], func);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_gt(lenv *e, lval *a) {
+  LASSERT_NUM(">", a, 2);
+  return builtin_compn(a, GT);
+}
+
+lval *builtin_ge(lenv *e, lval *a) {
+  LASSERT_NUM(">=", a, 2);
+  return builtin_compn(a, GE);
+}
+
+lval *builtin_eq(lenv *e, lval *a) {
+  LASSERT_NUM("=", a, 2);
+  return builtin_compn(a, EQ);
+}
+
+lval *builtin_ne(lenv *e, lval *a) {
+  LASSERT_NUM("!", a, 2);
+  return builtin_compn(a, NE);
+}
+
+lval *builtin_lt(lenv *e, lval *a) {
+  LASSERT_NUM("<", a, 2);
+  return builtin_compn(a, LT);
+}
+
+lval *builtin_le(lenv *e, lval *a) {
+  LASSERT_NUM("<=", a, 2);
+  return builtin_compn(a, LE);
+}
+
+/* Number of elements in a collection, or -1 if x is not one. */
+long lval_size(lval *x) {
+  switch (x->type) {
+  case LVAL_SEXP:
+  case LVAL_QEXP:
+  case LVAL_MAP:
+  case LVAL_SET: return x->count;
+  case LVAL_STR: return x->count;
+  case LVAL_VECTOR: return x->value.vec->count;
+  case LVAL_ARRAY: return x->value.arr->count;
+  case LVAL_TABLE: return x->value.tab->nrows;
+  case LVAL_MATRIX: return x->value.mat->rows * x->value.mat->cols;
+  case LVAL_PQUEUE: return x->value.pq->count;
+  case LVAL_BITSET: return x->value.bits->count;
+  }
+  return -1;
+}
+
+lval *builtin_empty(lenv *e, lval *a) {
+  LASSERT_NUM("empty?", a, 1);
+  long n = lval_size(a->value.cell[0]);
+  LASSERT(a, n >= 0, "Function 'empty?' passed incorrect type for argument 0. Got %s, Expected %s.",
+	  ltype_name(a->value.cell[0]->type), ltype_name(LVAL_QEXP));
+  lval_del(a);
+  return lval_booln(n == 0);
+}
+
+lval *builtin_count(lenv *e, lval *a) {
+  LASSERT_NUM("count", a, 1);
+  long n = lval_size(a->value.cell[0]);
+  LASSERT(a, n >= 0, "Function 'count' passed incorrect type for argument 0. Got %s, Expected %s.",
+	  ltype_name(a->value.cell[0]->type), ltype_name(LVAL_QEXP));
+  lval_del(a);
+  return lval_long(n);
+}
+
+lval *builtin_hash(lenv *e, lval *a) {
+  LASSERT_NUM("hash", a, 1);
+  lval *x = lval_long(lval_hash(a->value.cell[0]));
+  lval_del(a);
+  return x;
+}
+
+enum { ARR_ADD, ARR_SUB, ARR_MUL, ARR_DIV };
+enum { BITS_OR, BITS_AND, BITS_DIFF, BITS_XOR };
+
+/* Kernels take b either as an array (bs = 1) or as a single value
+   broadcast over a (bs = 0). Comparisons write 0/1 masks. */
+typedef struct {
+  char *name;
+  double (*sum_f64)(const double*, long);
+  double (*prod_f64)(const double*, long);
+  double (*dot_f64)(const double*, const double*, long);
+  double (*min_f64)(const double*, long);
+  double (*max_f64)(const double*, long);
+  void (*op_f64)(int, double*, const double*, const double*, int, long);
+  void (*cmp_f64)(int, long*, const double*, const double*, int, long);
+  long (*sum_i64)(const long*, long);
+  long (*prod_i64)(const long*, long);
+  long (*dot_i64)(const long*, const long*, long);
+  long (*min_i64)(const long*, long);
+  long (*max_i64)(const long*, long);
+  void (*op_i64)(int, long*, const long*, const long*, int, long);
+  void (*cmp_i64)(int, long*, const long*, const long*, int, long);
+  void (*axpy_f64)(double*, double, const double*, long);
+  void (*op_bits)(int, unsigned long*, const unsigned long*, const unsigned long*, long);
+  long (*count_bits)(const unsigned long*, long);
+} lkernels;
+
+double lk_sum_f64(const double *a, long n) {
+  double s = 0;
+  for (long i = 0; i < n; i++) { s += a[i]; }
+  return s;
+}
+
+double lk_prod_f64(const double *a, long n) {
+  double s = 1;
+  for (long i = 0; i < n; i++) { s *= a[i]; }
+  return s;
+}
+
+double lk_dot_f64(const double *a, const double *b, long n) {
+  double s = 0;
+  for (long i = 0; i < n; i++) { s += a[i] * b[i]; }
+  return s;
+}
+
+double lk_min_f64(const double *a, long n) {
+  double m = a[0];
+  for (long i = 1; i < n; i++) { if (a[i] < m) { m = a[i]; } }
+  return m;
+}
+
+double lk_max_f64(const double *a, long n) {
+  double m = a[0];
+  for (long i = 1; i < n; i++) { if (a[i] > m) { m = a[i]; } }
+  return m;
+}
+
+void lk_op_f64(int op, double *o, const double *a, const double *b, int bs, long n) {
+  for (long i = 0; i < n; i++) {
+    double y = b[i * bs];
+    switch (op) {
+    case ARR_ADD: o[i] = a[i] + y; break;
+    case ARR_SUB: o[i] = a[i] - y; break;
+    case ARR_MUL: o[i] = a[i] * y; break;
+    case ARR_DIV: o[i] = a[i] / y; break;
+    }
+  }
+}
+
+void lk_cmp_f64(int op, long *o, const double *a, const double *b, int bs, long n) {
+  for (long i = 0; i < n; i++) {
+    double y = b[i * bs];
+    switch (op) {
+    case GT: o[i] = a[i] > y; break;
+    case GE: o[i] = a[i] >= y; break;
+    case EQ: o[i] = a[i] == y; break;
+    case NE: o[i] = a[i] != y; break;
+    case LT: o[i] = a[i] < y; break;
+    case LE: o[i] = a[i] <= y; break;
+    }
+  }
+}
+
+/* y += a * x, the inner step of matrix multiply. */
+void lk_axpy_f64(double *y, double a, const double *x, long n) {
+  for (long i = 0; i < n; i++) { y[i] += a * x[i]; }
+}
+
+/* Bitset kernels work on whole 64-bit words. */
+void lk_op_bits(int op, unsigned long *o, const unsigned long *a, const unsigned long *b, long n) {
+  for (long i = 0; i < n; i++) {
+    switch (op) {
+    case BITS_OR: o[i] = a[i] | b[i]; break;
+    case BITS_AND: o[i] = a[i] & b[i]; break;
+    case BITS_DIFF: o[i] = a[i] & ~b[i]; break;
+    case BITS_XOR: o[i] = a[i] ^ b[i]; break;
+    }
+  }
+}
+
+long lk_count_bits(const unsigned long *a, long n) {
+  long c = 0;
+  for (long i = 0; i < n; i++) { c += __builtin_popcountl(a[i]); }
+  return c;
+}
+
+/* Integer arrays wrap on overflow rather than trapping. */
+long lk_sum_i64(const long *a, long n) {
+  unsigned long s = 0;
+  for (long i = 0; i < n; i++) { s += a[i]; }
+  return s;
+}
+
+long lk_prod_i64(const long *a, long n) {
+  unsigned long s = 1;
+  for (long i = 0; i < n; i++) { s *= a[i]; }
+  return s;
+}
+
+long lk_dot_i64(const long *a, const long *b, long n) {
+  unsigned long s = 0;
+  for (long i = 0; i < n; i++) { s += (unsigned long)a[i] * b[i]; }
+  return s;
+}
+
+long lk_min_i64(const long *a, long n) {
+  long m = a[0];
+  for (long i = 1; i < n; i++) { if (a[i] < m) { m = a[i]; } }
+  return m;
+}
+
+long lk_max_i64(const long *a, long n) {
+  long m = a[0];
+  for (long i = 1; i < n; i++) { if (a[i] > m) { m = a[i]; } }
+  return m;
+}
+
+/* Division by zero is rejected before the kernel runs. */
+void lk_op_i64(int op, long *o, const long *a, const long *b, int bs, long n) {
+  for (long i = 0; i < n; i++) {
+    long y = b[i * bs];
+    switch (op) {
+    case ARR_ADD: o[i] = (unsigned long)a[i] + y; break;
+    case ARR_SUB: o[i] = (unsigned long)a[i] - y; break;
+    case ARR_MUL: o[i] = (unsigned long)a[i] * y; break;
+    case ARR_DIV: o[i] = (a[i] == LONG_MIN && y == -1) ? LONG_MIN : a[i] / y; break;
+    }
+  }
+}
+
+void lk_cmp_i64(int op, long *o, const long *a, const long *b, int bs, long n) {
+  for (long i = 0; i < n; i++) {
+    long y = b[i * bs];
+    switch (op) {
+    case GT: o[i] = a[i] > y; break;
+    case GE: o[i] = a[i] >= y; break;
+    case EQ: o[i] = a[i] == y; break;
+    case NE: o[i] = a[i] != y; break;
+    case LT: o[i] = a[i] < y; break;
+    case LE: o[i] = a[i] <= y; break;
+    }
+  }
+}
+
+lkernels lk_scalar = {
+  "scalar",
+  lk_sum_f64, lk_prod_f64, lk_dot_f64, lk_min_f64, lk_max_f64, lk_op_f64, lk_cmp_f64,
+  lk_sum_i64, lk_prod_i64, lk_dot_i64, lk_min_i64, lk_max_i64, lk_op_i64, lk_cmp_i64,
+  lk_axpy_f64, lk_op_bits, lk_count_bits
+};
+
+#if defined(__x86_64__) && !defined(LIZ_NO_SIMD)
+#include <immintrin.h>
+
+/* SSE2 is part of x86-64, so these need no target attribute. Each
+   kernel finishes the tail that does not fill a register with the
+   scalar version. */
+double lk_sum_f64_sse2(const double *a, long n) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+    s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+  }
+  double t[2];
+  _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+  return t[0] + t[1] + lk_sum_f64(a + i, n - i);
+}
+
+double lk_prod_f64_sse2(const double *a, long n) {
+  __m128d s0 = _mm_set1_pd(1), s1 = _mm_set1_pd(1);
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_mul_pd(s0, _mm_loadu_pd(a + i));
+    s1 = _mm_mul_pd(s1, _mm_loadu_pd(a + i + 2));
+  }
+  double t[2];
+  _mm_storeu_pd(t, _mm_mul_pd(s0, s1));
+  return t[0] * t[1] * lk_prod_f64(a + i, n - i);
+}
+
+double lk_dot_f64_sse2(const double *a, const double *b, long n) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  double t[2];
+  _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+  return t[0] + t[1] + lk_dot_f64(a + i, b + i, n - i);
+}
+
+double lk_min_f64_sse2(const double *a, long n) {
+  if (n < 2) { return lk_min_f64(a, n); }
+  __m128d m = _mm_loadu_pd(a);
+  long i = 2;
+  for (; i + 2 <= n; i += 2) { m = _mm_min_pd(m, _mm_loadu_pd(a + i)); }
+  double t[2];
+  _mm_storeu_pd(t, m);
+  double r = t[0] < t[1] ? t[0] : t[1];
+  return i < n && a[i] < r ? a[i] : r;
+}
+
+double lk_max_f64_sse2(const double *a, long n) {
+  if (n < 2) { return lk_max_f64(a, n); }
+  __m128d m = _mm_loadu_pd(a);
+  long i = 2;
+  for (; i + 2 <= n; i += 2) { m = _mm_max_pd(m, _mm_loadu_pd(a + i)); }
+  double t[2];
+  _mm_storeu_pd(t, m);
+  double r = t[0] > t[1] ? t[0] : t[1];
+  return i < n && a[i] > r ? a[i] : r;
+}
+
+void lk_op_f64_sse2(int op, double *o, const double *a, const double *b, int bs, long n) {
+  __m128d k = bs ? _mm_setzero_pd() : _mm_set1_pd(b[0]);
+  long i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(a + i);
+    __m128d y = bs ? _mm_loadu_pd(b + i) : k;
+    switch (op) {
+    case ARR_ADD: x = _mm_add_pd(x, y); break;
+    case ARR_SUB: x = _mm_sub_pd(x, y); break;
+    case ARR_MUL: x = _mm_mul_pd(x, y); break;
+    case ARR_DIV: x = _mm_div_pd(x, y); break;
+    }
+    _mm_storeu_pd(o + i, x);
+  }
+  lk_op_f64(op, o + i, a + i, b + i * bs, bs, n - i);
+}
+
+void lk_cmp_f64_sse2(int op, long *o, const double *a, const double *b, int bs, long n) {
+  __m128d k = bs ? _mm_setzero_pd() : _mm_set1_pd(b[0]);
+  __m128i one = _mm_set1_epi64x(1);
+  long i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(a + i);
+    __m128d y = bs ? _mm_loadu_pd(b + i) : k;
+    switch (op) {
+    case GT: x = _mm_cmpgt_pd(x, y); break;
+    case GE: x = _mm_cmpge_pd(x, y); break;
+    case EQ: x = _mm_cmpeq_pd(x, y); break;
+    case NE: x = _mm_cmpneq_pd(x, y); break;
+    case LT: x = _mm_cmplt_pd(x, y); break;
+    case LE: x = _mm_cmple_pd(x, y); break;
+    }
+    _mm_storeu_si128((__m128i*)(o + i), _mm_and_si128(_mm_castpd_si128(x), one));
+  }
+  lk_cmp_f64(op, o + i, a + i, b + i * bs, bs, n - i);
+}
+
+void lk_axpy_f64_sse2(double *y, double a, const double *x, long n) {
+  __m128d k = _mm_set1_pd(a);
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(k, _mm_loadu_pd(x + i))));
+    _mm_storeu_pd(y + i + 2, _mm_add_pd(_mm_loadu_pd(y + i + 2), _mm_mul_pd(k, _mm_loadu_pd(x + i + 2))));
+  }
+  lk_axpy_f64(y + i, a, x + i, n - i);
+}
+
+long lk_sum_i64_sse2(const long *a, long n) {
+  __m128i s = _mm_setzero_si128();
+  long i = 0;
+  for (; i + 2 <= n; i += 2) { s = _mm_add_epi64(s, _mm_loadu_si128((const __m128i*)(a + i))); }
+  long t[2];
+  _mm_storeu_si128((__m128i*)t, s);
+  return (unsigned long)t[0] + t[1] + lk_sum_i64(a + i, n - i);
+}
+
+/* SSE2 has no 64-bit multiply, so only + and - are vectorised. */
+void lk_op_i64_sse2(int op, long *o, const long *a, const long *b, int bs, long n) {
+  if (op != ARR_ADD && op != ARR_SUB) { lk_op_i64(op, o, a, b, bs, n); return; }
+  __m128i k = bs ? _mm_setzero_si128() : _mm_set1_epi64x(b[0]);
+  long i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = bs ? _mm_loadu_si128((const __m128i*)(b + i)) : k;
+    x = op == ARR_ADD ? _mm_add_epi64(x, y) : _mm_sub_epi64(x, y);
+    _mm_storeu_si128((__m128i*)(o + i), x);
+  }
+  lk_op_i64(op, o + i, a + i, b + i * bs, bs, n - i);
+}
+
+void lk_op_bits_sse2(int op, unsigned long *o, const unsigned long *a, const unsigned long *b, long n) {
+  long i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    switch (op) {
+    case BITS_OR: x = _mm_or_si128(x, y); break;
+    case BITS_AND: x = _mm_and_si128(x, y); break;
+    case BITS_DIFF: x = _mm_andnot_si128(y, x); break;
+    case BITS_XOR: x = _mm_xor_si128(x, y); break;
+    }
+    _mm_storeu_si128((__m128i*)(o + i), x);
+  }
+  lk_op_bits(op, o + i, a + i, b + i, n - i);
+}
+
+/* Bit-sliced popcount within each byte, then summed per lane. */
+long lk_count_bits_sse2(const unsigned long *a, long n) {
+  __m128i m1 = _mm_set1_epi8(0x55), m2 = _mm_set1_epi8(0x33), m4 = _mm_set1_epi8(0x0f);
+  __m128i s = _mm_setzero_si128();
+  long i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+    x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+    x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+    s = _mm_add_epi64(s, _mm_sad_epu8(x, _mm_setzero_si128()));
+  }
+  long t[2];
+  _mm_storeu_si128((__m128i*)t, s);
+  return t[0] + t[1] + lk_count_bits(a + i, n - i);
+}
+
+lkernels lk_sse2 = {
+  "sse2",
+  lk_sum_f64_sse2, lk_prod_f64_sse2, lk_dot_f64_sse2, lk_min_f64_sse2, lk_max_f64_sse2,
+  lk_op_f64_sse2, lk_cmp_f64_sse2,
+  lk_sum_i64_sse2, lk_prod_i64, lk_dot_i64, lk_min_i64, lk_max_i64, lk_op_i64_sse2, lk_cmp_i64,
+  lk_axpy_f64_sse2, lk_op_bits_sse2, lk_count_bits_sse2
+};
+
+#define LK_AVX2 __attribute__((target("avx2")))
+
+LK_AVX2 double lk_hsum_avx2(__m256d s) {
+  double t[4];
+  _mm256_storeu_pd(t, s);
+  return (t[0] + t[1]) + (t[2] + t[3]);
+}
+
+LK_AVX2 double lk_sum_f64_avx2(const double *a, long n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+  }
+  return lk_hsum_avx2(_mm256_add_pd(s0, s1)) + lk_sum_f64(a + i, n - i);
+}
+
+LK_AVX2 double lk_prod_f64_avx2(const double *a, long n) {
+  __m256d s0 = _mm256_set1_pd(1), s1 = _mm256_set1_pd(1);
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_mul_pd(s0, _mm256_loadu_pd(a + i));
+    s1 = _mm256_mul_pd(s1, _mm256_loadu_pd(a + i + 4));
+  }
+  double t[4];
+  _mm256_storeu_pd(t, _mm256_mul_pd(s0, s1));
+  return (t[0] * t[1]) * (t[2] * t[3]) * lk_prod_f64(a + i, n - i);
+}
+
+LK_AVX2 double lk_dot_f64_avx2(const double *a, const double *b, long n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+  }
+  return lk_hsum_avx2(_mm256_add_pd(s0, s1)) + lk_dot_f64(a + i, b + i, n - i);
+}
+
+LK_AVX2 double lk_min_f64_avx2(const double *a, long n) {
+  if (n < 4) { return lk_min_f64(a, n); }
+  __m256d m = _mm256_loadu_pd(a);
+  long i = 4;
+  for (; i + 4 <= n; i += 4) { m = _mm256_min_pd(m, _mm256_loadu_pd(a + i)); }
+  double t[4];
+  _mm256_storeu_pd(t, m);
+  double r = lk_min_f64(t, 4);
+  if (i < n) { double x = lk_min_f64(a + i, n - i); if (x < r) { r = x; } }
+  return r;
+}
+
+LK_AVX2 double lk_max_f64_avx2(const double *a, long n) {
+  if (n < 4) { return lk_max_f64(a, n); }
+  __m256d m = _mm256_loadu_pd(a);
+  long i = 4;
+  for (; i + 4 <= n; i += 4) { m = _mm256_max_pd(m, _mm256_loadu_pd(a + i)); }
+  double t[4];
+  _mm256_storeu_pd(t, m);
+  double r = lk_max_f64(t, 4);
+  if (i < n) { double x = lk_max_f64(a + i, n - i); if (x > r) { r = x; } }
+  return r;
+}
+
+LK_AVX2 void lk_op_f64_avx2(int op, double *o, const double *a, const double *b, int bs, long n) {
+  __m256d k = bs ? _mm256_setzero_pd() : _mm256_set1_pd(b[0]);
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    __m256d y = bs ? _mm256_loadu_pd(b + i) : k;
+    switch (op) {
+    case ARR_ADD: x = _mm256_add_pd(x, y); break;
+    case ARR_SUB: x = _mm256_sub_pd(x, y); break;
+    case ARR_MUL: x = _mm256_mul_pd(x, y); break;
+    case ARR_DIV: x = _mm256_div_pd(x, y); break;
+    }
+    _mm256_storeu_pd(o + i, x);
+  }
+  lk_op_f64(op, o + i, a + i, b + i * bs, bs, n - i);
+}
+
+LK_AVX2 void lk_cmp_f64_avx2(int op, long *o, const double *a, const double *b, int bs, long n) {
+  __m256d k = bs ? _mm256_setzero_pd() : _mm256_set1_pd(b[0]);
+  __m256i one = _mm256_set1_epi64x(1);
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    __m256d y = bs ? _mm256_loadu_pd(b + i) : k;
+    switch (op) {
+    case GT: x = _mm256_cmp_pd(x, y, _CMP_GT_OQ); break;
+    case GE: x = _mm256_cmp_pd(x, y, _CMP_GE_OQ); break;
+    case EQ: x = _mm256_cmp_pd(x, y, _CMP_EQ_OQ); break;
+    case NE: x = _mm256_cmp_pd(x, y, _CMP_NEQ_UQ); break;
+    case LT: x = _mm256_cmp_pd(x, y, _CMP_LT_OQ); break;
+    case LE: x = _mm256_cmp_pd(x, y, _CMP_LE_OQ); break;
+    }
+    _mm256_storeu_si256((__m256i*)(o + i), _mm256_and_si256(_mm256_castpd_si256(x), one));
+  }
+  lk_cmp_f64(op, o + i, a + i, b + i * bs, bs, n - i);
+}
+
+LK_AVX2 void lk_axpy_f64_avx2(double *y, double a, const double *x, long n) {
+  __m256d k = _mm256_set1_pd(a);
+  long i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(k, _mm256_loadu_pd(x + i))));
+    _mm256_storeu_pd(y + i + 4, _mm256_add_pd(_mm256_loadu_pd(y + i + 4), _mm256_mul_pd(k, _mm256_loadu_pd(x + i + 4))));
+  }
+  lk_axpy_f64(y + i, a, x + i, n - i);
+}
+
+LK_AVX2 long lk_sum_i64_avx2(const long *a, long n) {
+  __m256i s = _mm256_setzero_si256();
+  long i = 0;
+  for (; i + 4 <= n; i += 4) { s = _mm256_add_epi64(s, _mm256_loadu_si256((const __m256i*)(a + i))); }
+  long t[4];
+  _mm256_storeu_si256((__m256i*)t, s);
+  return (unsigned long)t[0] + t[1] + t[2] + t[3] + lk_sum_i64(a + i, n - i);
+}
+
+LK_AVX2 long lk_min_i64_avx2(const long *a, long n) {
+  if (n < 4) { return lk_min_i64(a, n); }
+  __m256i m = _mm256_loadu_si256((const __m256i*)a);
+  long i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    m = _mm256_blendv_epi8(m, x, _mm256_cmpgt_epi64(m, x));
+  }
+  long t[4];
+  _mm256_storeu_si256((__m256i*)t, m);
+  long r = lk_min_i64(t, 4);
+  if (i < n) { long x = lk_min_i64(a + i, n - i); if (x < r) { r = x; } }
+  return r;
+}
+
+LK_AVX2 long lk_max_i64_avx2(const long *a, long n) {
+  if (n < 4) { return lk_max_i64(a, n); }
+  __m256i m = _mm256_loadu_si256((const __m256i*)a);
+  long i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    m = _mm256_blendv_epi8(m, x, _mm256_cmpgt_epi64(x, m));
+  }
+  long t[4];
+  _mm256_storeu_si256((__m256i*)t, m);
+  long r = lk_max_i64(t, 4);
+  if (i < n) { long x = lk_max_i64(a + i, n - i); if (x > r) { r = x; } }
+  return r;
+}
+
+/* AVX2 has no 64-bit multiply either. */
+LK_AVX2 void lk_op_i64_avx2(int op, long *o, const long *a, const long *b, int bs, long n) {
+  if (op != ARR_ADD && op != ARR_SUB) { lk_op_i64(op, o, a, b, bs, n); return; }
+  __m256i k = bs ? _mm256_setzero_si256() : _mm256_set1_epi64x(b[0]);
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y = bs ? _mm256_loadu_si256((const __m256i*)(b + i)) : k;
+    x = op == ARR_ADD ? _mm256_add_epi64(x, y) : _mm256_sub_epi64(x, y);
+    _mm256_storeu_si256((__m256i*)(o + i), x);
+  }
+  lk_op_i64(op, o + i, a + i, b + i * bs, bs, n - i);
+}
+
+/* Only > and = exist for 64-bit lanes; the rest swap operands or
+   invert the mask. */
+LK_AVX2 void lk_cmp_i64_avx2(int op, long *o, const long *a, const long *b, int bs, long n) {
+  __m256i k = bs ? _mm256_setzero_si256() : _mm256_set1_epi64x(b[0]);
+  __m256i one = _mm256_set1_epi64x(1);
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y = bs ? _mm256_loadu_si256((const __m256i*)(b + i)) : k;
+    __m256i m;
+    switch (op) {
+    case GT: m = _mm256_and_si256(_mm256_cmpgt_epi64(x, y), one); break;
+    case GE: m = _mm256_andnot_si256(_mm256_cmpgt_epi64(y, x), one); break;
+    case EQ: m = _mm256_and_si256(_mm256_cmpeq_epi64(x, y), one); break;
+    case NE: m = _mm256_andnot_si256(_mm256_cmpeq_epi64(x, y), one); break;
+    case LT: m = _mm256_and_si256(_mm256_cmpgt_epi64(y, x), one); break;
+    default: m = _mm256_andnot_si256(_mm256_cmpgt_epi64(x, y), one); break;
+    }
+    _mm256_storeu_si256((__m256i*)(o + i), m);
+  }
+  lk_cmp_i64(op, o + i, a + i, b + i * bs, bs, n - i);
+}
+
+LK_AVX2 void lk_op_bits_avx2(int op, unsigned long *o, const unsigned long *a, const unsigned long *b, long n) {
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+    switch (op) {
+    case BITS_OR: x = _mm256_or_si256(x, y); break;
+    case BITS_AND: x = _mm256_and_si256(x, y); break;
+    case BITS_DIFF: x = _mm256_andnot_si256(y, x); break;
+    case BITS_XOR: x = _mm256_xor_si256(x, y); break;
+    }
+    _mm256_storeu_si256((__m256i*)(o + i), x);
+  }
+  lk_op_bits(op, o + i, a + i, b + i, n - i);
+}
+
+/* Nibble lookup through a byte shuffle, then summed per lane. */
+LK_AVX2 long lk_count_bits_avx2(const unsigned long *a, long n) {
+  __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+				 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  __m256i m4 = _mm256_set1_epi8(0x0f);
+  __m256i s = _mm256_setzero_si256();
+  long i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, m4));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi64(x, 4), m4));
+    s = _mm256_add_epi64(s, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+  }
+  long t[4];
+  _mm256_storeu_si256((__m256i*)t, s);
+  return t[0] + t[1] + t[2] + t[3] + lk_count_bits(a + i, n - i);
+}
+
+lkernels lk_avx2 = {
+  "avx2",
+  lk_sum_f64_avx2, lk_prod_f64_avx2, lk_dot_f64_avx2, lk_min_f64_avx2, lk_max_f64_avx2,
+  lk_op_f64_avx2, lk_cmp_f64_avx2,
+  lk_sum_i64_avx2, lk_prod_i64, lk_dot_i64, lk_min_i64_avx2, lk_max_i64_avx2,
+  lk_op_i64_avx2, lk_cmp_i64_avx2,
+  lk_axpy_f64_avx2, lk_op_bits_avx2, lk_count_bits_avx2
+};
+#endif
+
+lkernels *lk = &lk_scalar;
+
+/* Picks the widest kernels the CPU supports. LIZ_SIMD=scalar|sse2
+   caps the choice, which is handy when comparing results. */
+void lk_init(void) {
+#if defined(__x86_64__) && !defined(LIZ_NO_SIMD)
+  char *cap = getenv("LIZ_SIMD");
+  if (cap && strcmp(cap, "scalar") == 0) { return; }
+  lk = &lk_sse2;
+  if (cap && strcmp(cap, "sse2") == 0) { return; }
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) { lk = &lk_avx2; }
+#endif
+}
+
+lval *lval_arr(int kind, long n) {
+  lval *v = lval_new(LVAL_ARRAY);
+  v->value.arr = malloc(sizeof(larr));
+  v->value.arr->refs = 1;
+  v->value.arr->kind = kind;
+  v->value.arr->count = n;
+  v->value.arr->data.d = malloc((kind == ARR_F64 ? sizeof(double) : sizeof(long)) * (n > 0 ? n : 1));
+  return v;
+}
+
+lval *builtin_arrn(lenv *e, lval *a, char *func, int kind) {
+  LASSERT_NUM(func, a, 1);
+  lval *x = a->value.cell[0];
+  if (x->type == LVAL_LONG) {
+    LASSERT(a, x->value.l >= 0, "Function '%s' passed negative length %li.", func, x->value.l);
+    lval *v = lval_arr(kind, x->value.l);
+    memset(v->value.arr->data.d, 0, sizeof(double) * x->value.l);
+    lval_del(a);
+    return v;
+  }
+  LASSERT(a, x->type == LVAL_QEXP || x->type == LVAL_VECTOR,
+    "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s or %s.",
+    func, ltype_name(x->type), ltype_name(LVAL_QEXP), ltype_name(LVAL_VECTOR));
+  long n = x->type == LVAL_VECTOR ? x->value.vec->count : x->count;
+  lval **items = x->type == LVAL_VECTOR ? x->value.vec->items : x->value.cell;
+  for (long i = 0; i < n; i++) {
+    int t = items[i]->type;
+    LASSERT(a, t == LVAL_LONG || (t == LVAL_DOUBLE && kind == ARR_F64),
+      "Function '%s' passed incorrect type for element %li. Got %s, Expected %s.",
+      func, i, ltype_name(t), ltype_name(kind == ARR_F64 ? LVAL_DOUBLE : LVAL_LONG));
+  }
+  lval *v = lval_arr(kind, n);
+  for (long i = 0; i < n; i++) {
+    if (kind == ARR_I64) {
+      v->value.arr->data.l[i] = items[i]->value.l;
+    } else {
+      v->value.arr->data.d[i] = items[i]->type == LVAL_LONG ? items[i]->value.l : items[i]->value.d;
+    }
+  }
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_f64_array(lenv *e, lval *a) {
+  return builtin_arrn(e, a, "f64-array", ARR_F64);
+}
+
+lval *builtin_i64_array(lenv *e, lval *a) {
+  return builtin_arrn(e, a, "i64-array", ARR_I64);
+}
+
+lval *lval_arr_elem(larr *r, long i) {
+  return r->kind == ARR_F64 ? lval_double(r->data.d[i]) : lval_long(r->data.l[i]);
+}
+
+lval *builtin_arr_len(lenv *e, lval *a) {
+  LASSERT_NUM("arr-len", a, 1);
+  LASSERT_TYPE("arr-len", a, 0, LVAL_ARRAY);
+  lval *x = lval_long(a->value.cell[0]->value.arr->count);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_arr_ref(lenv *e, lval *a) {
+  LASSERT_NUM("arr-ref", a, 2);
+  LASSERT_TYPE("arr-ref", a, 0, LVAL_ARRAY);
+  LASSERT_TYPE("arr-ref", a, 1, LVAL_LONG);
+  larr *r = a->value.cell[0]->value.arr;
+  long i = a->value.cell[1]->value.l;
+  LASSERT_INDEX("arr-ref", a, r, i);
+  lval *x = lval_arr_elem(r, i);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_arr_set(lenv *e, lval *a) {
+  LASSERT_NUM("arr-set!", a, 3);
+  LASSERT_TYPE("arr-set!", a, 0, LVAL_ARRAY);
+  LASSERT_TYPE("arr-set!", a, 1, LVAL_LONG);
+  larr *r = a->value.cell[0]->value.arr;
+  long i = a->value.cell[1]->value.l;
+  LASSERT_INDEX("arr-set!", a, r, i);
+  lval *x = a->value.cell[2];
+  if (r->kind == ARR_I64) {
+    LASSERT_TYPE("arr-set!", a, 2, LVAL_LONG);
+    r->data.l[i] = x->value.l;
+  } else {
+    LASSERT(a, x->type == LVAL_LONG || x->type == LVAL_DOUBLE,
+      "Function 'arr-set!' passed incorrect type for argument 2. Got %s, Expected %s.",
+      ltype_name(x->type), ltype_name(LVAL_DOUBLE));
+    r->data.d[i] = x->type == LVAL_LONG ? x->value.l : x->value.d;
+  }
+  return lval_take(a, 0);
+}
+
+lval *builtin_arr_to_list(lenv *e, lval *a) {
+  LASSERT_NUM("arr->list", a, 1);
+  LASSERT_TYPE("arr->list", a, 0, LVAL_ARRAY);
+  larr *r = a->value.cell[0]->value.arr;
+  lval *x = lval_qexp();
+  lval_reserve(x, r->count);
+  x->count = r->count;
+  for (long i = 0; i < r->count; i++) { x->value.cell[i] = lval_arr_elem(r, i); }
+  lval_del(a);
+  return x;
+}
+
+enum { ARR_SUM, ARR_PROD, ARR_MIN, ARR_MAX };
+
+lval *builtin_arr_fold(lenv *e, lval *a, char *func, int op) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_ARRAY);
+  larr *r = a->value.cell[0]->value.arr;
+  LASSERT(a, r->count > 0 || op == ARR_SUM || op == ARR_PROD,
+    "Function '%s' passed an empty array.", func);
+  lval *x;
+  if (r->kind == ARR_F64) {
+    switch (op) {
+    case ARR_SUM: x = lval_double(lk->sum_f64(r->data.d, r->count)); break;
+    case ARR_PROD: x = lval_double(lk->prod_f64(r->data.d, r->count)); break;
+    case ARR_MIN: x = lval_double(lk->min_f64(r->data.d, r->count)); break;
+    default: x = lval_double(lk->max_f64(r->data.d, r->count)); break;
+    }
+  } else {
+    switch (op) {
+    case ARR_SUM: x = lval_long(lk->sum_i64(r->data.l, r->count)); break;
+    case ARR_PROD: x = lval_long(lk->prod_i64(r->data.l, r->count)); break;
+    case ARR_MIN: x = lval_long(lk->min_i64(r->data.l, r->count)); break;
+    default: x = lval_long(lk->max_i64(r->data.l, r->count)); break;
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_arr_sum(lenv *e, lval *a) {
+  return builtin_arr_fold(e, a, "arr-sum", ARR_SUM);
+}
+
+lval *builtin_arr_prod(lenv *e, lval *a) {
+  return builtin_arr_fold(e, a, "arr-prod", ARR_PROD);
+}
+
+lval *builtin_arr_min(lenv *e, lval *a) {
+  return builtin_arr_fold(e, a, "arr-min", ARR_MIN);
+}
+
+lval *builtin_arr_max(lenv *e, lval *a) {
+  return builtin_arr_fold(e, a, "arr-max", ARR_MAX);
+}
+
+#define LASSERT_ARR_MATCH(func, args, x, y) \
+  LASSERT(args, x->kind == y->kind && x->count == y->count, \
+    "Function '%s' passed mismatched arrays. Got %s[%li] and %s[%li].", func, \
+    x->kind == ARR_F64 ? "f64" : "i64", x->count, y->kind == ARR_F64 ? "f64" : "i64", y->count)
+
+lval *builtin_arr_dot(lenv *e, lval *a) {
+  LASSERT_NUM("arr-dot", a, 2);
+  LASSERT_TYPE("arr-dot", a, 0, LVAL_ARRAY);
+  LASSERT_TYPE("arr-dot", a, 1, LVAL_ARRAY);
+  larr *x = a->value.cell[0]->value.arr;
+  larr *y = a->value.cell[1]->value.arr;
+  LASSERT_ARR_MATCH("arr-dot", a, x, y);
+  lval *r = x->kind == ARR_F64
+    ? lval_double(lk->dot_f64(x->data.d, y->data.d, x->count))
+    : lval_long(lk->dot_i64(x->data.l, y->data.l, x->count));
+  lval_del(a);
+  return r;
+}
+
+/* Elementwise ops take two matching arrays, or an array and a number
+   that is broadcast over it. Comparisons give an i64 mask of 0/1. */
+lval *builtin_arr_map(lenv *e, lval *a, char *func, int op, int cmp) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_ARRAY);
+  larr *x = a->value.cell[0]->value.arr;
+  lval *b = a->value.cell[1];
+  union { double d; long l; } k;
+  const void *y;
+  int bs = 1;
+  if (b->type == LVAL_ARRAY) {
+    LASSERT_ARR_MATCH(func, a, x, b->value.arr);
+    y = b->value.arr->data.d;
+  } else if (x->kind == ARR_F64) {
+    LASSERT(a, b->type == LVAL_LONG || b->type == LVAL_DOUBLE,
+      "Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.",
+      func, ltype_name(b->type), ltype_name(LVAL_ARRAY));
+    k.d = b->type == LVAL_LONG ? b->value.l : b->value.d;
+    y = &k;
+    bs = 0;
+  } else {
+    LASSERT(a, b->type == LVAL_LONG,
+      "Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.",
+      func, ltype_name(b->type), ltype_name(LVAL_ARRAY));
+    k.l = b->value.l;
+    y = &k;
+    bs = 0;
+  }
+  if (!cmp && op == ARR_DIV && x->kind == ARR_I64) {
+    const long *d = y;
+    for (long i = 0; i < (bs ? x->count : 1); i++) {
+      LASSERT(a, d[i] != 0, "Division By Zero!");
+    }
+  }
+  lval *r = lval_arr(cmp ? ARR_I64 : x->kind, x->count);
+  if (cmp && x->kind == ARR_F64) {
+    lk->cmp_f64(op, r->value.arr->data.l, x->data.d, y, bs, x->count);
+  } else if (cmp) {
+    lk->cmp_i64(op, r->value.arr->data.l, x->data.l, y, bs, x->count);
+  } else if (x->kind == ARR_F64) {
+    lk->op_f64(op, r->value.arr->data.d, x->data.d, y, bs, x->count);
+  } else {
+    lk->op_i64(op, r->value.arr->data.l, x->data.l, y, bs, x->count);
+  }
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_arr_add(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr+", ARR_ADD, 0);
+}
+
+lval *builtin_arr_sub(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr-", ARR_SUB, 0);
+}
+
+lval *builtin_arr_mul(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr*", ARR_MUL, 0);
+}
+
+lval *builtin_arr_div(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr/", ARR_DIV, 0);
+}
+
+lval *builtin_arr_gt(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr>", GT, 1);
+}
+
+lval *builtin_arr_ge(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr>=", GE, 1);
+}
+
+lval *builtin_arr_eq(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr=", EQ, 1);
+}
+
+lval *builtin_arr_ne(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr!", NE, 1);
+}
+
+lval *builtin_arr_lt(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr<", LT, 1);
+}
+
+lval *builtin_arr_le(lenv *e, lval *a) {
+  return builtin_arr_map(e, a, "arr<=", LE, 1);
+}
+
+lval *lval_table(void) {
+  lval *v = lval_new(LVAL_TABLE);
+  v->value.tab = malloc(sizeof(ltab));
+  v->value.tab->refs = 1;
+  v->value.tab->ncols = 0;
+  v->value.tab->nrows = 0;
+  v->value.tab->names = NULL;
+  v->value.tab->cols = NULL;
+  return v;
+}
+
+long lval_col_len(lval *c) {
+  return c->type == LVAL_ARRAY ? c->value.arr->count : c->value.vec->count;
+}
+
+void ltab_add(ltab *t, char *name, lval *col) {
+  t->ncols++;
+  t->names = realloc(t->names, sizeof(char*) * t->ncols);
+  t->cols = realloc(t->cols, sizeof(lval*) * t->ncols);
+  t->names[t->ncols-1] = malloc(strlen(name) + 1);
+  strcpy(t->names[t->ncols-1], name);
+  t->cols[t->ncols-1] = col;
+  t->nrows = lval_col_len(col);
+}
+
+int ltab_find(ltab *t, char *name) {
+  for (int i = 0; i < t->ncols; i++) {
+    if (strcmp(t->names[i], name) == 0) { return i; }
+  }
+  return -1;
+}
+
+/* Columns are named by a string, a symbol in a Q-Expression, or the
+   symbol or string inside one. */
+char *lval_colname(lval *x) {
+  if (x->type == LVAL_STR) { return x->value.str; }
+  if (x->type == LVAL_SYM) { return x->value.sym; }
+  if (x->type == LVAL_QEXP && x->count == 1) { return lval_colname(x->value.cell[0]); }
+  return NULL;
+}
+
+/* Turns a list or vector into a column: all longs become an i64 array,
+   mixed numbers an f64 array and strings a vector. */
+lval *lval_column(lval *x) {
+  if (x->type == LVAL_ARRAY) { return x; }
+  if (x->type != LVAL_QEXP && x->type != LVAL_VECTOR) {
+    lval *err = lval_err("Column has incorrect type. Got %s, Expected %s.",
+			 ltype_name(x->type), ltype_name(LVAL_ARRAY));
+    lval_del(x);
+    return err;
+  }
+  long n = x->type == LVAL_VECTOR ? x->value.vec->count : x->count;
+  lval **items = x->type == LVAL_VECTOR ? x->value.vec->items : x->value.cell;
+  int longs = 1, nums = 1, strs = 1;
+  for (long i = 0; i < n; i++) {
+    switch (items[i]->type) {
+    case LVAL_LONG: strs = 0; break;
+    case LVAL_DOUBLE: longs = 0; strs = 0; break;
+    case LVAL_STR: longs = 0; nums = 0; break;
+    default: longs = 0; nums = 0; strs = 0; break;
+    }
+  }
+  if (n && strs && x->type == LVAL_VECTOR) { return x; }
+  lval *c;
+  if (n && strs) {
+    c = lval_vec();
+    for (long i = 0; i < n; i++) { lval_vec_push(c->value.vec, lval_copy(items[i])); }
+  } else if (nums) {
+    c = lval_arr(longs ? ARR_I64 : ARR_F64, n);
+    for (long i = 0; i < n; i++) {
+      if (longs) {
+	c->value.arr->data.l[i] = items[i]->value.l;
+      } else {
+	c->value.arr->data.d[i] = items[i]->type == LVAL_LONG ? items[i]->value.l : items[i]->value.d;
+      }
+    }
+  } else {
+    c = lval_err("Column must hold only numbers or only strings.");
+  }
+  lval_del(x);
+  return c;
+}
+
+lval *lval_col_gather(lval *c, long *idx, long n) {
+  if (c->type == LVAL_VECTOR) {
+    lval *v = lval_vec();
+    v->value.vec->cap = n;
+    v->value.vec->items = malloc(sizeof(lval*) * (n > 0 ? n : 1));
+    for (long i = 0; i < n; i++) { v->value.vec->items[i] = lval_copy(c->value.vec->items[idx[i]]); }
+    v->value.vec->count = n;
+    return v;
+  }
+  larr *s = c->value.arr;
+  lval *r = lval_arr(s->kind, n);
+  if (s->kind == ARR_F64) {
+    for (long i = 0; i < n; i++) { r->value.arr->data.d[i] = s->data.d[idx[i]]; }
+  } else {
+    for (long i = 0; i < n; i++) { r->value.arr->data.l[i] = s->data.l[idx[i]]; }
+  }
+  return r;
+}
+
+/* Orders rows i and j of a column. NaNs sort last and equal each
+   other so they group together. */
+int lval_col_cmp(lval *c, long i, long j) {
+  if (c->type == LVAL_VECTOR) {
+    return strcmp(c->value.vec->items[i]->value.str, c->value.vec->items[j]->value.str);
+  }
+  if (c->value.arr->kind == ARR_I64) {
+    long x = c->value.arr->data.l[i], y = c->value.arr->data.l[j];
+    return (x > y) - (x < y);
+  }
+  double x = c->value.arr->data.d[i], y = c->value.arr->data.d[j];
+  if (isnan(x) || isnan(y)) { return isnan(x) - isnan(y); }
+  return (x > y) - (x < y);
+}
+
+unsigned long lval_col_hash(lval *c, long i) {
+  unsigned long h;
+  if (c->type == LVAL_VECTOR) {
+    h = 14695981039346656037UL;
+    for (char *s = c->value.vec->items[i]->value.str; *s; s++) {
+      h = (h ^ (unsigned char)*s) * 1099511628211UL;
+    }
+    return h;
+  }
+  if (c->value.arr->kind == ARR_I64) {
+    h = c->value.arr->data.l[i];
+  } else {
+    double d = c->value.arr->data.d[i];
+    if (d == 0) { d = 0; }
+    if (isnan(d)) { d = NAN; }
+    memcpy(&h, &d, sizeof(h));
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  return h;
+}
+
+lval *builtin_table(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, "Function 'table' passed no column names.");
+  LASSERT_TYPE("table", a, 0, LVAL_QEXP);
+  lval *names = a->value.cell[0];
+  LASSERT(a, names->count == a->count - 1,
+    "Function 'table' passed %i column names for %i columns.", names->count, a->count - 1);
+  for (int i = 0; i < names->count; i++) {
+    LASSERT(a, lval_colname(names->value.cell[i]),
+      "Function 'table' passed incorrect type for column name. Got %s, Expected %s.",
+      ltype_name(names->value.cell[i]->type), ltype_name(LVAL_SYM));
+    for (int j = 0; j < i; j++) {
+      LASSERT(a, strcmp(lval_colname(names->value.cell[i]), lval_colname(names->value.cell[j])) != 0,
+	"Function 'table' passed duplicate column '%s'.", lval_colname(names->value.cell[i]));
+    }
+  }
+  for (int i = 1; i < a->count; i++) {
+    a->value.cell[i] = lval_column(a->value.cell[i]);
+    if (a->value.cell[i]->type == LVAL_ERR) { return lval_take(a, i); }
+    LASSERT(a, lval_col_len(a->value.cell[i]) == lval_col_len(a->value.cell[1]),
+      "Function 'table' passed columns of different lengths. Got %li and %li.",
+      lval_col_len(a->value.cell[1]), lval_col_len(a->value.cell[i]));
+  }
+  lval *t = lval_table();
+  for (int i = 0; i < names->count; i++) {
+    ltab_add(t->value.tab, lval_colname(names->value.cell[i]), lval_copy(a->value.cell[i+1]));
+  }
+  lval_del(a);
+  return t;
+}
+
+#define LASSERT_COL(func, args, tab, index, name) \
+  LASSERT(args, name, "Function '%s' passed incorrect column name.", func); \
+  int index = ltab_find(tab, name); \
+  LASSERT(args, index >= 0, "Function '%s' passed unknown column '%s'.", func, name)
+
+lval *builtin_table_col(lenv *e, lval *a) {
+  LASSERT_NUM("table-col", a, 2);
+  LASSERT_TYPE("table-col", a, 0, LVAL_TABLE);
+  ltab *t = a->value.cell[0]->value.tab;
+  char *name = lval_colname(a->value.cell[1]);
+  LASSERT_COL("table-col", a, t, c, name);
+  lval *x = lval_copy(t->cols[c]);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_table_names(lenv *e, lval *a) {
+  LASSERT_NUM("table-names", a, 1);
+  LASSERT_TYPE("table-names", a, 0, LVAL_TABLE);
+  ltab *t = a->value.cell[0]->value.tab;
+  lval *x = lval_qexp();
+  for (int i = 0; i < t->ncols; i++) { x = lval_add(x, lval_sym(t->names[i])); }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_table_count(lenv *e, lval *a) {
+  LASSERT_NUM("table-count", a, 1);
+  LASSERT_TYPE("table-count", a, 0, LVAL_TABLE);
+  lval *x = lval_long(a->value.cell[0]->value.tab->nrows);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_table_select(lenv *e, lval *a) {
+  LASSERT_NUM("table-select", a, 2);
+  LASSERT_TYPE("table-select", a, 0, LVAL_TABLE);
+  LASSERT_TYPE("table-select", a, 1, LVAL_QEXP);
+  ltab *t = a->value.cell[0]->value.tab;
+  lval *cs = a->value.cell[1];
+  for (int i = 0; i < cs->count; i++) {
+    char *name = lval_colname(cs->value.cell[i]);
+    LASSERT_COL("table-select", a, t, c, name);
+  }
+  lval *r = lval_table();
+  for (int i = 0; i < cs->count; i++) {
+    char *name = lval_colname(cs->value.cell[i]);
+    ltab_add(r->value.tab, name, lval_copy(t->cols[ltab_find(t, name)]));
+  }
+  lval_del(a);
+  return r;
+}
+
+lval *ltab_gather(ltab *t, long *idx, long n) {
+  lval *r = lval_table();
+  for (int i = 0; i < t->ncols; i++) {
+    ltab_add(r->value.tab, t->names[i], lval_col_gather(t->cols[i], idx, n));
+  }
+  r->value.tab->nrows = n;
+  return r;
+}
+
+/* Keeps the rows where an i64 mask, such as one from arr<, is set. */
+lval *builtin_table_where(lenv *e, lval *a) {
+  LASSERT_NUM("table-where", a, 2);
+  LASSERT_TYPE("table-where", a, 0, LVAL_TABLE);
+  LASSERT_TYPE("table-where", a, 1, LVAL_ARRAY);
+  ltab *t = a->value.cell[0]->value.tab;
+  larr *m = a->value.cell[1]->value.arr;
+  LASSERT(a, m->kind == ARR_I64 && m->count == t->nrows,
+    "Function 'table-where' passed a mask that is not an i64 array of %li rows.", t->nrows);
+  long *idx = malloc(sizeof(long) * (t->nrows > 0 ? t->nrows : 1));
+  long n = 0;
+  for (long i = 0; i < t->nrows; i++) {
+    idx[n] = i;
+    n += m->data.l[i] != 0;
+  }
+  lval *r = ltab_gather(t, idx, n);
+  free(idx);
+  lval_del(a);
+  return r;
+}
+
+/* Stable bottom-up merge sort of row indices by one column. */
+void lval_col_sort(lval *c, long *idx, long n, int desc) {
+  long *tmp = malloc(sizeof(long) * (n > 0 ? n : 1));
+  long *src = idx, *dst = tmp;
+  for (long w = 1; w < n; w *= 2) {
+    for (long lo = 0; lo < n; lo += 2 * w) {
+      long mid = lo + w < n ? lo + w : n;
+      long hi = lo + 2 * w < n ? lo + 2 * w : n;
+      long i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+	int o = lval_col_cmp(c, src[j], src[i]);
+	dst[k++] = (desc ? o > 0 : o < 0) ? src[j++] : src[i++];
+      }
+      while (i < mid) { dst[k++] = src[i++]; }
+      while (j < hi) { dst[k++] = src[j++]; }
+    }
+    long *s = src; src = dst; dst = s;
+  }
+  if (src != idx) { memcpy(idx, src, sizeof(long) * n); }
+  free(tmp);
+}
+
+lval *builtin_table_sort_by(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'table-sort-by' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+  LASSERT_TYPE("table-sort-by", a, 0, LVAL_TABLE);
+  if (a->count == 3) { LASSERT_TYPE("table-sort-by", a, 2, LVAL_BOOL); }
+  ltab *t = a->value.cell[0]->value.tab;
+  char *name = lval_colname(a->value.cell[1]);
+  LASSERT_COL("table-sort-by", a, t, c, name);
+  long *idx = malloc(sizeof(long) * (t->nrows > 0 ? t->nrows : 1));
+  for (long i = 0; i < t->nrows; i++) { idx[i] = i; }
+  lval_col_sort(t->cols[c], idx, t->nrows, a->count == 3 && a->value.cell[2]->value.l);
+  lval *r = ltab_gather(t, idx, t->nrows);
+  free(idx);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_table_aggn(lenv *e, lval *a, char *func, int mean) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_TABLE);
+  ltab *t = a->value.cell[0]->value.tab;
+  char *name = lval_colname(a->value.cell[1]);
+  LASSERT_COL(func, a, t, c, name);
+  LASSERT(a, t->cols[c]->type == LVAL_ARRAY, "Function '%s' passed non-numeric column '%s'.", func, name);
+  larr *r = t->cols[c]->value.arr;
+  lval *x;
+  if (mean) {
+    double s = r->kind == ARR_F64 ? lk->sum_f64(r->data.d, r->count) : lk->sum_i64(r->data.l, r->count);
+    x = lval_double(r->count ? s / r->count : NAN);
+  } else {
+    x = r->kind == ARR_F64 ? lval_double(lk->sum_f64(r->data.d, r->count))
+      : lval_long(lk->sum_i64(r->data.l, r->count));
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_table_sum(lenv *e, lval *a) {
+  return builtin_table_aggn(e, a, "table-sum", 0);
+}
+
+lval *builtin_table_mean(lenv *e, lval *a) {
+  return builtin_table_aggn(e, a, "table-mean", 1);
+}
+
+/* Assigns each row a dense group id in order of first appearance,
+   using an open-addressed hash on the key column. */
+long ltab_groups(lval *key, long n, long *gid, long *first) {
+  long cap = 16;
+  while (cap < 2 * n) { cap *= 2; }
+  long *slots = malloc(sizeof(long) * cap);
+  for (long i = 0; i < cap; i++) { slots[i] = -1; }
+  long groups = 0;
+  for (long i = 0; i < n; i++) {
+    unsigned long h = lval_col_hash(key, i) & (cap - 1);
+    while (slots[h] >= 0 && lval_col_cmp(key, first[slots[h]], i) != 0) { h = (h + 1) & (cap - 1); }
+    if (slots[h] < 0) {
+      slots[h] = groups;
+      first[groups++] = i;
+    }
+    gid[i] = slots[h];
+  }
+  free(slots);
+  return groups;
+}
+
+/* (table-group-by t {key} {sum x} {mean y} {count}) gives one row per
+   distinct key, with aggregate columns named sum-x, mean-y and count.
+   Each aggregate makes a single pass over its column. */
+lval *builtin_table_group_by(lenv *e, lval *a) {
+  LASSERT(a, a->count >= 2, "Function 'table-group-by' passed no key column.");
+  LASSERT_TYPE("table-group-by", a, 0, LVAL_TABLE);
+  ltab *t = a->value.cell[0]->value.tab;
+  char *name = lval_colname(a->value.cell[1]);
+  LASSERT_COL("table-group-by", a, t, k, name);
+  for (int i = 2; i < a->count; i++) {
+    lval *s = a->value.cell[i];
+    LASSERT(a, s->type == LVAL_QEXP && s->count > 0 && s->value.cell[0]->type == LVAL_SYM,
+      "Function 'table-group-by' passed a malformed aggregate. Expected {sum col}, {mean col} or {count}.");
+    char *op = s->value.cell[0]->value.sym;
+    if (strcmp(op, "count") == 0) {
+      LASSERT(a, s->count == 1, "Function 'table-group-by' passed a malformed aggregate. Expected {count}.");
+      continue;
+    }
+    LASSERT(a, (strcmp(op, "sum") == 0 || strcmp(op, "mean") == 0) && s->count == 2,
+      "Function 'table-group-by' passed a malformed aggregate. Expected {sum col}, {mean col} or {count}.");
+    char *col = lval_colname(s->value.cell[1]);
+    LASSERT_COL("table-group-by", a, t, c, col);
+    LASSERT(a, t->cols[c]->type == LVAL_ARRAY,
+      "Function 'table-group-by' passed non-numeric column '%s'.", col);
+  }
+
+  long n = t->nrows;
+  long *gid = malloc(sizeof(long) * (n > 0 ? n : 1));
+  long *first = malloc(sizeof(long) * (n > 0 ? n : 1));
+  long groups = ltab_groups(t->cols[k], n, gid, first);
+  long *counts = calloc(groups > 0 ? groups : 1, sizeof(long));
+  for (long i = 0; i < n; i++) { counts[gid[i]]++; }
+
+  lval *r = lval_table();
+  ltab_add(r->value.tab, t->names[k], lval_col_gather(t->cols[k], first, groups));
+  for (int i = 2; i < a->count; i++) {
+    lval *s = a->value.cell[i];
+    char *op = s->value.cell[0]->value.sym;
+    lval *col;
+    char label[512];
+    if (strcmp(op, "count") == 0) {
+      col = lval_arr(ARR_I64, groups);
+      memcpy(col->value.arr->data.l, counts, sizeof(long) * groups);
+      snprintf(label, sizeof(label), "count");
+    } else {
+      char *cn = lval_colname(s->value.cell[1]);
+      larr *x = t->cols[ltab_find(t, cn)]->value.arr;
+      int mean = strcmp(op, "mean") == 0;
+      col = lval_arr(mean ? ARR_F64 : x->kind, groups);
+      larr *y = col->value.arr;
+      if (y->kind == ARR_I64) {
+	memset(y->data.l, 0, sizeof(long) * groups);
+	for (long j = 0; j < n; j++) { y->data.l[gid[j]] += x->data.l[j]; }
+      } else {
+	memset(y->data.d, 0, sizeof(double) * groups);
+	if (x->kind == ARR_F64) {
+	  for (long j = 0; j < n; j++) { y->data.d[gid[j]] += x->data.d[j]; }
+	} else {
+	  for (long j = 0; j < n; j++) { y->data.d[gid[j]] += x->data.l[j]; }
+	}
+      }
+      if (mean) {
+	for (long g = 0; g < groups; g++) { y->data.d[g] /= counts[g]; }
+      }
+      snprintf(label, sizeof(label), "%s-%s", op, cn);
+    }
+    if (ltab_find(r->value.tab, label) >= 0) {
+      lval_del(col);
+      continue;
+    }
+    ltab_add(r->value.tab, label, col);
+  }
+  r->value.tab->nrows = groups;
+  free(gid);
+  free(first);
+  free(counts);
+  lval_del(a);
+  return r;
+}
+
+/* Splits off the next CSV field in place, undoing "" escapes inside
+   quoted fields. Sets eol when the field ends its record. */
+char *lcsv_field(char **pp, int *eol) {
+  char *p = *pp, *start, *w;
+  if (*p == '"') {
+    start = w = ++p;
+    while (*p) {
+      if (*p == '"') {
+	if (p[1] != '"') { p++; break; }
+	p++;
+      }
+      *w++ = *p++;
+    }
+    while (*p && *p != ',' && *p != '\n' && *p != '\r') { p++; }
+  } else {
+    start = p;
+    while (*p && *p != ',' && *p != '\n' && *p != '\r') { p++; }
+    w = p;
+  }
+  char c = *p;
+  *w = '\0';
+  *eol = c != ',';
+  if (c == ',' || c == '\n') { p++; }
+  if (c == '\r') { p++; if (*p == '\n') { p++; } }
+  *pp = p;
+  return start;
+}
+
+/* Loads a CSV file with a header row. Columns where every field is an
+   integer become i64, other numeric columns f64 (empty fields are NaN)
+   and anything else a string column. */
+lval *builtin_table_load_csv(lenv *e, lval *a) {
+  LASSERT_NUM("table-load-csv", a, 1);
+  LASSERT_TYPE("table-load-csv", a, 0, LVAL_STR);
+  FILE *f = fopen(a->value.cell[0]->value.str, "rb");
+  LASSERT(a, f, "Function 'table-load-csv' could not open '%s'.", a->value.cell[0]->value.str);
+  long size = 0, cap = 65536;
+  char *buf = malloc(cap + 1);
+  size_t got;
+  while ((got = fread(buf + size, 1, cap - size, f)) > 0) {
+    size += got;
+    if (size == cap) { cap *= 2; buf = realloc(buf, cap + 1); }
+  }
+  fclose(f);
+  buf[size] = '\0';
+
+  char *p = buf;
+  int eol = 0;
+  int ncols = 0;
+  char **names = NULL;
+  while (!eol) {
+    names = realloc(names, sizeof(char*) * (ncols + 1));
+    names[ncols++] = lcsv_field(&p, &eol);
+  }
+  char ***fields = malloc(sizeof(char**) * ncols);
+  long rows = 0, rcap = 1024;
+  for (int c = 0; c < ncols; c++) { fields[c] = malloc(sizeof(char*) * rcap); }
+  lval *err = NULL;
+  long line = 1;
+  while (*p && !err) {
+    line++;
+    if (*p == '\n' || *p == '\r') { lcsv_field(&p, &eol); continue; }
+    if (rows == rcap) {
+      rcap *= 2;
+      for (int c = 0; c < ncols; c++) { fields[c] = realloc(fields[c], sizeof(char*) * rcap); }
+    }
+    int c = 0;
+    eol = 0;
+    while (!eol) {
+      char *x = lcsv_field(&p, &eol);
+      if (c < ncols) { fields[c][rows] = x; }
+      c++;
+    }
+    if (c != ncols) {
+      err = lval_err("Function 'table-load-csv' found %i fields on line %li, Expected %i.", c, line, ncols);
+    }
+    rows++;
+  }
+
+  lval *t = err ? NULL : lval_table();
+  for (int c = 0; c < ncols && !err; c++) {
+    int longs = 1, nums = 1;
+    for (long r = 0; r < rows && nums; r++) {
+      char *end, *x = fields[c][r];
+      if (longs) { errno = 0; strtol(x, &end, 10); longs = *x && !*end && errno != ERANGE; }
+      if (!longs && *x) { strtod(x, &end); nums = !*end; }
+    }
+    lval *col;
+    if (nums && rows) {
+      col = lval_arr(longs ? ARR_I64 : ARR_F64, rows);
+      for (long r = 0; r < rows; r++) {
+	if (longs) {
+	  col->value.arr->data.l[r] = strtol(fields[c][r], NULL, 10);
+	} else {
+	  col->value.arr->data.d[r] = *fields[c][r] ? strtod(fields[c][r], NULL) : NAN;
+	}
+      }
+    } else {
+      col = lval_vec();
+      for (long r = 0; r < rows; r++) { lval_vec_push(col->value.vec, lval_str(fields[c][r])); }
+    }
+    if (ltab_find(t->value.tab, names[c]) >= 0) {
+      err = lval_err("Function 'table-load-csv' found duplicate column '%s'.", names[c]);
+      lval_del(col);
+      break;
+    }
+    ltab_add(t->value.tab, names[c], col);
+  }
+  if (t) { t->value.tab->nrows = rows; }
+  for (int c = 0; c < ncols; c++) { free(fields[c]); }
+  free(fields);
+  free(names);
+  free(buf);
+  lval_del(a);
+  if (err) {
+    if (t) { lval_del(t); }
+    return err;
+  }
+  return t;
+}
+
+lval *lval_mat(long rows, long cols) {
+  lval *v = lval_new(LVAL_MATRIX);
+  v->value.mat = malloc(sizeof(lmat));
+  v->value.mat->refs = 1;
+  v->value.mat->rows = rows;
+  v->value.mat->cols = cols;
+  v->value.mat->d = calloc(rows * cols > 0 ? rows * cols : 1, sizeof(double));
+  return v;
+}
+
+lval *builtin_mat(lenv *e, lval *a) {
+  LASSERT_NUM("mat", a, 1);
+  LASSERT_TYPE("mat", a, 0, LVAL_QEXP);
+  lval *rs = a->value.cell[0];
+  long cols = rs->count ? rs->value.cell[0]->count : 0;
+  for (int i = 0; i < rs->count; i++) {
+    lval *r = rs->value.cell[i];
+    LASSERT(a, r->type == LVAL_QEXP && r->count == cols,
+      "Function 'mat' passed a malformed row %i. Expected a list of %li numbers.", i, cols);
+    for (int j = 0; j < r->count; j++) {
+      int t = r->value.cell[j]->type;
+      LASSERT(a, t == LVAL_LONG || t == LVAL_DOUBLE,
+	"Function 'mat' passed incorrect type at (%i %i). Got %s, Expected %s.",
+	i, j, ltype_name(t), ltype_name(LVAL_DOUBLE));
+    }
+  }
+  lval *m = lval_mat(rs->count, cols);
+  for (int i = 0; i < rs->count; i++) {
+    for (int j = 0; j < cols; j++) {
+      lval *x = rs->value.cell[i]->value.cell[j];
+      m->value.mat->d[i * cols + j] = x->type == LVAL_LONG ? x->value.l : x->value.d;
+    }
+  }
+  lval_del(a);
+  return m;
+}
+
+lval *builtin_mat_zeros(lenv *e, lval *a) {
+  LASSERT_NUM("mat-zeros", a, 2);
+  LASSERT_TYPE("mat-zeros", a, 0, LVAL_LONG);
+  LASSERT_TYPE("mat-zeros", a, 1, LVAL_LONG);
+  long r = a->value.cell[0]->value.l, c = a->value.cell[1]->value.l;
+  LASSERT(a, r >= 0 && c >= 0, "Function 'mat-zeros' passed negative size %lix%li.", r, c);
+  lval_del(a);
+  return lval_mat(r, c);
+}
+
+lval *builtin_mat_identity(lenv *e, lval *a) {
+  LASSERT_NUM("mat-identity", a, 1);
+  LASSERT_TYPE("mat-identity", a, 0, LVAL_LONG);
+  long n = a->value.cell[0]->value.l;
+  LASSERT(a, n >= 0, "Function 'mat-identity' passed negative size %li.", n);
+  lval *m = lval_mat(n, n);
+  for (long i = 0; i < n; i++) { m->value.mat->d[i * n + i] = 1; }
+  lval_del(a);
+  return m;
+}
+
+#define LASSERT_MAT_INDEX(func, args, m, i, j) \
+  LASSERT(args, i >= 0 && i < m->rows && j >= 0 && j < m->cols, \
+    "Function '%s' passed index (%li %li) out of range for %lix%li matrix.", \
+    func, i, j, m->rows, m->cols)
+
+lval *builtin_mat_ref(lenv *e, lval *a) {
+  LASSERT_NUM("mat-ref", a, 3);
+  LASSERT_TYPE("mat-ref", a, 0, LVAL_MATRIX);
+  LASSERT_TYPE("mat-ref", a, 1, LVAL_LONG);
+  LASSERT_TYPE("mat-ref", a, 2, LVAL_LONG);
+  lmat *m = a->value.cell[0]->value.mat;
+  long i = a->value.cell[1]->value.l, j = a->value.cell[2]->value.l;
+  LASSERT_MAT_INDEX("mat-ref", a, m, i, j);
+  lval *x = lval_double(m->d[i * m->cols + j]);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_mat_set(lenv *e, lval *a) {
+  LASSERT_NUM("mat-set!", a, 4);
+  LASSERT_TYPE("mat-set!", a, 0, LVAL_MATRIX);
+  LASSERT_TYPE("mat-set!", a, 1, LVAL_LONG);
+  LASSERT_TYPE("mat-set!", a, 2, LVAL_LONG);
+  lmat *m = a->value.cell[0]->value.mat;
+  long i = a->value.cell[1]->value.l, j = a->value.cell[2]->value.l;
+  LASSERT_MAT_INDEX("mat-set!", a, m, i, j);
+  lval *x = a->value.cell[3];
+  LASSERT(a, x->type == LVAL_LONG || x->type == LVAL_DOUBLE,
+    "Function 'mat-set!' passed incorrect type for argument 3. Got %s, Expected %s.",
+    ltype_name(x->type), ltype_name(LVAL_DOUBLE));
+  m->d[i * m->cols + j] = x->type == LVAL_LONG ? x->value.l : x->value.d;
+  return lval_take(a, 0);
+}
+
+lval *builtin_mat_rows(lenv *e, lval *a) {
+  LASSERT_NUM("mat-rows", a, 1);
+  LASSERT_TYPE("mat-rows", a, 0, LVAL_MATRIX);
+  lval *x = lval_long(a->value.cell[0]->value.mat->rows);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_mat_cols(lenv *e, lval *a) {
+  LASSERT_NUM("mat-cols", a, 1);
+  LASSERT_TYPE("mat-cols", a, 0, LVAL_MATRIX);
+  lval *x = lval_long(a->value.cell[0]->value.mat->cols);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_mat_to_list(lenv *e, lval *a) {
+  LASSERT_NUM("mat->list", a, 1);
+  LASSERT_TYPE("mat->list", a, 0, LVAL_MATRIX);
+  lmat *m = a->value.cell[0]->value.mat;
+  lval *x = lval_qexp();
+  for (long i = 0; i < m->rows; i++) {
+    lval *r = lval_qexp();
+    for (long j = 0; j < m->cols; j++) { r = lval_add(r, lval_double(m->d[i * m->cols + j])); }
+    x = lval_add(x, r);
+  }
+  lval_del(a);
+  return x;
+}
+
+#define MAT_TILE 32
+
+/* Transposes tile by tile so both sides are touched in cache lines. */
+lval *builtin_mat_transpose(lenv *e, lval *a) {
+  LASSERT_NUM("mat-transpose", a, 1);
+  LASSERT_TYPE("mat-transpose", a, 0, LVAL_MATRIX);
+  lmat *m = a->value.cell[0]->value.mat;
+  lval *t = lval_mat(m->cols, m->rows);
+  double *d = t->value.mat->d;
+  for (long ii = 0; ii < m->rows; ii += MAT_TILE) {
+    for (long jj = 0; jj < m->cols; jj += MAT_TILE) {
+      long ie = ii + MAT_TILE < m->rows ? ii + MAT_TILE : m->rows;
+      long je = jj + MAT_TILE < m->cols ? jj + MAT_TILE : m->cols;
+      for (long i = ii; i < ie; i++) {
+	for (long j = jj; j < je; j++) { d[j * m->rows + i] = m->d[i * m->cols + j]; }
+      }
+    }
+  }
+  lval_del(a);
+  return t;
+}
+
+/* Block sizes keep a 64x256 panel of B (128K) resident while rows of A
+   stream past it; the innermost step is a SIMD axpy along a row of C. */
+#define MAT_BLOCK_I 64
+#define MAT_BLOCK_K 64
+#define MAT_BLOCK_J 256
+
+void lmat_mul_rows(const double *a, const double *b, double *c, long k, long m, long lo, long hi) {
+  for (long jj = 0; jj < m; jj += MAT_BLOCK_J) {
+    long jn = jj + MAT_BLOCK_J < m ? MAT_BLOCK_J : m - jj;
+    for (long kk = 0; kk < k; kk += MAT_BLOCK_K) {
+      long ke = kk + MAT_BLOCK_K < k ? kk + MAT_BLOCK_K : k;
+      for (long ii = lo; ii < hi; ii += MAT_BLOCK_I) {
+	long ie = ii + MAT_BLOCK_I < hi ? ii + MAT_BLOCK_I : hi;
+	for (long i = ii; i < ie; i++) {
+	  for (long p = kk; p < ke; p++) {
+	    lk->axpy_f64(c + i * m + jj, a[i * k + p], b + p * m + jj, jn);
+	  }
+	}
+      }
+    }
+  }
+}
+
+/* Native kernels that split work across threads use LIZ_THREADS of
+   them, by default one per online core. */
+#define LPAR_MAX_THREADS 64
+
+int lpar_threads(void) {
+  static int n = 0;
+  if (!n) {
+    char *s = getenv("LIZ_THREADS");
+    n = s ? atoi(s) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) { n = 1; }
+    if (n > LPAR_MAX_THREADS) { n = LPAR_MAX_THREADS; }
+  }
+  return n;
+}
+
+/* Runs fn over n jobs laid out size bytes apart, one per thread, with
+   the first on the caller. A job whose thread cannot start runs on the
+   caller too. */
+void lpar_run(void *(*fn)(void*), void *jobs, size_t size, int n) {
+  pthread_t th[LPAR_MAX_THREADS];
+  int started[LPAR_MAX_THREADS];
+  for (int i = 1; i < n; i++) {
+    started[i] = pthread_create(&th[i], NULL, fn, (char*)jobs + i * size) == 0;
+  }
+  fn(jobs);
+  for (int i = 1; i < n; i++) {
+    if (started[i]) {
+      pthread_join(th[i], NULL);
+    } else {
+      fn((char*)jobs + i * size);
+    }
+  }
+}
+
+/* Products with at least this many multiply-adds are split by rows of
+   the result across threads. */
+#ifndef LIZ_MAT_PAR_FLOPS
+#define LIZ_MAT_PAR_FLOPS (1L << 22)
+#endif
+
+typedef struct {
+  const double *a, *b;
+  double *c;
+  long k, m, lo, hi;
+} lmat_job;
+
+void *lmat_worker(void *p) {
+  lmat_job *j = p;
+  lmat_mul_rows(j->a, j->b, j->c, j->k, j->m, j->lo, j->hi);
+  return NULL;
+}
+
+void lmat_mul(const double *a, const double *b, double *c, long n, long k, long m) {
+  int t = lpar_threads();
+  if (t > n) { t = n; }
+  if (t < 2 || (double)n * k * m < LIZ_MAT_PAR_FLOPS) {
+    lmat_mul_rows(a, b, c, k, m, 0, n);
+    return;
+  }
+  lmat_job jobs[LPAR_MAX_THREADS];
+  for (int i = 0; i < t; i++) {
+    lmat_job j = { a, b, c, k, m, n * i / t, n * (i + 1) / t };
+    jobs[i] = j;
+  }
+  lpar_run(lmat_worker, jobs, sizeof(lmat_job), t);
+}
+
+/* Multiplies two matrices, or a matrix by an f64 array taken as a
+   column vector, which gives an f64 array back. */
+lval *builtin_mat_mul(lenv *e, lval *a) {
+  LASSERT_NUM("mat-mul", a, 2);
+  LASSERT_TYPE("mat-mul", a, 0, LVAL_MATRIX);
+  lmat *x = a->value.cell[0]->value.mat;
+  lval *b = a->value.cell[1];
+  if (b->type == LVAL_ARRAY) {
+    LASSERT(a, b->value.arr->kind == ARR_F64 && b->value.arr->count == x->cols,
+      "Function 'mat-mul' passed a vector that is not an f64 array of %li elements.", x->cols);
+    lval *r = lval_arr(ARR_F64, x->rows);
+    for (long i = 0; i < x->rows; i++) {
+      r->value.arr->data.d[i] = lk->dot_f64(x->d + i * x->cols, b->value.arr->data.d, x->cols);
+    }
+    lval_del(a);
+    return r;
+  }
+  LASSERT_TYPE("mat-mul", a, 1, LVAL_MATRIX);
+  lmat *y = b->value.mat;
+  LASSERT(a, x->cols == y->rows,
+    "Function 'mat-mul' passed incompatible shapes %lix%li and %lix%li.",
+    x->rows, x->cols, y->rows, y->cols);
+  lval *r = lval_mat(x->rows, y->cols);
+  lmat_mul(x->d, y->d, r->value.mat->d, x->rows, x->cols, y->cols);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_mat_map(lenv *e, lval *a, char *func, int op) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_MATRIX);
+  lmat *x = a->value.cell[0]->value.mat;
+  lval *b = a->value.cell[1];
+  double k;
+  const double *y = &k;
+  int bs = 0;
+  if (b->type == LVAL_MATRIX) {
+    LASSERT(a, b->value.mat->rows == x->rows && b->value.mat->cols == x->cols,
+      "Function '%s' passed mismatched shapes %lix%li and %lix%li.",
+      func, x->rows, x->cols, b->value.mat->rows, b->value.mat->cols);
+    y = b->value.mat->d;
+    bs = 1;
+  } else {
+    LASSERT(a, b->type == LVAL_LONG || b->type == LVAL_DOUBLE,
+      "Function '%s' passed incorrect type for argument 1. Got %s, Expected %s.",
+      func, ltype_name(b->type), ltype_name(LVAL_MATRIX));
+    k = b->type == LVAL_LONG ? b->value.l : b->value.d;
+  }
+  lval *r = lval_mat(x->rows, x->cols);
+  lk->op_f64(op, r->value.mat->d, x->d, y, bs, x->rows * x->cols);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_mat_add(lenv *e, lval *a) {
+  return builtin_mat_map(e, a, "mat+", ARR_ADD);
+}
+
+lval *builtin_mat_sub(lenv *e, lval *a) {
+  return builtin_mat_map(e, a, "mat-", ARR_SUB);
+}
+
+lval *builtin_mat_mul_elem(lenv *e, lval *a) {
+  return builtin_mat_map(e, a, "mat*", ARR_MUL);
+}
+
+lval *builtin_mat_div(lenv *e, lval *a) {
+  return builtin_mat_map(e, a, "mat/", ARR_DIV);
+}
+
+/* Sorting works on (key, index) pairs. Long, double and string keys
+   under the default or a builtin comparator compare natively, without
+   lval_call, and are the only ones sorted on several threads; any
+   other comparator is called like a function and runs on the caller's
+   thread. Neither path is stable. */
+#ifndef LIZ_SORT_PAR
+#define LIZ_SORT_PAR (1L << 16)
+#endif
+#define LSORT_INSERTION 16
+
+enum { LSORT_LONG, LSORT_DOUBLE, LSORT_STR, LSORT_CALL };
+
+typedef struct {
+  union {
+    long l;
+    double d;
+    lval *v;
+  } k;
+  long i;
+} lsort_el;
+
+typedef struct {
+  int mode;
+  int desc;
+  lenv *e;
+  lval *f;
+  lval *err;
+} lsort_ctx;
+
+int lsort_less(lsort_ctx *c, lsort_el *x, lsort_el *y) {
+  switch (c->mode) {
+  case LSORT_LONG: return c->desc ? x->k.l > y->k.l : x->k.l < y->k.l;
+  case LSORT_DOUBLE: return c->desc ? x->k.d > y->k.d : x->k.d < y->k.d;
+  case LSORT_STR: {
+    int o = strcmp(x->k.v->value.str, y->k.v->value.str);
+    return c->desc ? o > 0 : o < 0;
+  }
+  }
+  if (c->err) { return 0; }
+  lval *r = lval_call_with(c->e, c->f, lval_add(lval_add(lval_sexp(), lval_copy(x->k.v)), lval_copy(y->k.v)));
+  if (r->type == LVAL_ERR) { c->err = r; return 0; }
+  int less = lval_truthy(r);
+  lval_del(r);
+  return less;
+}
+
+#define LSORT_SWAP(a, i, j) { lsort_el t_ = a[i]; a[i] = a[j]; a[j] = t_; }
+
+void lsort_insertion(lsort_ctx *c, lsort_el *a, long n) {
+  for (long i = 1; i < n; i++) {
+    lsort_el x = a[i];
+    long j = i;
+    while (j > 0 && lsort_less(c, &x, &a[j-1])) { a[j] = a[j-1]; j--; }
+    a[j] = x;
+  }
+}
+
+void lsort_sift(lsort_ctx *c, lsort_el *a, long i, long n) {
+  for (;;) {
+    long m = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && lsort_less(c, &a[m], &a[l])) { m = l; }
+    if (r < n && lsort_less(c, &a[m], &a[r])) { m = r; }
+    if (m == i) { return; }
+    LSORT_SWAP(a, i, m);
+    i = m;
+  }
+}
+
+void lsort_heap(lsort_ctx *c, lsort_el *a, long n) {
+  for (long i = n / 2 - 1; i >= 0; i--) { lsort_sift(c, a, i, n); }
+  for (long i = n - 1; i > 0; i--) {
+    LSORT_SWAP(a, 0, i);
+    lsort_sift(c, a, 0, i);
+  }
+}
+
+/* Median-of-three quicksort that falls back to heapsort past the depth
+   limit and finishes short runs with insertion sort. The partition
+   scans are bounded so an inconsistent comparator cannot overrun. */
+void lsort_intro(lsort_ctx *c, lsort_el *a, long n, int depth) {
+  while (n > LSORT_INSERTION && !c->err) {
+    if (depth-- == 0) { lsort_heap(c, a, n); return; }
+    long m = n / 2;
+    if (lsort_less(c, &a[m], &a[0])) { LSORT_SWAP(a, 0, m); }
+    if (lsort_less(c, &a[n-1], &a[0])) { LSORT_SWAP(a, 0, n-1); }
+    if (lsort_less(c, &a[n-1], &a[m])) { LSORT_SWAP(a, m, n-1); }
+    lsort_el p = a[m];
+    long i = -1, j = n;
+    for (;;) {
+      do { i++; } while (i < n - 1 && lsort_less(c, &a[i], &p));
+      do { j--; } while (j > 0 && lsort_less(c, &p, &a[j]));
+      if (i >= j) { break; }
+      LSORT_SWAP(a, i, j);
+    }
+    long left = j + 1;
+    if (left < n - left) {
+      lsort_intro(c, a, left, depth);
+      a += left;
+      n -= left;
+    } else {
+      lsort_intro(c, a + left, n - left, depth);
+      n = left;
+    }
+  }
+  if (!c->err) { lsort_insertion(c, a, n); }
+}
+
+int lsort_depth(long n) {
+  int d = 0;
+  while (n > 1) { n >>= 1; d += 2; }
+  return d;
+}
+
+void lsort_merge(lsort_ctx *c, lsort_el *a, long mid, long n, lsort_el *out) {
+  long i = 0, j = mid, k = 0;
+  while (i < mid && j < n) { out[k++] = lsort_less(c, &a[j], &a[i]) ? a[j++] : a[i++]; }
+  while (i < mid) { out[k++] = a[i++]; }
+  while (j < n) { out[k++] = a[j++]; }
+}
+
+typedef struct {
+  lsort_ctx *c;
+  lsort_el *a;
+  long mid;
+  long n;
+  lsort_el *out;
+} lsort_job;
+
+void *lsort_worker(void *p) {
+  lsort_job *j = p;
+  if (j->out) {
+    lsort_merge(j->c, j->a, j->mid, j->n, j->out);
+  } else {
+    lsort_intro(j->c, j->a, j->n, lsort_depth(j->n));
+  }
+  return NULL;
+}
+
+/* Large native sorts introsort one chunk per thread, then merge the
+   chunks pairwise, each merge of a level on its own thread. */
+void lsort_run(lsort_ctx *c, lsort_el *a, long n) {
+  int t = lpar_threads();
+  if (c->mode == LSORT_CALL || t < 2 || n < LIZ_SORT_PAR) {
+    lsort_intro(c, a, n, lsort_depth(n));
+    return;
+  }
+  long bounds[LPAR_MAX_THREADS + 1];
+  lsort_job jobs[LPAR_MAX_THREADS];
+  for (int i = 0; i <= t; i++) { bounds[i] = n * i / t; }
+  for (int i = 0; i < t; i++) {
+    lsort_job j = { c, a + bounds[i], 0, bounds[i+1] - bounds[i], NULL };
+    jobs[i] = j;
+  }
+  lpar_run(lsort_worker, jobs, sizeof(lsort_job), t);
+
+  lsort_el *tmp = malloc(sizeof(lsort_el) * n);
+  lsort_el *src = a, *dst = tmp;
+  for (int w = 1; w < t; w *= 2) {
+    int m = 0;
+    for (int i = 0; i < t; i += 2 * w) {
+      long lo = bounds[i];
+      long mid = bounds[i + w < t ? i + w : t];
+      long hi = bounds[i + 2 * w < t ? i + 2 * w : t];
+      lsort_job j = { c, src + lo, mid - lo, hi - lo, dst + lo };
+      jobs[m++] = j;
+    }
+    lpar_run(lsort_worker, jobs, sizeof(lsort_job), m);
+    lsort_el *s = src; src = dst; dst = s;
+  }
+  if (src != a) { memcpy(a, src, sizeof(lsort_el) * n); }
+  free(tmp);
+}
+
+lval *builtin_sortn(lenv *e, lval *a, char *func, int by) {
+  LASSERT(a, a->count == by + 1 || a->count == by + 2,
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i or %i.",
+    func, a->count, by + 1, by + 2);
+  if (by) { LASSERT_TYPE(func, a, 0, LVAL_FUN); }
+  lval *l = a->value.cell[by];
+  LASSERT(a, l->type == LVAL_QEXP || l->type == LVAL_VECTOR,
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s or %s.",
+    func, by, ltype_name(l->type), ltype_name(LVAL_QEXP), ltype_name(LVAL_VECTOR));
+  lval *cmp = a->count == by + 2 ? a->value.cell[by+1] : NULL;
+  if (cmp) { LASSERT_TYPE(func, a, by + 1, LVAL_FUN); }
+
+  if (l->type == LVAL_QEXP) { lval_reserve(l, 0); }
+  long n = l->type == LVAL_VECTOR ? l->value.vec->count : l->count;
+  lval **items = l->type == LVAL_VECTOR ? l->value.vec->items : l->value.cell;
+  lval **keys = items;
+  if (by) {
+    keys = malloc(sizeof(lval*) * (n > 0 ? n : 1));
+    for (long i = 0; i < n; i++) {
+      keys[i] = lval_call1(e, a->value.cell[0], lval_copy(items[i]));
+      if (keys[i]->type == LVAL_ERR) {
+	lval *err = keys[i];
+	while (i--) { lval_del(keys[i]); }
+	free(keys);
+	lval_del(a);
+	return err;
+      }
+    }
+  }
+
+  /* Keys of one unboxed type sort natively; a mix of numbers goes
+     through the comparator, which for < and > orders them across the
+     tower. Strings only order against strings. */
+  lval *lt = cmp ? NULL : lval_fun(builtin_lt);
+  lsort_ctx c = { LSORT_CALL, 0, e, cmp ? cmp : lt, NULL };
+  lbuiltin b = c.f->value.builtin;
+  if (b == builtin_lt || b == builtin_le || b == builtin_gt || b == builtin_ge) {
+    c.desc = b == builtin_gt || b == builtin_ge;
+    int t = n ? keys[0]->type : LVAL_LONG;
+    for (long i = 0; i < n && !c.err; i++) {
+      int k = keys[i]->type;
+      if ((lnum_rank(k) < 0 && k != LVAL_STR) || (k == LVAL_STR) != (keys[0]->type == LVAL_STR)) {
+	c.err = lval_err("Function '%s' cannot order %s and %s.", func, ltype_name(keys[0]->type), ltype_name(k));
+      }
+      if (k != keys[0]->type) { t = -1; }
+    }
+    c.mode = t == LVAL_LONG ? LSORT_LONG : t == LVAL_DOUBLE ? LSORT_DOUBLE :
+      t == LVAL_STR ? LSORT_STR : LSORT_CALL;
+  }
+
+  lsort_el *els = malloc(sizeof(lsort_el) * (n > 0 ? n : 1));
+  for (long i = 0; i < n; i++) {
+    switch (c.mode) {
+    case LSORT_LONG: els[i].k.l = keys[i]->value.l; break;
+    case LSORT_DOUBLE: els[i].k.d = keys[i]->value.d; break;
+    default: els[i].k.v = keys[i]; break;
+    }
+    els[i].i = i;
+  }
+  if (!c.err) { lsort_run(&c, els, n); }
+
+  lval *r = NULL;
+  if (!c.err && l->type == LVAL_QEXP) {
+    r = lval_qexp();
+    lval_reserve(r, n);
+    r->count = n;
+    for (long i = 0; i < n; i++) { r->value.cell[i] = items[els[i].i]; }
+    l->count = 0;
+  } else if (!c.err) {
+    r = lval_vec();
+    for (long i = 0; i < n; i++) { lval_vec_push(r->value.vec, lval_copy(items[els[i].i])); }
+  }
+  if (by) {
+    for (long i = 0; i < n; i++) { lval_del(keys[i]); }
+    free(keys);
+  }
+  free(els);
+  if (lt) { lval_del(lt); }
+  lval_del(a);
+  return c.err ? c.err : r;
+}
+
+lval *builtin_sort(lenv *e, lval *a) {
+  return builtin_sortn(e, a, "sort", 0);
+}
+
+lval *builtin_sort_by(lenv *e, lval *a) {
+  return builtin_sortn(e, a, "sort-by", 1);
+}
+
+enum { LH_SET, LH_INS, LH_DEL };
+
+lhamt *lhamt_node(unsigned int bitmap, int count) {
+  lhamt *n = malloc(sizeof(lhamt) + sizeof(lhslot) * count);
+  n->refs = 1;
+  n->bitmap = bitmap;
+  n->count = count;
+  return n;
+}
+
+lhslot lhslot_leaf(lhleaf *x) { lhslot s = { NULL, x }; return s; }
+lhslot lhslot_sub(lhamt *n) { lhslot s = { n, NULL }; return s; }
+
+/* Copies n with slot i replaced by s, s inserted before slot i, or slot
+   i removed. The copy owns s and shares every other slot with n. */
+lhamt *lhamt_edit(lhamt *n, unsigned int bitmap, int i, int op, lhslot s) {
+  int count = n ? n->count : 0;
+  lhamt *m = lhamt_node(bitmap, count + (op == LH_INS) - (op == LH_DEL));
+  int j = 0;
+  for (int k = 0; k <= count; k++) {
+    if (k == i && op != LH_DEL) { m->slots[j++] = s; }
+    if (k == count || (k == i && op != LH_INS)) { continue; }
+    m->slots[j] = n->slots[k];
+    if (m->slots[j].sub) { m->slots[j].sub->refs++; } else { m->slots[j].leaf->refs++; }
+    j++;
+  }
+  return m;
+}
+
+/* Two leaves whose hashes agree below shift get a chain of nodes down
+   to the first fragment where they differ. */
+lhamt *lhamt_pair(int shift, lhleaf *x, lhleaf *y) {
+  if (shift >= LHAMT_DEPTH) {
+    lhamt *n = lhamt_node(0, 2);
+    n->slots[0] = lhslot_leaf(x);
+    n->slots[1] = lhslot_leaf(y);
+    return n;
+  }
+  unsigned int fx = LHAMT_FRAG(x->hash, shift), fy = LHAMT_FRAG(y->hash, shift);
+  if (fx == fy) {
+    lhamt *n = lhamt_node(1u << fx, 1);
+    n->slots[0] = lhslot_sub(lhamt_pair(shift + LHAMT_BITS, x, y));
+    return n;
+  }
+  lhamt *n = lhamt_node((1u << fx) | (1u << fy), 2);
+  n->slots[fx > fy] = lhslot_leaf(x);
+  n->slots[fx < fy] = lhslot_leaf(y);
+  return n;
+}
+
+/* Returns the version of n that also holds x, which it takes. */
+lhamt *lhamt_assoc(lhamt *n, int shift, lhleaf *x, int *added) {
+  if (shift >= LHAMT_DEPTH) {
+    for (int i = 0; i < n->count; i++) {
+      if (lhleaf_match(n->slots[i].leaf, x->hash, x->key)) {
+	return lhamt_edit(n, 0, i, LH_SET, lhslot_leaf(x));
+      }
+    }
+    *added = 1;
+    return lhamt_edit(n, 0, n->count, LH_INS, lhslot_leaf(x));
+  }
+  unsigned int bit = 1u << LHAMT_FRAG(x->hash, shift);
+  unsigned int bitmap = n ? n->bitmap : 0;
+  int i = __builtin_popcount(bitmap & (bit - 1));
+  if (!(bitmap & bit)) {
+    *added = 1;
+    return lhamt_edit(n, bitmap | bit, i, LH_INS, lhslot_leaf(x));
+  }
+  lhslot s = n->slots[i];
+  if (s.sub) {
+    return lhamt_edit(n, bitmap, i, LH_SET, lhslot_sub(lhamt_assoc(s.sub, shift + LHAMT_BITS, x, added)));
+  }
+  if (lhleaf_match(s.leaf, x->hash, x->key)) {
+    return lhamt_edit(n, bitmap, i, LH_SET, lhslot_leaf(x));
+  }
+  *added = 1;
+  s.leaf->refs++;
+  return lhamt_edit(n, bitmap, i, LH_SET, lhslot_sub(lhamt_pair(shift + LHAMT_BITS, s.leaf, x)));
+}
+
+/* Returns the version of n without k: n itself, retained, when k is
+   absent, and NULL once nothing is left. A node reduced to one leaf
+   folds into its parent. */
+lhamt *lhamt_dissoc(lhamt *n, int shift, unsigned long h, lval *k, int *removed) {
+  if (!n) { return NULL; }
+  unsigned int bit = 0;
+  int i = 0;
+  if (shift >= LHAMT_DEPTH) {
+    while (i < n->count && !lhleaf_match(n->slots[i].leaf, h, k)) { i++; }
+    if (i == n->count) { n->refs++; return n; }
+  } else {
+    bit = 1u << LHAMT_FRAG(h, shift);
+    if (!(n->bitmap & bit)) { n->refs++; return n; }
+    i = __builtin_popcount(n->bitmap & (bit - 1));
+    lhamt *sub = n->slots[i].sub;
+    if (sub) {
+      lhamt *c = lhamt_dissoc(sub, shift + LHAMT_BITS, h, k, removed);
+      if (c == sub) {
+	lhamt_release(c);
+	n->refs++;
+	return n;
+      }
+      if (c && c->count == 1 && c->slots[0].leaf) {
+	lhleaf *x = c->slots[0].leaf;
+	x->refs++;
+	lhamt_release(c);
+	return lhamt_edit(n, n->bitmap, i, LH_SET, lhslot_leaf(x));
+      }
+      if (c) { return lhamt_edit(n, n->bitmap, i, LH_SET, lhslot_sub(c)); }
+    } else if (!lhleaf_match(n->slots[i].leaf, h, k)) {
+      n->refs++;
+      return n;
+    }
+  }
+  *removed = 1;
+  if (n->count == 1) { return NULL; }
+  return lhamt_edit(n, n->bitmap & ~bit, i, LH_DEL, lhslot_sub(NULL));
+}
+
+/* Updates m, which the caller owns, to point at a new trie. Copies
+   of m keep the old one. */
+void lval_map_put(lval *m, lval *k, lval *v) {
+  lhleaf *x = malloc(sizeof(lhleaf));
+  x->refs = 1;
+  x->hash = lval_hash(k);
+  x->key = k;
+  x->val = v;
+  int added = 0;
+  lhamt *r = lhamt_assoc(m->value.map, 0, x, &added);
+  lhamt_release(m->value.map);
+  m->value.map = r;
+  m->count += added;
+}
+
+void lval_map_remove(lval *m, lval *k) {
+  int removed = 0;
+  lhamt *r = lhamt_dissoc(m->value.map, 0, lval_hash(k), k, &removed);
+  lhamt_release(m->value.map);
+  m->value.map = r;
+  m->count -= removed;
+}
+
+/* Appends keys (what 0), values (1) or both (2) to l. */
+void lhamt_collect(lhamt *n, lval *l, int what) {
+  for (int i = 0; n && i < n->count; i++) {
+    lhleaf *x = n->slots[i].leaf;
+    if (n->slots[i].sub) {
+      lhamt_collect(n->slots[i].sub, l, what);
+      continue;
+    }
+    if (what != 1) { lval_add(l, lval_copy(x->key)); }
+    if (what != 0 && x->val) { lval_add(l, lval_copy(x->val)); }
+  }
+}
+
+/* Puts the pairs (or, for sets, the elements) of a from index start
+   into m, which is returned. Consumes a. */
+lval *lval_map_fill(lval *m, lval *a, int start) {
+  while (a->count > start) {
+    lval *k = lval_pop(a, start);
+    lval_map_put(m, k, m->type == LVAL_MAP ? lval_pop(a, start) : NULL);
+  }
+  lval_del(a);
+  return m;
+}
+
+lval *builtin_hash_map(lenv *e, lval *a) {
+  LASSERT(a, a->count % 2 == 0,
+    "Function 'hash-map' passed an odd number of arguments. Got %i.", a->count);
+  return lval_map_fill(lval_map(LVAL_MAP), a, 0);
+}
+
+lval *builtin_hash_set(lenv *e, lval *a) {
+  return lval_map_fill(lval_map(LVAL_SET), a, 0);
+}
+
+/* Zero-argument calls are not expressible, so empty maps and sets
+   come from converting empty lists. */
+lval *builtin_list_to_map(lenv *e, lval *a) {
+  LASSERT_NUM("list->map", a, 1);
+  LASSERT_TYPE("list->map", a, 0, LVAL_QEXP);
+  LASSERT(a, a->value.cell[0]->count % 2 == 0,
+    "Function 'list->map' passed a list of odd length. Got %i.", a->value.cell[0]->count);
+  return lval_map_fill(lval_map(LVAL_MAP), lval_take(a, 0), 0);
+}
+
+lval *builtin_list_to_set(lenv *e, lval *a) {
+  LASSERT_NUM("list->set", a, 1);
+  LASSERT_TYPE("list->set", a, 0, LVAL_QEXP);
+  return lval_map_fill(lval_map(LVAL_SET), lval_take(a, 0), 0);
+}
+
+lval *builtin_assoc(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0,
+    "Function 'assoc' passed incorrect number of arguments. Got %i, Expected at least %i.", a->count, 1);
+  LASSERT_MAP("assoc", a, 0);
+  LASSERT(a, a->value.cell[0]->type == LVAL_SET || a->count % 2 == 1,
+    "Function 'assoc' passed a key without a value.");
+  return lval_map_fill(lval_pop(a, 0), a, 0);
+}
+
+lval *builtin_dissoc(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0,
+    "Function 'dissoc' passed incorrect number of arguments. Got %i, Expected at least %i.", a->count, 1);
+  LASSERT_MAP("dissoc", a, 0);
+  lval *m = lval_pop(a, 0);
+  for (int i = 0; i < a->count; i++) { lval_map_remove(m, a->value.cell[i]); }
+  lval_del(a);
+  return m;
+}
+
+/* (get m k) or (get m k default). Sets return the element itself. */
+lval *builtin_get(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'get' passed incorrect number of arguments. Got %i, Expected %i or %i.", a->count, 2, 3);
+  LASSERT_MAP("get", a, 0);
+  lval *k = a->value.cell[1];
+  lhleaf *x = lhamt_get(a->value.cell[0]->value.map, lval_hash(k), k);
+  LASSERT(a, x || a->count == 3, "Function 'get' found no such key.");
+  lval *r = x ? lval_copy(x->val ? x->val : x->key) : lval_pop(a, 2);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_contains(lenv *e, lval *a) {
+  LASSERT_NUM("contains?", a, 2);
+  LASSERT_MAP("contains?", a, 0);
+  lval *k = a->value.cell[1];
+  lval *r = lval_booln(lhamt_get(a->value.cell[0]->value.map, lval_hash(k), k) != NULL);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_map_list(lenv *e, lval *a, char *func, int what) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_MAP(func, a, 0);
+  lval *l = lval_qexp();
+  lhamt_collect(a->value.cell[0]->value.map, l, what);
+  lval_del(a);
+  return l;
+}
+
+lval *builtin_keys(lenv *e, lval *a) {
+  return builtin_map_list(e, a, "keys", 0);
+}
+
+lval *builtin_vals(lenv *e, lval *a) {
+  return builtin_map_list(e, a, "vals", 1);
+}
+
+lval *builtin_map_to_list(lenv *e, lval *a) {
+  return builtin_map_list(e, a, "map->list", 2);
+}
+
+lval *builtin_rec_new(lval *f, lval *a) {
+  lrtype *t = f->rtype;
+  LASSERT(a, a->count == t->count,
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", t->name, a->count, t->count);
+  lval *r = lval_rec(t);
+  lval_reserve(a, 0);
+  memcpy(r->value.rec->slots, a->value.cell, sizeof(lval*) * t->count);
+  a->count = 0;
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_rec_is(lval *f, lval *a) {
+  lrtype *t = f->rtype;
+  LASSERT(a, a->count == 1,
+    "Function '%s?' passed incorrect number of arguments. Got %i, Expected %i.", t->name, a->count, 1);
+  lval *x = a->value.cell[0];
+  lval *r = lval_booln(x->type == LVAL_RECORD && x->value.rec->type == t);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_rec_get(lval *f, lval *a) {
+  lrtype *t = f->rtype;
+  int i = f->count;
+  char *field = t->fields[i];
+  LASSERT(a, a->count == 1,
+    "Function '%s-%s' passed incorrect number of arguments. Got %i, Expected %i.", t->name, field, a->count, 1);
+  lval *x = a->value.cell[0];
+  LASSERT(a, x->type == LVAL_RECORD && x->value.rec->type == t,
+    "Function '%s-%s' passed incorrect type for argument 0. Got %s, Expected %s.", t->name, field,
+    x->type == LVAL_RECORD ? x->value.rec->type->name : ltype_name(x->type), t->name);
+  lval *r = lval_copy(x->value.rec->slots[i]);
+  lval_del(a);
+  return r;
+}
+
+/* Binds name, sep and field run together to an operation of t. */
+void lrtype_def(lenv *e, lrtype *t, char *sep, char *field, lrecop op, int index) {
+  char *name = malloc(strlen(t->name) + strlen(sep) + strlen(field) + 1);
+  strcpy(name, t->name);
+  strcat(name, sep);
+  strcat(name, field);
+  lval *k = lval_sym(name);
+  lval *f = lval_fun(NULL);
+  f->value.recop = op;
+  f->rtype = t;
+  f->count = index;
+  t->refs++;
+  lenv_def(e, k, f);
+  lval_del(k);
+  lval_del(f);
+  free(name);
+}
+
+/* (defrecord {name field ...}) defines the constructor name, the
+   predicate name? and an accessor name-field per field. */
+lval *builtin_defrecord(lenv *e, lval *a) {
+  LASSERT_NUM("defrecord", a, 1);
+  LASSERT_TYPE("defrecord", a, 0, LVAL_QEXP);
+  LASSERT_NOT_EMPTY("defrecord", a, 0);
+  lval *d = a->value.cell[0];
+  for (int i = 0; i < d->count; i++) {
+    LASSERT(a, d->value.cell[i]->type == LVAL_SYM,
+      "Function 'defrecord' cannot define non-symbol. Got %s, Expected %s.",
+      ltype_name(d->value.cell[i]->type), ltype_name(LVAL_SYM));
+  }
+  lrtype *t = malloc(sizeof(lrtype));
+  t->refs = 1;
+  t->name = malloc(strlen(d->value.cell[0]->value.sym) + 1);
+  strcpy(t->name, d->value.cell[0]->value.sym);
+  t->count = d->count - 1;
+  t->fields = malloc(sizeof(char*) * (t->count > 0 ? t->count : 1));
+  for (int i = 0; i < t->count; i++) {
+    t->fields[i] = malloc(strlen(d->value.cell[i+1]->value.sym) + 1);
+    strcpy(t->fields[i], d->value.cell[i+1]->value.sym);
+  }
+
+  lenv_epoch++;
+  lrtype_def(e, t, "", "", builtin_rec_new, 0);
+  lrtype_def(e, t, "?", "", builtin_rec_is, 0);
+  for (int i = 0; i < t->count; i++) {
+    lrtype_def(e, t, "-", t->fields[i], builtin_rec_get, i);
+  }
+  lrtype_release(t);
+  lval_del(a);
+  return lval_nil();
+}
+
+lval *lval_pq(int max, lval *key) {
+  lval *v = lval_new(LVAL_PQUEUE);
+  v->value.pq = malloc(sizeof(lpq));
+  v->value.pq->refs = 1;
+  v->value.pq->max = max;
+  v->value.pq->kind = PQ_NONE;
+  v->value.pq->count = 0;
+  v->value.pq->cap = 0;
+  v->value.pq->key = key;
+  v->value.pq->ents = NULL;
+  return v;
+}
+
+/* Entry x belongs above entry y. */
+int lpq_above(lpq *q, lpq_ent *x, lpq_ent *y) {
+  switch (q->kind) {
+  case PQ_LONG: return q->max ? x->k.l > y->k.l : x->k.l < y->k.l;
+  case PQ_DOUBLE: return q->max ? x->k.d > y->k.d : x->k.d < y->k.d;
+  }
+  int o = q->kind == PQ_NUM ? lnum_cmp(x->k.s, y->k.s) : strcmp(x->k.s->value.str, y->k.s->value.str);
+  return q->max ? o > 0 : o < 0;
+}
+
+void lpq_up(lpq *q, long i) {
+  lpq_ent x = q->ents[i];
+  while (i > 0 && lpq_above(q, &x, &q->ents[(i - 1) / 2])) {
+    q->ents[i] = q->ents[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  q->ents[i] = x;
+}
+
+void lpq_down(lpq *q, long i) {
+  lpq_ent x = q->ents[i];
+  for (;;) {
+    long c = 2 * i + 1;
+    if (c >= q->count) { break; }
+    if (c + 1 < q->count && lpq_above(q, &q->ents[c+1], &q->ents[c])) { c++; }
+    if (!lpq_above(q, &q->ents[c], &x)) { break; }
+    q->ents[i] = q->ents[c];
+    i = c;
+  }
+  q->ents[i] = x;
+}
+
+/* A double key turns a queue of long keys into one of double keys.
+   Items that were their own key keep their type as payloads. */
+void lpq_widen(lpq *q) {
+  for (long i = 0; i < q->count; i++) {
+    if (!q->ents[i].v) { q->ents[i].v = lval_long(q->ents[i].k.l); }
+    q->ents[i].k.d = q->ents[i].k.l;
+  }
+  q->kind = PQ_DOUBLE;
+}
+
+/* A bignum or ratio key boxes the keys of a long or double queue. */
+void lpq_box(lpq *q) {
+  for (long i = 0; i < q->count; i++) {
+    q->ents[i].k.s = q->kind == PQ_LONG ? lval_long(q->ents[i].k.l) : lval_double(q->ents[i].k.d);
+  }
+  q->kind = PQ_NUM;
+}
+
+/* Takes x, and k, its key computed by the key function (or NULL when
+   x is its own key). Returns an error if the key cannot be ordered
+   against those already queued. */
+lval *lpq_push(lpq *q, lval *x, lval *k) {
+  lval *key = k ? k : x;
+  int num = lnum_rank(key->type) >= 0;
+  int kind = key->type == LVAL_LONG ? PQ_LONG : key->type == LVAL_DOUBLE ? PQ_DOUBLE :
+    key->type == LVAL_STR ? PQ_STR : num ? PQ_NUM : PQ_NONE;
+  if (q->count == 0 && kind != PQ_NONE) { q->kind = kind; }
+  if (q->kind == PQ_DOUBLE && kind == PQ_LONG) { kind = PQ_DOUBLE; }
+  if (q->kind == PQ_LONG && kind == PQ_DOUBLE) { lpq_widen(q); }
+  if (num && kind != q->kind && q->kind != PQ_STR) {
+    if (q->kind != PQ_NUM) { lpq_box(q); }
+    kind = PQ_NUM;
+  }
+  if (kind == PQ_NONE || kind != q->kind) {
+    lval *err = kind == PQ_NONE
+      ? lval_err("Function 'pq-push' cannot order keys of type %s.", ltype_name(key->type))
+      : lval_err("Function 'pq-push' cannot order %s keys with %s keys.", ltype_name(key->type),
+		 q->kind == PQ_STR ? ltype_name(LVAL_STR) : "numeric");
+    lval_del(x);
+    if (k) { lval_del(k); }
+    return err;
+  }
+  if (q->count == q->cap) {
+    q->cap = q->cap ? q->cap * 2 : 8;
+    q->ents = realloc(q->ents, sizeof(lpq_ent) * q->cap);
+  }
+  lpq_ent *n = &q->ents[q->count++];
+  n->v = k ? x : NULL;
+  if (q->kind == PQ_STR || q->kind == PQ_NUM) {
+    n->k.s = key;
+  } else {
+    if (q->kind == PQ_LONG) { n->k.l = key->value.l; } else { n->k.d = key->type == LVAL_LONG ? key->value.l : key->value.d; }
+    if (key->type == LVAL_LONG && q->kind == PQ_DOUBLE && !k) { n->v = x; } else { lval_del(key); }
+  }
+  lpq_up(q, q->count - 1);
+  return NULL;
+}
+
+/* The item held by entry n, moved out of it when take is set. */
+lval *lpq_item(lpq *q, lpq_ent *n, int take) {
+  if (n->v) { return take ? n->v : lval_copy(n->v); }
+  switch (q->kind) {
+  case PQ_LONG: return lval_long(n->k.l);
+  case PQ_DOUBLE: return lval_double(n->k.d);
+  }
+  return take ? n->k.s : lval_copy(n->k.s);
+}
+
+void lpq_release(lpq *q) {
+  if (--q->refs) { return; }
+  for (long i = 0; i < q->count; i++) {
+    if (q->ents[i].v) { lval_del(q->ents[i].v); }
+    if (q->kind == PQ_STR || q->kind == PQ_NUM) { lval_del(q->ents[i].k.s); }
+  }
+  if (q->key) { lval_del(q->key); }
+  free(q->ents);
+  free(q);
+}
+
+/* (make-pq <) is a min-heap and (make-pq >) a max-heap. An optional
+   key function gives the priority of each pushed item. */
+lval *builtin_make_pq(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'make-pq' passed incorrect number of arguments. Got %i, Expected %i or %i.", a->count, 1, 2);
+  LASSERT_TYPE("make-pq", a, 0, LVAL_FUN);
+  lbuiltin b = a->value.cell[0]->value.builtin;
+  LASSERT(a, b == builtin_lt || b == builtin_le || b == builtin_gt || b == builtin_ge,
+    "Function 'make-pq' passed an ordering other than < or > for argument 0.");
+  if (a->count == 2) { LASSERT_TYPE("make-pq", a, 1, LVAL_FUN); }
+  lval *q = lval_pq(b == builtin_gt || b == builtin_ge, a->count == 2 ? lval_pop(a, 1) : NULL);
+  lval_del(a);
+  return q;
+}
+
+lval *builtin_pq_push(lenv *e, lval *a) {
+  LASSERT(a, a->count >= 2,
+    "Function 'pq-push' passed incorrect number of arguments. Got %i, Expected at least %i.", a->count, 2);
+  LASSERT_TYPE("pq-push", a, 0, LVAL_PQUEUE);
+  lpq *q = a->value.cell[0]->value.pq;
+  while (a->count > 1) {
+    lval *x = lval_pop(a, 1);
+    lval *k = NULL;
+    if (q->key) {
+      k = lval_call1(e, q->key, lval_copy(x));
+      if (k->type == LVAL_ERR) {
+	lval_del(x);
+	lval_del(a);
+	return k;
+      }
+    }
+    lval *err = lpq_push(q, x, k);
+    if (err) {
+      lval_del(a);
+      return err;
+    }
+  }
+  return lval_take(a, 0);
+}
+
+lval *builtin_pq_pop(lenv *e, lval *a) {
+  LASSERT_NUM("pq-pop", a, 1);
+  LASSERT_TYPE("pq-pop", a, 0, LVAL_PQUEUE);
+  lpq *q = a->value.cell[0]->value.pq;
+  LASSERT(a, q->count > 0, "Function 'pq-pop' passed an empty queue.");
+  lpq_ent top = q->ents[0];
+  q->ents[0] = q->ents[--q->count];
+  if (q->count) { lpq_down(q, 0); }
+  lval *x = lpq_item(q, &top, 1);
+  if ((q->kind == PQ_STR || q->kind == PQ_NUM) && top.v) { lval_del(top.k.s); }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_pq_peek(lenv *e, lval *a) {
+  LASSERT_NUM("pq-peek", a, 1);
+  LASSERT_TYPE("pq-peek", a, 0, LVAL_PQUEUE);
+  lpq *q = a->value.cell[0]->value.pq;
+  LASSERT(a, q->count > 0, "Function 'pq-peek' passed an empty queue.");
+  lval *x = lpq_item(q, &q->ents[0], 0);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_pq_size(lenv *e, lval *a) {
+  LASSERT_NUM("pq-size", a, 1);
+  LASSERT_TYPE("pq-size", a, 0, LVAL_PQUEUE);
+  lval *x = lval_long(a->value.cell[0]->value.pq->count);
+  lval_del(a);
+  return x;
+}
+
+lval *lval_bits(long n) {
+  lval *v = lval_new(LVAL_BITSET);
+  v->value.bits = malloc(sizeof(lbits));
+  v->value.bits->refs = 1;
+  v->value.bits->count = n;
+  v->value.bits->words = (n + 63) / 64;
+  v->value.bits->w = calloc(v->value.bits->words > 0 ? v->value.bits->words : 1, sizeof(unsigned long));
+  return v;
+}
+
+lval *builtin_make_bits(lenv *e, lval *a) {
+  LASSERT_NUM("make-bits", a, 1);
+  LASSERT_TYPE("make-bits", a, 0, LVAL_LONG);
+  long n = a->value.cell[0]->value.l;
+  LASSERT(a, n >= 0, "Function 'make-bits' passed negative size %li.", n);
+  lval_del(a);
+  return lval_bits(n);
+}
+
+/* (bits-set! b i ...) and (bits-clear! b i ...) return b. */
+lval *builtin_bits_put(lenv *e, lval *a, char *func, int on) {
+  LASSERT(a, a->count >= 2,
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected at least %i.", func, a->count, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_BITSET);
+  lbits *b = a->value.cell[0]->value.bits;
+  for (int j = 1; j < a->count; j++) {
+    LASSERT_TYPE(func, a, j, LVAL_LONG);
+    long i = a->value.cell[j]->value.l;
+    LASSERT_INDEX(func, a, b, i);
+  }
+  for (int j = 1; j < a->count; j++) {
+    long i = a->value.cell[j]->value.l;
+    if (on) {
+      b->w[i / 64] |= 1UL << (i % 64);
+    } else {
+      b->w[i / 64] &= ~(1UL << (i % 64));
+    }
+  }
+  return lval_take(a, 0);
+}
+
+lval *builtin_bits_set(lenv *e, lval *a) {
+  return builtin_bits_put(e, a, "bits-set!", 1);
+}
+
+lval *builtin_bits_clear(lenv *e, lval *a) {
+  return builtin_bits_put(e, a, "bits-clear!", 0);
+}
+
+lval *builtin_bits_test(lenv *e, lval *a) {
+  LASSERT_NUM("bits-test", a, 2);
+  LASSERT_TYPE("bits-test", a, 0, LVAL_BITSET);
+  LASSERT_TYPE("bits-test", a, 1, LVAL_LONG);
+  lbits *b = a->value.cell[0]->value.bits;
+  long i = a->value.cell[1]->value.l;
+  LASSERT_INDEX("bits-test", a, b, i);
+  lval *x = lval_booln(b->w[i / 64] >> (i % 64) & 1);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_bits_op(lenv *e, lval *a, char *func, int op) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_BITSET);
+  LASSERT_TYPE(func, a, 1, LVAL_BITSET);
+  lbits *x = a->value.cell[0]->value.bits, *y = a->value.cell[1]->value.bits;
+  LASSERT(a, x->count == y->count,
+    "Function '%s' passed bitsets of different sizes. Got %li and %li.", func, x->count, y->count);
+  lval *r = lval_bits(x->count);
+  lk->op_bits(op, r->value.bits->w, x->w, y->w, x->words);
+  lval_del(a);
+  return r;
+}
+
+lval *builtin_bits_or(lenv *e, lval *a) {
+  return builtin_bits_op(e, a, "bits-or", BITS_OR);
+}
+
+lval *builtin_bits_and(lenv *e, lval *a) {
+  return builtin_bits_op(e, a, "bits-and", BITS_AND);
+}
+
+lval *builtin_bits_diff(lenv *e, lval *a) {
+  return builtin_bits_op(e, a, "bits-diff", BITS_DIFF);
+}
+
+lval *builtin_bits_xor(lenv *e, lval *a) {
+  return builtin_bits_op(e, a, "bits-xor", BITS_XOR);
+}
+
+lval *builtin_bits_count(lenv *e, lval *a) {
+  LASSERT_NUM("bits-count", a, 1);
+  LASSERT_TYPE("bits-count", a, 0, LVAL_BITSET);
+  lbits *b = a->value.cell[0]->value.bits;
+  lval *x = lval_long(lk->count_bits(b->w, b->words));
+  lval_del(a);
+  return x;
+}
+
+/* Indices of the set bits, found a word at a time. */
+lval *builtin_bits_to_list(lenv *e, lval *a) {
+  LASSERT_NUM("bits->list", a, 1);
+  LASSERT_TYPE("bits->list", a, 0, LVAL_BITSET);
+  lbits *b = a->value.cell[0]->value.bits;
+  lval *l = lval_qexp();
+  for (long i = 0; i < b->words; i++) {
+    for (unsigned long w = b->w[i]; w; w &= w - 1) {
+      lval_add(l, lval_long(i * 64 + __builtin_ctzl(w)));
+    }
+  }
+  lval_del(a);
+  return l;
+}
+
+lseq *lseq_new(int kind, lseq *src) {
+  lseq *s = calloc(1, sizeof(lseq));
+  s->refs = 1;
+  s->kind = kind;
+  s->src = src;
+  return s;
+}
+
+lval *lval_xf(lxf *x) {
+  lval *v = lval_new(LVAL_XFORM);
+  v->value.xf = x;
+  return v;
+}
+
+lval *lval_seq(int kind, lseq *src) {
+  lval *v = lval_new(LVAL_SEQ);
+  v->value.seq = lseq_new(kind, src);
+  return v;
+}
+
+void lseq_release(lseq *s) {
+  if (!s || --s->refs) { return; }
+  if (s->f) { lval_del(s->f); }
+  if (s->x) { lval_del(s->x); }
+  lseq_release(s->src);
+  free(s);
+}
+
+/* Calls f, which it leaves alone, on the arguments a. Only calls that
+   bind into f's own env need a copy of it. */
+lval *lval_call_with(lenv *e, lval *f, lval *a) {
+  if (f->value.builtin || lval_framed(f, a->count)) { return lval_call(e, f, a); }
+  lval *g = lval_copy(f);
+  lval *r = lval_call(e, g, a);
+  lval_del(g);
+  return r;
+}
+
+/* Applies f to the one argument x, which it takes. */
+lval *lval_call1(lenv *e, lval *f, lval *x) {
+  return lval_call_with(e, f, lval_add(lval_sexp(), x));
+}
+
+liter *liter_new(lseq *s) {
+  liter *it = malloc(sizeof(liter));
+  it->s = s;
+  it->i = s->kind == SEQ_RANGE ? s->a : 0;
+  it->x = NULL;
+  it->src = s->src ? liter_new(s->src) : NULL;
+  return it;
+}
+
+void liter_free(liter *it) {
+  if (!it) { return; }
+  if (it->x) { lval_del(it->x); }
+  liter_free(it->src);
+  free(it);
+}
+
+/* Produces the next element, NULL at the end, or an error. */
+lval *liter_next(lenv *e, liter *it) {
+  lseq *s = it->s;
+  lval *v;
+  switch (s->kind) {
+  case SEQ_RANGE:
+    if (s->step > 0 ? it->i >= s->b : it->i <= s->b) { return NULL; }
+    v = lval_long(it->i);
+    it->i += s->step;
+    return v;
+  case SEQ_LIST:
+    if (s->x->type == LVAL_VECTOR) {
+      return it->i < s->x->value.vec->count ? lval_copy(s->x->value.vec->items[it->i++]) : NULL;
+    }
+    return it->i < s->x->count ? lval_copy(s->x->value.cell[it->i++]) : NULL;
+  case SEQ_ITERATE:
+    v = it->x ? lval_call1(e, s->f, it->x) : lval_copy(s->x);
+    it->x = NULL;
+    if (v->type == LVAL_ERR) { return v; }
+    it->x = v;
+    return lval_copy(v);
+  case SEQ_MAP:
+    v = liter_next(e, it->src);
+    return v && v->type != LVAL_ERR ? lval_call1(e, s->f, v) : v;
+  case SEQ_FILTER:
+    while ((v = liter_next(e, it->src)) && v->type != LVAL_ERR) {
+      lval *keep = lval_call1(e, s->f, lval_copy(v));
+      if (keep->type == LVAL_ERR) { lval_del(v); return keep; }
+      int t = lval_truthy(keep);
+      lval_del(keep);
+      if (t) { return v; }
+      lval_del(v);
+    }
+    return v;
+  case SEQ_TAKE:
+    if (it->i >= s->a) { return NULL; }
+    it->i++;
+    return liter_next(e, it->src);
+  case SEQ_DROP:
+    for (; it->i < s->a; it->i++) {
+      v = liter_next(e, it->src);
+      if (!v || v->type == LVAL_ERR) { return v; }
+      lval_del(v);
+    }
+    return liter_next(e, it->src);
+  }
+  return NULL;
+}
+
+/* Lists and vectors can stand in for sequences. */
+lseq *lval_to_seq(lval *x) {
+  if (x->type == LVAL_SEQ) {
+    x->value.seq->refs++;
+    return x->value.seq;
+  }
+  lseq *s = lseq_new(SEQ_LIST, NULL);
+  s->x = lval_copy(x);
+  return s;
+}
+
+#define LASSERT_SEQ(func, args, index) \
+  LASSERT(args, args->value.cell[index]->type == LVAL_SEQ || args->value.cell[index]->type == LVAL_QEXP || \
+	  args->value.cell[index]->type == LVAL_VECTOR, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
+    func, index, ltype_name(args->value.cell[index]->type), ltype_name(LVAL_SEQ))
+
+/* (range end), (range start end) or (range start end step). */
+lval *builtin_range(lenv *e, lval *a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+    "Function 'range' passed incorrect number of arguments. Got %i, Expected %i to %i.", a->count, 1, 3);
+  for (int i = 0; i < a->count; i++) { LASSERT_TYPE("range", a, i, LVAL_LONG); }
+  lval *v = lval_seq(SEQ_RANGE, NULL);
+  lseq *s = v->value.seq;
+  s->a = a->count > 1 ? a->value.cell[0]->value.l : 0;
+  s->b = a->value.cell[a->count > 1]->value.l;
+  s->step = a->count > 2 ? a->value.cell[2]->value.l : 1;
+  if (s->step == 0) {
+    lval_del(v);
+    LASSERT(a, 0, "Function 'range' passed a step of 0.");
+  }
+  lval_del(a);
+  return v;
+}
+
+/* (iterate f x) is the endless sequence x, (f x), (f (f x)), ... */
+lval *builtin_iterate(lenv *e, lval *a) {
+  LASSERT_NUM("iterate", a, 2);
+  LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+  lval *v = lval_seq(SEQ_ITERATE, NULL);
+  v->value.seq->x = lval_pop(a, 1);
+  v->value.seq->f = lval_pop(a, 0);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_lazy_fn(lenv *e, lval *a, char *func, int kind) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_SEQ(func, a, 1);
+  lval *v = lval_seq(kind, lval_to_seq(a->value.cell[1]));
+  v->value.seq->f = lval_pop(a, 0);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_lazy_map(lenv *e, lval *a) {
+  return builtin_lazy_fn(e, a, "lazy-map", SEQ_MAP);
+}
+
+lval *builtin_lazy_filter(lenv *e, lval *a) {
+  return builtin_lazy_fn(e, a, "lazy-filter", SEQ_FILTER);
+}
+
+lval *builtin_lazy_count(lenv *e, lval *a, char *func, int kind) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_LONG);
+  LASSERT_SEQ(func, a, 1);
+  lval *v = lval_seq(kind, lval_to_seq(a->value.cell[1]));
+  v->value.seq->a = a->value.cell[0]->value.l;
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_take(lenv *e, lval *a) {
+  return builtin_lazy_count(e, a, "take", SEQ_TAKE);
+}
+
+lval *builtin_drop(lenv *e, lval *a) {
+  return builtin_lazy_count(e, a, "drop", SEQ_DROP);
+}
+
+lval *builtin_seq_to_list(lenv *e, lval *a) {
+  LASSERT_NUM("seq->list", a, 1);
+  LASSERT_SEQ("seq->list", a, 0);
+  lseq *s = lval_to_seq(a->value.cell[0]);
+  liter *it = liter_new(s);
+  lval *l = lval_qexp();
+  lval *v;
+  while ((v = liter_next(e, it))) {
+    if (v->type == LVAL_ERR) { lval_del(l); l = v; break; }
+    lval_add(l, v);
+  }
+  liter_free(it);
+  lseq_release(s);
+  lval_del(a);
+  return l;
+}
+
+/* (reduce f init seq) folds a sequence, list or vector as it is
+   produced, so only the accumulator and one element are live. */
+lval *builtin_reduce(lenv *e, lval *a) {
+  LASSERT_NUM("reduce", a, 3);
+  LASSERT_TYPE("reduce", a, 0, LVAL_FUN);
+  LASSERT_SEQ("reduce", a, 2);
+  lseq *s = lval_to_seq(a->value.cell[2]);
+  liter *it = liter_new(s);
+  lval *acc = lval_pop(a, 1);
+  lval *v;
+  while (acc->type != LVAL_ERR && (v = liter_next(e, it))) {
+    if (v->type == LVAL_ERR) { lval_del(acc); acc = v; break; }
+    acc = lval_call_with(e, a->value.cell[0], lval_add(lval_add(lval_sexp(), acc), v));
+  }
+  liter_free(it);
+  lseq_release(s);
+  lval_del(a);
+  return acc;
+}
+
+lxf *lxf_new(int count) {
+  lxf *x = malloc(sizeof(lxf));
+  x->refs = 1;
+  x->count = count;
+  x->kinds = malloc(sizeof(int) * (count > 0 ? count : 1));
+  x->fns = malloc(sizeof(lval*) * (count > 0 ? count : 1));
+  return x;
+}
+
+void lxf_release(lxf *x) {
+  if (--x->refs) { return; }
+  for (int i = 0; i < x->count; i++) { lval_del(x->fns[i]); }
+  free(x->kinds);
+  free(x->fns);
+  free(x);
+}
+
+/* Pushes v, which it takes, through the stages and folds it into *acc
+   with f. Returns 0 once nothing more should be fed in: a take-while
+   stage has failed, or *acc has been replaced by an error. */
+int lxf_step(lenv *e, lxf *x, lval *f, lval **acc, lval *v) {
+  for (int i = 0; i < x->count; i++) {
+    if (x->kinds[i] == XF_MAP) {
+      v = lval_call1(e, x->fns[i], v);
+      if (v->type == LVAL_ERR) { lval_del(*acc); *acc = v; return 0; }
+      continue;
+    }
+    lval *t = lval_call1(e, x->fns[i], lval_copy(v));
+    if (x->kinds[i] == XF_COND && t->type != LVAL_BOOL) {
+      lval *err = lval_err("Function 'cond' passed incorrect type for argument 0. Got %s, Expected %s.",
+			   ltype_name(t->type), ltype_name(LVAL_BOOL));
+      lval_del(t);
+      t = err;
+    }
+    if (t->type == LVAL_ERR) { lval_del(v); lval_del(*acc); *acc = t; return 0; }
+    int keep = lval_truthy(t);
+    lval_del(t);
+    if (!keep) {
+      lval_del(v);
+      return x->kinds[i] != XF_TAKE_WHILE;
+    }
+  }
+  *acc = lval_call_with(e, f, lval_add(lval_add(lval_sexp(), *acc), v));
+  return (*acc)->type != LVAL_ERR;
+}
+
+/* Feeds each element of coll, which it takes, through x into acc.
+   List elements are moved rather than copied. */
+lval *lxf_run(lenv *e, lxf *x, lval *f, lval *acc, lval *coll) {
+  if (coll->type == LVAL_QEXP) {
+    lval_reserve(coll, 0);
+    int i = 0;
+    while (i < coll->count && lxf_step(e, x, f, &acc, coll->value.cell[i++])) {}
+    while (i < coll->count) { lval_del(coll->value.cell[i++]); }
+    coll->count = 0;
+  } else {
+    lseq *s = lval_to_seq(coll);
+    liter *it = liter_new(s);
+    lval *v;
+    while ((v = liter_next(e, it))) {
+      if (v->type == LVAL_ERR) { lval_del(acc); acc = v; break; }
+      if (!lxf_step(e, x, f, &acc, v)) { break; }
+    }
+    liter_free(it);
+    lseq_release(s);
+  }
+  lval_del(coll);
+  return acc;
+}
+
+lval *builtin_xf_stage(lenv *e, lval *a, char *func, int kind) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  lval *v = lval_xf(lxf_new(1));
+  v->value.xf->kinds[0] = kind;
+  v->value.xf->fns[0] = lval_pop(a, 0);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_mapping(lenv *e, lval *a) {
+  return builtin_xf_stage(e, a, "mapping", XF_MAP);
+}
+
+lval *builtin_filtering(lenv *e, lval *a) {
+  return builtin_xf_stage(e, a, "filtering", XF_FILTER);
+}
+
+lval *builtin_taking_while(lenv *e, lval *a) {
+  return builtin_xf_stage(e, a, "taking-while", XF_TAKE_WHILE);
+}
+
+/* (pipeline xf ...) runs its arguments' stages left to right. */
+lval *builtin_pipeline(lenv *e, lval *a) {
+  int n = 0;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("pipeline", a, i, LVAL_XFORM);
+    n += a->value.cell[i]->value.xf->count;
+  }
+  lxf *x = lxf_new(n);
+  n = 0;
+  for (int i = 0; i < a->count; i++) {
+    lxf *y = a->value.cell[i]->value.xf;
+    for (int j = 0; j < y->count; j++, n++) {
+      x->kinds[n] = y->kinds[j];
+      x->fns[n] = lval_copy(y->fns[j]);
+    }
+  }
+  lval_del(a);
+  return lval_xf(x);
+}
+
+/* (transduce xf f init coll) folds coll through xf in a single pass. */
+lval *builtin_transduce(lenv *e, lval *a) {
+  LASSERT_NUM("transduce", a, 4);
+  LASSERT_TYPE("transduce", a, 0, LVAL_XFORM);
+  LASSERT_TYPE("transduce", a, 1, LVAL_FUN);
+  LASSERT_SEQ("transduce", a, 3);
+  lval *coll = lval_pop(a, 3);
+  lval *r = lxf_run(e, a->value.cell[0]->value.xf, a->value.cell[1], lval_pop(a, 2), coll);
+  lval_del(a);
+  return r;
+}
+
+/* The library functions that literal compositions are fused through.
+   Each is recognised by the tag lfuse_tag puts on the lambda lib.liz
+   binds to the name, which every copy shares, so a name rebound to
+   anything else, even to the same text, is left alone. */
+char *lfuse_names[] = { "foldl", "map", "filter" };
+int lfuse_loading;
+
+void lfuse_tag(lval *v, char *name) {
+  for (int i = 0; i < 3; i++) {
+    if (strcmp(name, lfuse_names[i]) == 0) { v->ir->lib = i + 1; }
+  }
+}
+
+int lfuse_lib(lenv *e, int i) {
+  lval *f = lenv_peek(e, lfuse_names[i]);
+  return f && f->type == LVAL_FUN && !f->value.builtin && f->env->count == 0 &&
+    f->ir && f->ir->lib == i + 1;
+}
+
+int lfuse_is(lval *x, int i, int count) {
+  return x->type == LVAL_SEXP && x->count == count && x->value.cell[0]->type == LVAL_SYM &&
+    strcmp(x->value.cell[0]->value.sym, lfuse_names[i]) == 0;
+}
+
+/* (foldl f z (map g (filter p ... l))) written out literally runs as
+   one pass over l, through lxf_step, with no intermediate lists and
+   with each element visiting every stage before the next is read.
+   Arguments are evaluated in the usual order. Anything but a list
+   of self-evaluating elements for l goes through the library
+   functions. Returns NULL, leaving v alone, when v is not such a
+   form. */
+lval *lval_fuse(lenv *e, lval *v) {
+  if (!lfuse_is(v, 0, 4)) { return NULL; }
+  int n = 0;
+  for (lval *s = v->value.cell[3]; lfuse_is(s, 1, 3) || lfuse_is(s, 2, 3); s = s->value.cell[2]) { n++; }
+  if (n == 0 || !lfuse_lib(e, 0)) { return NULL; }
+  lval **st = malloc(sizeof(lval*) * n);
+  st[0] = v->value.cell[3];
+  lval_reserve(st[0], 0);
+  for (int i = 1; i < n; i++) {
+    st[i] = st[i-1]->value.cell[2];
+    lval_reserve(st[i], 0);
+  }
+  for (int i = 0; i < n; i++) {
+    if (!lfuse_lib(e, lfuse_is(st[i], 1, 3) ? 1 : 2)) { free(st); return NULL; }
+  }
+
+  v->value.cell[1] = lval_eval(e, v->value.cell[1]);
+  v->value.cell[2] = lval_eval(e, v->value.cell[2]);
+  for (int i = 0; i < n; i++) { st[i]->value.cell[1] = lval_eval(e, st[i]->value.cell[1]); }
+  st[n-1]->value.cell[2] = lval_eval(e, st[n-1]->value.cell[2]);
+  lval *err = v->value.cell[1]->type == LVAL_ERR ? v->value.cell[1] :
+    v->value.cell[2]->type == LVAL_ERR ? v->value.cell[2] : NULL;
+  for (int i = 0; i < n && !err; i++) {
+    if (st[i]->value.cell[1]->type == LVAL_ERR) { err = st[i]->value.cell[1]; }
+  }
+  if (!err && st[n-1]->value.cell[2]->type == LVAL_ERR) { err = st[n-1]->value.cell[2]; }
+
+  int native = st[n-1]->value.cell[2]->type == LVAL_QEXP && v->value.cell[1]->type == LVAL_FUN;
+  for (int i = 0; i < n; i++) { native = native && st[i]->value.cell[1]->type == LVAL_FUN; }
+  /* The library evaluates each element as it takes it; only lists of
+     self-evaluating elements can be read in place. */
+  for (int i = 0; native && i < st[n-1]->value.cell[2]->count; i++) {
+    lval *y = st[n-1]->value.cell[2]->value.cell[i];
+    native = y->type != LVAL_SYM && !(y->type == LVAL_SEXP && y->count);
+  }
+  lval *r;
+  if (err) {
+    r = lval_copy(err);
+  } else if (native) {
+    lxf *x = lxf_new(n);
+    for (int i = 0; i < n; i++) {
+      lval *s = st[n-1-i];
+      x->kinds[i] = lfuse_is(s, 1, 3) ? XF_MAP : XF_COND;
+      x->fns[i] = s->value.cell[1];
+      s->value.cell[1] = lval_sexp();
+    }
+    lval *l = lval_pop(st[n-1], 2);
+    r = lxf_run(e, x, v->value.cell[1], lval_pop(v, 2), l);
+    lxf_release(x);
+  } else {
+    r = lval_pop(st[n-1], 2);
+    for (int i = n - 1; i >= 0; i--) {
+      lval *c = lval_sexp();
+      lval_add(c, lval_copy(lenv_peek(e, st[i]->value.cell[0]->value.sym)));
+      lval_add(c, lval_pop(st[i], 1));
+      r = lval_apply(e, lval_add(c, r));
+    }
+    lval *c = lval_add(lval_sexp(), lval_copy(lenv_peek(e, lfuse_names[0])));
+    lval_add(c, lval_pop(v, 1));
+    lval_add(c, lval_pop(v, 1));
+    r = lval_apply(e, lval_add(c, r));
+  }
+  free(st);
+  lval_del(v);
+  return r;
+}
+
+lval *builtin_load(lenv *e, lval *a) {
+  FILE *f = fopen(a->value.cell[0]->value.str, "r");
+  if (f == NULL) {
+    return lval_err("file failire\n");
+  }
+  char *base = strrchr(a->value.cell[0]->value.str, '/');
+  int loading = lfuse_loading;
+  lfuse_loading = strcmp(base ? base + 1 : a->value.cell[0]->value.str, "lib.liz") == 0;
+  mpc_result_t r;
+  if (mpc_parse_file(a->value.cell[0]->value.str, f, Lisp64, &r)) { 
+    lval *x = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    while (x->count) {
+      lval *y = lval_eval(e, lval_pop(x, 0));
+      if (y->type == LVAL_ERR) { lval_println(y); }
+      lval_del(y);
+      lpool_trim();
+    }
+    lval_del(x);    
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  } 
+  lfuse_loading = loading;
+  fclose(f);
+  return lval_nil();
+}
+
+lval *builtin_print(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    lval_print(a->value.cell[i]); putchar(' ');
+  }
+  putchar('\n');
+  lval_del(a);
+  return lval_nil();
+}
+
+lval *builtin_error(lenv *e, lval *a) {
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+  lval *err = lval_err(a->value.cell[0]->value.str);
+  lval_del(a);
+  return err;
+}
+
+lval *builtin_var(lenv *e, lval *a, char *func) {
+  LASSERT_TYPE(func, a, 0, LVAL_QEXP);
+
+  lval *syms = a->value.cell[0];
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, (syms->value.cell[i]->type == LVAL_SYM),
+      "Function '%s' cannot define non-symbol. "
+      "Got %s, Expected %s.", func,
+      ltype_name(syms->value.cell[i]->type),
+      ltype_name(LVAL_SYM));
+  }
+
+  LASSERT(a, (syms->count == a->count-1),
+    "Function '%s' passed too many arguments for symbols. "
+    "Got %i, Expected %i.", func, syms->count, a->count-1);
+  
+  lenv_epoch++;
+  for (int i = 0; i < syms->count; i++) {
+    lval *v = a->value.cell[i+1];
+    if (v->type == LVAL_FUN && v->ir && !v->ir->name) {
+      v->ir->name = malloc(strlen(syms->value.cell[i]->value.sym) + 1);
+      strcpy(v->ir->name, syms->value.cell[i]->value.sym);
+    }
+    if (lfuse_loading && v->type == LVAL_FUN && v->ir && strcmp(func, "define") == 0) {
+      lfuse_tag(v, syms->value.cell[i]->value.sym);
+    }
+    if (strcmp(func, "define") == 0) {
+      lenv_def(e, syms->value.cell[i], a->value.cell[i+1]);
+    }
+    if (strcmp(func, "set")   == 0) {
+      lenv_put(e, syms->value.cell[i], a->value.cell[i+1]);
+    }
+  }
+  lval_del(a);
+  return lval_nil();
+}
+
+lval *builtin_define(lenv *e, lval *a) {
+  return builtin_var(e, a, "define");
+}
+
+lval *builtin_condn(lenv *e, lval *b, lval *t, lval *f) {
+  lval *x;
+  t = lval_unquote(t);
+  f = lval_unquote(f);
+  if (b->value.l) {
+    x = lval_eval(e, t);
+  } else {
+    x = lval_eval(e, f);
+  }
+  lval_del(b);
+  return x;
+}
+
+lval *builtin_cond(lenv *e, lval *a) {
+  LASSERT_NUM("cond", a, 3);
+  LASSERT_TYPE("cond", a, 0, LVAL_BOOL);
+  LASSERT_TYPE("cond", a, 1, LVAL_QEXP);
+  LASSERT_TYPE("cond", a, 2, LVAL_QEXP);
+  return builtin_condn(e, a->value.cell[0], a->value.cell[1], a->value.cell[2]);
+}
+
+int lval_truthy(lval *x) {
+  switch (x->type) {
+  case LVAL_BOOL:
+  case LVAL_LONG: return x->value.l != 0;
+  case LVAL_DOUBLE: return x->value.d != 0;
+  default: return 1;
+  }
+}
+
+/* A recur marker is only for its enclosing loop, so one whose value is
+   used anywhere but in tail position becomes an error. */
+lval *lval_used(lval *x) {
+  if (x->type != LVAL_RECUR) { return x; }
+  lval_del(x);
+  return lval_err("Function 'recur' not in tail position.");
+}
+
+/* Arms written as Q-Expressions keep their cond-style meaning of code. */
+lval *lval_eval_arm(lenv *e, lval *x) {
+  if (x->type == LVAL_QEXP) { x = lval_unquote(x); }
+  return lval_eval(e, x);
+}
+
+lval *lval_eval_body(lenv *e, lval *a) {
+  lval *x = lval_nil();
+  while (a->count) {
+    lval_del(x);
+    x = lval_eval_arm(e, lval_pop(a, 0));
+    if (a->count) { x = lval_used(x); }
+    if (x->type == LVAL_ERR) { break; }
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_if(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "Function 'if' passed incorrect number of arguments. Got %i, Expected 2 or 3.", a->count);
+  lval *c = lval_used(lval_eval(e, lval_pop(a, 0)));
+  if (c->type == LVAL_ERR) { lval_del(a); return c; }
+  int i = lval_truthy(c) ? 0 : 1;
+  lval_del(c);
+  if (i == a->count) { lval_del(a); return lval_nil(); }
+  return lval_eval_arm(e, lval_take(a, i));
+}
+
+lval *builtin_when(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, "Function 'when' passed no condition.");
+  lval *c = lval_used(lval_eval(e, lval_pop(a, 0)));
+  if (c->type == LVAL_ERR) { lval_del(a); return c; }
+  int t = lval_truthy(c);
+  lval_del(c);
+  if (!t) { lval_del(a); return lval_nil(); }
+  return lval_eval_body(e, a);
+}
+
+lval *builtin_unless(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, "Function 'unless' passed no condition.");
+  lval *c = lval_used(lval_eval(e, lval_pop(a, 0)));
+  if (c->type == LVAL_ERR) { lval_del(a); return c; }
+  int t = lval_truthy(c);
+  lval_del(c);
+  if (t) { lval_del(a); return lval_nil(); }
+  return lval_eval_body(e, a);
+}
+
+lval *builtin_and(lenv *e, lval *a) {
+  lval *x = lval_booln(1);
+  while (a->count) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(a, 0));
+    if (a->count) { x = lval_used(x); }
+    if (x->type == LVAL_ERR || !lval_truthy(x)) { break; }
+  }
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_or(lenv *e, lval *a) {
+  lval *x = lval_booln(0);
+  while (a->count) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(a, 0));
+    if (a->count) { x = lval_used(x); }
+    if (x->type == LVAL_ERR || lval_truthy(x)) { break; }
+  }
+  lval_del(a);
+  return x;
+}
+
+enum { LET_PARALLEL, LET_SEQUENTIAL, LET_RECURSIVE };
+
+lval *builtin_letn(lenv *e, lval *a, char *func, int mode) {
+  LASSERT(a, a->count > 0, "Function '%s' passed no bindings.", func);
+  lval *bs = a->value.cell[0];
+  LASSERT(a, bs->type == LVAL_QEXP || bs->type == LVAL_SEXP,
+    "Function '%s' passed incorrect type for argument 0. Got %s, Expected %s.",
+    func, ltype_name(bs->type), ltype_name(LVAL_QEXP));
+  if (a->count == 1) {
+    lenv f;
+    lenv_frame(&f, e, 0);
+    lval *x = lval_eval_body(&f, a);
+    lenv_frame_release(&f, 0);
+    return x;
+  }
+  for (int i = 0; i < bs->count; i++) {
+    lval *b = bs->value.cell[i];
+    LASSERT(a, (b->type == LVAL_QEXP || b->type == LVAL_SEXP) && b->count == 2 &&
+	    b->value.cell[0]->type == LVAL_SYM,
+      "Function '%s' passed a malformed binding. Expected {symbol value}.", func);
+  }
+
+  bs = lval_pop(a, 0);
+  lval_reserve(bs, 0);
+  int n = bs->count;
+  lenv f;
+  lenv_frame(&f, e, n);
+  if (mode == LET_RECURSIVE) {
+    for (int i = 0; i < n; i++) { lenv_bind(&f, bs->value.cell[i]->value.cell[0], lval_nil()); }
+  }
+  for (int i = 0; i < n; i++) {
+    lval *b = bs->value.cell[i];
+    lval *x = lval_used(lval_eval(mode == LET_PARALLEL ? e : &f, lval_pop(b, 1)));
+    if (x->type == LVAL_ERR) {
+      lenv_frame_release(&f, n);
+      lval_del(bs);
+      lval_del(a);
+      return x;
+    }
+    lenv_bind(&f, b->value.cell[0], x);
+  }
+  lval *x = lval_eval_body(&f, a);
+  lenv_frame_release(&f, n);
+  lval_del(bs);
+  return x;
+}
+
+lval *builtin_let(lenv *e, lval *a) {
+  return builtin_letn(e, a, "let", LET_PARALLEL);
+}
+
+lval *builtin_let_star(lenv *e, lval *a) {
+  return builtin_letn(e, a, "let*", LET_SEQUENTIAL);
+}
+
+lval *builtin_letrec(lenv *e, lval *a) {
+  return builtin_letn(e, a, "letrec", LET_RECURSIVE);
+}
+
+/* Loop bodies are re-run each iteration, so evaluate copies. */
+lval *lval_eval_each(lenv *e, lval *body) {
+  lval *x = lval_nil();
+  for (int i = 0; i < body->count; i++) {
+    lval_del(x);
+    x = lval_eval_arm(e, lval_copy(body->value.cell[i]));
+    if (i < body->count - 1) { x = lval_used(x); }
+    if (x->type == LVAL_ERR) { break; }
+  }
+  return x;
+}
+
+lval *builtin_while(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, "Function 'while' passed no condition.");
+  lval *c = lval_pop(a, 0);
+  while (1) {
+    lval *t = lval_used(lval_eval_arm(e, lval_copy(c)));
+    if (t->type == LVAL_ERR) { lval_del(c); lval_del(a); return t; }
+    int go = lval_truthy(t);
+    lval_del(t);
+    if (!go) { break; }
+    lval *x = lval_used(lval_eval_each(e, a));
+    if (x->type == LVAL_ERR) { lval_del(c); lval_del(a); return x; }
+    lval_del(x);
+  }
+  lval_del(c);
+  lval_del(a);
+  return lval_nil();
+}
+
+/* Checks a {symbol value} iteration spec and evaluates its value. */
+lval *lval_iter_spec(lenv *e, lval *a, char *func) {
+  LASSERT(a, a->count > 0, "Function '%s' passed no binding.", func);
+  lval *b = a->value.cell[0];
+  LASSERT(a, (b->type == LVAL_QEXP || b->type == LVAL_SEXP) && b->count == 2 &&
+	  b->value.cell[0]->type == LVAL_SYM,
+    "Function '%s' passed a malformed binding. Expected {symbol value}.", func);
+  lval_reserve(b, 0);
+  b->value.cell[1] = lval_eval(e, b->value.cell[1]);
+  return NULL;
+}
+
+lval *builtin_dotimes(lenv *e, lval *a) {
+  lval *err = lval_iter_spec(e, a, "dotimes");
+  if (err) { return err; }
+  lval *b = lval_pop(a, 0);
+  lval *n = b->value.cell[1];
+  if (n->type == LVAL_ERR) { lval_del(a); return lval_take(b, 1); }
+  if (n->type != LVAL_LONG) {
+    lval *err = lval_err("Function 'dotimes' passed incorrect type for count. Got %s, Expected %s.",
+			 ltype_name(n->type), ltype_name(LVAL_LONG));
+    lval_del(b); lval_del(a);
+    return err;
+  }
+  lenv f;
+  lenv_frame(&f, e, 1);
+  lenv_bind(&f, b->value.cell[0], lval_long(0));
+  lval *x = lval_nil();
+  for (long i = 0; i < n->value.l; i++) {
+    lval_del(f.vals[0]);
+    f.vals[0] = lval_long(i);
+    lval_del(x);
+    x = lval_eval_each(&f, a);
+    if (x->type == LVAL_ERR) { break; }
+  }
+  lenv_frame_release(&f, 1);
+  lval_del(b);
+  lval_del(a);
+  if (x->type == LVAL_ERR) { return x; }
+  lval_del(x);
+  return lval_nil();
+}
+
+lval *builtin_for_each(lenv *e, lval *a) {
+  lval *err = lval_iter_spec(e, a, "for-each");
+  if (err) { return err; }
+  lval *b = lval_pop(a, 0);
+  lval *l = b->value.cell[1];
+  if (l->type == LVAL_ERR) { lval_del(a); return lval_take(b, 1); }
+  if (l->type == LVAL_QEXP) { lval_reserve(l, 0); }
+  if (l->type != LVAL_QEXP && l->type != LVAL_VECTOR && l->type != LVAL_ARRAY && l->type != LVAL_SEQ) {
+    lval *err = lval_err("Function 'for-each' passed incorrect type for list. Got %s, Expected %s.",
+			 ltype_name(l->type), ltype_name(LVAL_QEXP));
+    lval_del(b); lval_del(a);
+    return err;
+  }
+  lenv f;
+  lenv_frame(&f, e, 1);
+  lenv_bind(&f, b->value.cell[0], lval_nil());
+  lval *x = lval_nil();
+  int i = 0;
+  int lazy = l->type == LVAL_SEQ;
+  liter *it = lazy ? liter_new(l->value.seq) : NULL;
+  while (lazy) {
+    lval *v = liter_next(e, it);
+    if (!v) { break; }
+    lval_del(x);
+    if (v->type == LVAL_ERR) { x = v; break; }
+    lval_del(f.vals[0]);
+    f.vals[0] = v;
+    x = lval_eval_each(&f, a);
+    if (x->type == LVAL_ERR) { break; }
+  }
+  liter_free(it);
+  /* List elements move into the frame rather than being copied. The
+     body may grow a vector, so its length is re-read every step. */
+  while (!lazy && i < (l->type == LVAL_VECTOR ? l->value.vec->count :
+	      l->type == LVAL_ARRAY ? l->value.arr->count : l->count)) {
+    lval_del(f.vals[0]);
+    if (l->type == LVAL_VECTOR) {
+      f.vals[0] = lval_copy(l->value.vec->items[i++]);
+    } else if (l->type == LVAL_ARRAY) {
+      f.vals[0] = lval_arr_elem(l->value.arr, i++);
+    } else {
+      f.vals[0] = l->value.cell[i++];
+    }
+    lval_del(x);
+    x = lval_eval_each(&f, a);
+    if (x->type == LVAL_ERR) { break; }
+  }
+  lenv_frame_release(&f, 1);
+  if (l->type == LVAL_QEXP) {
+    while (i < l->count) { lval_del(l->value.cell[i++]); }
+    l->count = 0;
+  }
+  lval_del(b);
+  lval_del(a);
+  if (x->type == LVAL_ERR) { return x; }
+  lval_del(x);
+  return lval_nil();
+}
+
+int lval_loop_depth = 0;
+
+lval *builtin_recur(lenv *e, lval *a) {
+  LASSERT(a, lval_loop_depth > 0, "Function 'recur' used outside of loop.");
+  a->type = LVAL_RECUR;
+  return a;
+}
+
+/* Runs the body until it yields something other than recur, whose
+   arguments rebind the loop frame in place. */
+lval *builtin_loop(lenv *e, lval *a) {
+  LASSERT(a, a->count > 0, "Function 'loop' passed no bindings.");
+  lval *bs = a->value.cell[0];
+  LASSERT(a, bs->type == LVAL_QEXP || bs->type == LVAL_SEXP,
+    "Function 'loop' passed incorrect type for argument 0. Got %s, Expected %s.",
+    ltype_name(bs->type), ltype_name(LVAL_QEXP));
+  for (int i = 0; i < bs->count; i++) {
+    lval *b = bs->value.cell[i];
+    LASSERT(a, (b->type == LVAL_QEXP || b->type == LVAL_SEXP) && b->count == 2 &&
+	    b->value.cell[0]->type == LVAL_SYM,
+      "Function 'loop' passed a malformed binding. Expected {symbol value}.");
+  }
+
+  bs = lval_pop(a, 0);
+  lval_reserve(bs, 0);
+  int n = bs->count;
+  lenv f;
+  lenv_frame(&f, e, n);
+  lval *x = NULL;
+  for (int i = 0; i < n; i++) {
+    lval *b = bs->value.cell[i];
+    x = lval_used(lval_eval(&f, lval_pop(b, 1)));
+    if (x->type == LVAL_ERR) { break; }
+    lenv_bind(&f, b->value.cell[0], x);
+    x = NULL;
+  }
+  /* A set in an initialiser can put other names between the slots. */
+  int slot[n + 1];
+  for (int i = 0; i < n && !x; i++) {
+    for (slot[i] = 0; strcmp(f.syms[slot[i]], bs->value.cell[i]->value.cell[0]->value.sym); slot[i]++) {}
+  }
+  lval_loop_depth++;
+  while (!x) {
+    x = lval_eval_each(&f, a);
+    if (x->type != LVAL_RECUR) { break; }
+    if (x->count != n) {
+      int got = x->count;
+      lval_del(x);
+      x = lval_err("Function 'recur' passed incorrect number of arguments. Got %i, Expected %i.",
+		   got, n);
+      break;
+    }
+    lval_reserve(x, 0);
+    for (int i = 0; i < n; i++) {
+      lval_del(f.vals[slot[i]]);
+      f.vals[slot[i]] = x->value.cell[i];
+    }
+    x->count = 0;
+    lval_del(x);
+    x = NULL;
+  }
+  lval_loop_depth--;
+  lenv_frame_release(&f, n);
+  lval_del(bs);
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_not(lenv *e, lval *a) {
+  LASSERT_NUM("not", a, 1);
+  lval *x = lval_booln(!lval_truthy(a->value.cell[0]));
+  lval_del(a);
+  return x;
+}
+
+lval *builtin_set(lenv *e, lval *a) {
+  return builtin_var(e, a, "set");
+}
+
+/* Whether calling f with n arguments binds exactly its formals, none
+   of them '&', into an env holding nothing else. Such a call runs in a
+   frame on the binding stack and leaves f untouched. */
+int lval_framed(lval *f, int n) {
+  if (f->value.builtin || f->env->count || f->formals->count != n) { return 0; }
+  for (int i = 0; i < n; i++) {
+    if (strcmp(f->formals->value.cell[i]->value.sym, "&") == 0) { return 0; }
+  }
+  return 1;
+}
+
+lval *lval_call(lenv *e, lval *f, lval *a) {
+  if (f->value.builtin) {
+    /* A record operation finds its type on itself. */
+    if (f->rtype) { return f->value.recop(f, a); }
+    return f->value.builtin(e, a);
+  }
+  int compiled = f->env->count == 0 && lir_ready(f->ir, e, f, a);
+  if (lval_framed(f, a->count)) {
+    int n = a->count;
+    lenv fr;
+    lenv_frame(&fr, e, n);
+    for (int i = 0; i < n; i++) { lenv_bind(&fr, f->formals->value.cell[i], a->value.cell[i]); }
+    a->count = 0;
+    lval_del(a);
+    lval *x = compiled ? lir_exec(f->ir, &fr) : lval_eval(&fr, lval_unquote(lval_copy(f->body)));
+    lenv_frame_release(&fr, n);
+    return x;
+  }
+  int given = a->count;
+  int total = f->formals->count;
+  while (a->count) {
+    if (f->formals->count == 0) {
+      lval_del(a);
+      return lval_err("Function passed too many arguments. " "Got %i, Expected %i.", given, total);
+    }
+    lval *sym = lval_pop(f->formals, 0);
+    if (strcmp(sym->value.sym, "&") == 0) {
+      if (f->formals->count != 1) {
+	lval_del(a);
+	return lval_err("Function format invalid. "
+			"Symbol '&' not followed by single symbol.");
+      }
+      lval *nsym = lval_pop(f->formals, 0);
+      lenv_put(f->env, nsym, builtin_list(e, a));
+      lval_del(sym);
+      lval_del(nsym);
+      break;
+    }
+    lval *val = lval_pop(a, 0);
+    lenv_put(f->env, sym, val);
+    lval_del(sym);
+    lval_del(val);
+  }
+  lval_del(a);
+  if (f->formals->count > 0 &&
+      strcmp(f->formals->value.cell[0]->value.sym, "&") == 0) {
+    if (f->formals->count != 2) {
+      return lval_err("Function format invalid. "
+		      "Symbol '&' not followed by single symbol.");
+    }
+    lval_del(lval_pop(f->formals, 0));
+    lval *sym = lval_pop(f->formals, 0);
+    lval *val = lval_qexp();
+    lenv_put(f->env, sym, val);
+    lval_del(sym);
+    lval_del(val);
+  }
+  if (f->formals->count == 0) {
+    f->env->par = e;
+    if (compiled) { return lir_exec(f->ir, f->env); }
+    return builtin_eval(f->env, lval_add(lval_sexp(), lval_copy(f->body)));
+  }
+  return lval_copy(f);
+}
+
+lval *lval_eval_sexp(lenv *e, lval *v) {
+  v->hash = 0;
+  lval_reserve(v, 0);
+  lval *fused = lval_fuse(e, v);
+  if (fused) { return fused; }
+  for (int i = 0; i < v->count; i++) {
+    v->value.cell[i] = lval_eval(e, v->value.cell[i]);
+    if (i == 0 && v->value.cell[0]->type == LVAL_FORM) {
+      lval *f = lval_pop(v, 0);
+      lval *result = f->value.builtin(e, v);
+      lval_del(f);
+      return result;
+    }
+  }
+  return lval_apply(e, v);
+}
+
+lval *lval_apply(lenv *e, lval *v) {
+  int builtin = v->count > 1 && v->value.cell[0]->type == LVAL_FUN && v->value.cell[0]->value.builtin;
+  for (int i = 0; i < v->count; i++) {
+    if (v->value.cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    if (builtin && v->value.cell[i]->type == LVAL_RECUR) { return lval_used(lval_take(v, i)); }
+  }
+  if (v->count == 0) { return v; }
+  if (v->count == 1) { return lval_take(v, 0); }
+
+  lval *f = lval_pop(v, 0);
+  if (f->type == LVAL_FORM) {
+    lval *result = f->value.builtin(e, v);
+    lval_del(f);
+    return result;
+  }
+  if (f->type != LVAL_FUN) {
+    lval *err = lval_err("S-Expression starts with incorrect type. " "Got %s, Expected %s.",
+			 ltype_name(f->type), ltype_name(LVAL_FUN));
+    lval_del(f);
+    lval_del(v);
+    return err;
+  }
+  lval *result = lval_call(e, f, v);
+  lval_del(f);
+  return result;
+}
+
+lval *lval_eval(lenv *e, lval *v) {
+  if (v->type == LVAL_SYM) {
+    lval *x = lenv_get(e, v);
+    lval_del(v);
+    return x;
+  }
+  if (v->type == LVAL_SEXP) { return lval_eval_sexp(e, v); }
+  return v;
+}
+
+lval *builtin_add(lenv *e, lval *a) {
+  return builtin_op(e, a, "+");
+}
+
+lval *builtin_sub(lenv *e, lval *a) {
+  return builtin_op(e, a, "-");
+}
+
+lval *builtin_mul(lenv *e, lval *a) {
+  return builtin_op(e, a, "*");
+}
+
+lval *builtin_div(lenv *e, lval *a) {
+  return builtin_op(e, a, "/");
+}
+
+lval *builtin_mod(lenv *e, lval *a) {
+  return builtin_op(e, a, "%");
+}
+
+lval *builtin_pow(lenv *e, lval *a) {
+  return builtin_op(e, a, "^");
+}
+
+#ifndef LIZ_HOT_CALLS
+#define LIZ_HOT_CALLS 16
+#endif
+
+lbuiltin lir_pure[] = {
+  builtin_add, builtin_sub, builtin_mul, builtin_div, builtin_mod, builtin_pow,
+  builtin_gt, builtin_ge, builtin_eq, builtin_ne, builtin_lt, builtin_le,
+  builtin_head, builtin_tail, builtin_list, builtin_join, builtin_not, builtin_empty, builtin_count, NULL
+};
+
+lir *lir_new(void) {
+  lir *ir = malloc(sizeof(lir));
+  ir->refs = 1;
+  ir->calls = 0;
+  ir->deopts = 0;
+  ir->lib = 0;
+  ir->state = LIR_COLD;
+  ir->name = NULL;
+  ir->formals = NULL;
+  ir->body = NULL;
+  ir->nvals = 0;
+  ir->defs = NULL;
+  ir->pre = NULL;
+  ir->loop = NULL;
+  ir->ptypes = NULL;
+  ir->types = NULL;
+  ir->unsupported = 0;
+  ir->cse = 0;
+  ir->dce = 0;
+  ir->licm = 0;
+  return ir;
+}
+
+lir_block *lir_block_new(void) {
+  lir_block *b = malloc(sizeof(lir_block));
+  b->count = 0;
+  b->ins = NULL;
+  b->result = -1;
+  return b;
+}
+
+void lir_block_del(lir_block *b) {
+  if (!b) { return; }
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->k) { lval_del(n->k); }
+    lir_block_del(n->then);
+    lir_block_del(n->els);
+    free(n->args);
+    free(n);
+  }
+  free(b->ins);
+  free(b);
+}
+
+void lir_release(lir *ir) {
+  if (--ir->refs > 0) { return; }
+  free(ir->name);
+  if (ir->formals) { lval_del(ir->formals); }
+  if (ir->body) { lval_del(ir->body); }
+  lir_block_del(ir->pre);
+  lir_block_del(ir->loop);
+  free(ir->defs);
+  free(ir->ptypes);
+  free(ir->types);
+  free(ir);
+}
+
+lir_ins *lir_emit(lir *ir, lir_block *b, int op, lval *k, int argc, int *args) {
+  lir_ins *n = malloc(sizeof(lir_ins));
+  n->op = op;
+  n->dst = ir->nvals++;
+  n->argc = argc;
+  n->args = args;
+  n->index = -1;
+  n->dead = 0;
+  n->fast = -1;
+  n->k = k;
+  n->pure = NULL;
+  n->in = b;
+  n->then = NULL;
+  n->els = NULL;
+  ir->defs = realloc(ir->defs, sizeof(lir_ins*) * ir->nvals);
+  ir->defs[n->dst] = n;
+  b->count++;
+  b->ins = realloc(b->ins, sizeof(lir_ins*) * b->count);
+  b->ins[b->count-1] = n;
+  return n;
+}
+
+int lir_param(lir *ir, lval *k) {
+  for (int i = 0; i < ir->formals->count; i++) {
+    if (strcmp(ir->formals->value.cell[i]->value.sym, k->value.sym) == 0) { return i; }
+  }
+  return -1;
+}
+
+lbuiltin lir_resolve(lir *ir, lenv *g, lval *k) {
+  if (k->type != LVAL_SYM || lir_param(ir, k) >= 0) { return NULL; }
+  for (int i = 0; i < g->count; i++) {
+    if (strcmp(g->syms[i], k->value.sym) == 0) {
+      lval *v = g->vals[i];
+      if (v->type == LVAL_FORM) { return v->value.builtin; }
+      if (v->type != LVAL_FUN || !v->value.builtin) { return NULL; }
+      if (v->value.builtin == builtin_cond) { return builtin_cond; }
+      for (int j = 0; lir_pure[j]; j++) {
+	if (lir_pure[j] == v->value.builtin) { return v->value.builtin; }
+      }
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+int lir_lower_sexp(lir *ir, lir_block *b, lenv *g, lval *x, int tail);
+
+int lir_lower(lir *ir, lir_block *b, lenv *g, lval *x, int tail) {
+  if (x->type == LVAL_SEXP) { return lir_lower_sexp(ir, b, g, x, tail); }
+  if (x->type != LVAL_SYM) { return lir_emit(ir, b, LIR_CONST, lval_copy(x), 0, NULL)->dst; }
+  int i = lir_param(ir, x);
+  lir_ins *n = lir_emit(ir, b, i < 0 ? LIR_LOOKUP : LIR_PARAM, lval_copy(x), 0, NULL);
+  n->index = i;
+  return n->dst;
+}
+
+lir_ins *lir_branch(lir *ir, lir_block *b, int test, int head, int x, lir_block *t, lir_block *f) {
+  int *args = malloc(sizeof(int) * 2);
+  args[0] = head;
+  args[1] = x;
+  lir_ins *n = lir_emit(ir, b, LIR_IF, NULL, 2, args);
+  n->index = test;
+  n->then = t;
+  n->els = f;
+  return n;
+}
+
+lir_block *lir_block_of(int result) {
+  lir_block *b = lir_block_new();
+  b->result = result;
+  return b;
+}
+
+int lir_lower_arm(lir *ir, lir_block *b, lenv *g, lval *x, int tail) {
+  if (x->type == LVAL_QEXP) { return lir_lower_sexp(ir, b, g, x, tail); }
+  return lir_lower(ir, b, g, x, tail);
+}
+
+/* Bodies stop at the first error, so each non-final form is followed by
+   an error test that either returns it or continues with the rest. */
+int lir_lower_body(lir *ir, lir_block *b, lenv *g, lval *x, int from, int head, int tail) {
+  if (from == x->count) { return lir_emit(ir, b, LIR_CONST, lval_nil(), 0, NULL)->dst; }
+  if (from == x->count-1) { return lir_lower_arm(ir, b, g, x->value.cell[from], tail); }
+  int v = lir_lower_arm(ir, b, g, x->value.cell[from], 0);
+  lir_block *rest = lir_block_new();
+  rest->result = lir_lower_body(ir, rest, g, x, from+1, head, tail);
+  return lir_branch(ir, b, LIR_TEST_ERROR, head, v, lir_block_of(v), rest)->dst;
+}
+
+int lir_lower_logic(lir *ir, lir_block *b, lenv *g, lval *x, int from, int head, int tail, int any) {
+  if (from == x->count) {
+    return lir_emit(ir, b, LIR_CONST, lval_booln(!any), 0, NULL)->dst;
+  }
+  if (from == x->count-1) { return lir_lower(ir, b, g, x->value.cell[from], tail); }
+  int v = lir_lower(ir, b, g, x->value.cell[from], 0);
+  lir_block *rest = lir_block_new();
+  rest->result = lir_lower_logic(ir, rest, g, x, from+1, head, tail, any);
+  if (any) { return lir_branch(ir, b, LIR_TEST_TRUTHY, head, v, lir_block_of(v), rest)->dst; }
+  return lir_branch(ir, b, LIR_TEST_TRUTHY, head, v, rest, lir_block_of(v))->dst;
+}
+
+int lir_lower_form(lir *ir, lir_block *b, lenv *g, lval *x, lbuiltin fn, int tail) {
+  int head = lir_lower(ir, b, g, x->value.cell[0], 0);
+  ir->defs[head]->pure = fn;
+  if (fn == builtin_and || fn == builtin_or) {
+    return lir_lower_logic(ir, b, g, x, 1, head, tail, fn == builtin_or);
+  }
+  if (fn == builtin_if && (x->count == 3 || x->count == 4)) {
+    int c = lir_lower(ir, b, g, x->value.cell[1], 0);
+    lir_block *t = lir_block_new();
+    lir_block *f = lir_block_new();
+    t->result = lir_lower_arm(ir, t, g, x->value.cell[2], tail);
+    if (x->count == 4) {
+      f->result = lir_lower_arm(ir, f, g, x->value.cell[3], tail);
+    } else {
+      f->result = lir_emit(ir, f, LIR_CONST, lval_nil(), 0, NULL)->dst;
+    }
+    return lir_branch(ir, b, LIR_TEST_TRUTHY, head, c, t, f)->dst;
+  }
+  if ((fn == builtin_when || fn == builtin_unless) && x->count > 1) {
+    int c = lir_lower(ir, b, g, x->value.cell[1], 0);
+    lir_block *body = lir_block_new();
+    lir_block *none = lir_block_new();
+    body->result = lir_lower_body(ir, body, g, x, 2, head, tail);
+    none->result = lir_emit(ir, none, LIR_CONST, lval_nil(), 0, NULL)->dst;
+    if (fn == builtin_when) { return lir_branch(ir, b, LIR_TEST_TRUTHY, head, c, body, none)->dst; }
+    return lir_branch(ir, b, LIR_TEST_TRUTHY, head, c, none, body)->dst;
+  }
+  ir->unsupported = 1;
+  return head;
+}
+
+/* Arguments are evaluated in order, but parameters and lookups are read,
+   and hoisted builtin results recomputed, only when the call consumes
+   them. One that a later argument's call could set or define is copied
+   where it stands instead. */
+int lir_snap(lir *ir, lir_block *b, int v) {
+  int op = ir->defs[v]->op;
+  if (op != LIR_PARAM && op != LIR_LOOKUP && op != LIR_PCALL) { return v; }
+  int *args = malloc(sizeof(int));
+  args[0] = v;
+  lir_ins *n = lir_emit(ir, b, LIR_SNAP, NULL, 1, args);
+  int at = b->count - 1;
+  while (at > 0 && b->ins[at-1] != ir->defs[v]) {
+    b->ins[at] = b->ins[at-1];
+    at--;
+  }
+  b->ins[at] = n;
+  return n->dst;
+}
+
+int lir_lower_sexp(lir *ir, lir_block *b, lenv *g, lval *x, int tail) {
+  if (x->count == 0) { return lir_emit(ir, b, LIR_CONST, lval_nil(), 0, NULL)->dst; }
+
+  lval *h = x->value.cell[0];
+  lbuiltin fn = lir_resolve(ir, g, h);
+  for (int i = 0; fn && fn != builtin_cond && lir_pure[i] != fn; i++) {
+    if (!lir_pure[i]) { return lir_lower_form(ir, b, g, x, fn, tail); }
+  }
+  if (x->count == 1) { return lir_lower(ir, b, g, h, tail); }
+  int *args = malloc(sizeof(int) * x->count);
+  if (fn == builtin_cond && x->count == 4 &&
+      x->value.cell[2]->type == LVAL_QEXP && x->value.cell[3]->type == LVAL_QEXP) {
+    args[0] = lir_lower(ir, b, g, h, 0);
+    args[1] = lir_lower(ir, b, g, x->value.cell[1], 0);
+    ir->defs[args[0]]->pure = builtin_cond;
+    lir_block *t = lir_block_new();
+    lir_block *f = lir_block_new();
+    t->result = lir_lower_sexp(ir, t, g, x->value.cell[2], tail);
+    f->result = lir_lower_sexp(ir, f, g, x->value.cell[3], tail);
+    lval *arms = lval_add(lval_qexp(), lval_copy(x->value.cell[2]));
+    lir_ins *n = lir_emit(ir, b, LIR_IF, lval_add(arms, lval_copy(x->value.cell[3])), 2, args);
+    n->index = LIR_TEST_BOOL;
+    n->then = t;
+    n->els = f;
+    return n->dst;
+  }
+
+  int from = ir->nvals, last = -1;
+  for (int i = 0; i < x->count; i++) {
+    args[i] = lir_lower(ir, b, g, x->value.cell[i], 0);
+  }
+  for (int v = from; v < ir->nvals; v++) {
+    if (ir->defs[v]->op == LIR_CALL || ir->defs[v]->op == LIR_LOOP) { last = v; }
+  }
+  for (int i = 1; i < x->count; i++) {
+    if (args[i] < last) { args[i] = lir_snap(ir, b, args[i]); }
+  }
+  int op = LIR_CALL;
+  if (fn && fn != builtin_cond) {
+    op = LIR_PCALL;
+    ir->defs[args[0]]->pure = fn;
+  } else if (tail && ir->name && h->type == LVAL_SYM && lir_param(ir, h) < 0 &&
+	     strcmp(h->value.sym, ir->name) == 0 && x->count-1 == ir->formals->count) {
+    op = LIR_LOOP;
+  }
+  lir_ins *n = lir_emit(ir, b, op, NULL, x->count, args);
+  n->pure = op == LIR_PCALL ? fn : NULL;
+  return n->dst;
+}
+
+int lir_alias(int *alias, int v) {
+  while (alias[v] != v) { v = alias[v]; }
+  return v;
+}
+
+int lir_same(lir_ins *a, lir_ins *b) {
+  if (a->op != b->op || a->argc != b->argc) { return 0; }
+  switch (a->op) {
+  case LIR_PARAM: return a->index == b->index;
+  case LIR_LOOKUP: return strcmp(a->k->value.sym, b->k->value.sym) == 0;
+  case LIR_CONST:
+    if (a->k->type != b->k->type) { return 0; }
+    switch (a->k->type) {
+    case LVAL_BOOL:
+    case LVAL_LONG: return a->k->value.l == b->k->value.l;
+    case LVAL_DOUBLE: return a->k->value.d == b->k->value.d;
+    case LVAL_STR: return strcmp(a->k->value.str, b->k->value.str) == 0;
+    }
+    return 0;
+  case LIR_PCALL:
+    if (a->pure != b->pure) { return 0; }
+    for (int i = 0; i < a->argc; i++) {
+      if (a->args[i] != b->args[i]) { return 0; }
+    }
+    return 1;
+  }
+  return 0;
+}
+
+int lir_pure_op(lir_ins *n) {
+  return n->op == LIR_PARAM || n->op == LIR_CONST || n->op == LIR_LOOKUP || n->op == LIR_PCALL;
+}
+
+/* Dominator-scoped value numbering: an arm sees what was available before
+   its IF, but nothing from the sibling arm. A call can run any code,
+   set and define included, so builtin results from before it are not
+   reused after it: those below *wall are out. Returns whether b holds
+   such a call. */
+int lir_cse(lir *ir, lir_block *b, int *alias, lir_ins **avail, int *navail, int *wall) {
+  int mark = *navail, calls = 0;
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    for (int j = 0; j < n->argc; j++) { n->args[j] = lir_alias(alias, n->args[j]); }
+    int call = n->op == LIR_CALL || n->op == LIR_LOOP;
+    if (n->op == LIR_IF) {
+      int w = *wall;
+      call = lir_cse(ir, n->then, alias, avail, navail, wall);
+      *wall = w;
+      call |= lir_cse(ir, n->els, alias, avail, navail, wall);
+      *wall = w;
+    }
+    if (call) {
+      *wall = *navail;
+      calls = 1;
+    }
+    if (!lir_pure_op(n)) { continue; }
+    int found = 0;
+    for (int j = 0; j < *navail && !found; j++) {
+      if (avail[j]->op == LIR_PCALL && j < *wall) { continue; }
+      if (lir_same(avail[j], n)) {
+	alias[n->dst] = avail[j]->dst;
+	if (!avail[j]->pure) { avail[j]->pure = n->pure; }
+	n->dead = 1;
+	ir->cse++;
+	found = 1;
+      }
+    }
+    if (!found) { avail[(*navail)++] = n; }
+  }
+  if (b->result >= 0) { b->result = lir_alias(alias, b->result); }
+  *navail = mark;
+  return calls;
+}
+
+void lir_loops(lir_block *b, lir_ins ***loops, int *count) {
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->op == LIR_IF) {
+      lir_loops(n->then, loops, count);
+      lir_loops(n->els, loops, count);
+    }
+    if (n->op == LIR_LOOP) {
+      (*count)++;
+      *loops = realloc(*loops, sizeof(lir_ins*) * *count);
+      (*loops)[*count-1] = n;
+    }
+  }
+}
+
+void lir_hoist(lir *ir, lir_block *b, char *inv, char *pinv, int loops) {
+  int kept = 0;
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->op == LIR_IF) {
+      lir_hoist(ir, n->then, inv, pinv, loops);
+      lir_hoist(ir, n->els, inv, pinv, loops);
+    }
+    int hoist = !n->dead &&
+      (n->op == LIR_LOOKUP || n->op == LIR_CONST ||
+       (n->op == LIR_PARAM && pinv[n->index]) || (n->op == LIR_PCALL && loops));
+    for (int j = 0; hoist && n->op == LIR_PCALL && j < n->argc; j++) {
+      hoist = inv[n->args[j]];
+    }
+    if (!hoist) {
+      b->ins[kept++] = n;
+      continue;
+    }
+    inv[n->dst] = 1;
+    if (n->op == LIR_PCALL || n->op == LIR_LOOKUP) { ir->licm++; }
+    n->in = ir->pre;
+    ir->pre->count++;
+    ir->pre->ins = realloc(ir->pre->ins, sizeof(lir_ins*) * ir->pre->count);
+    ir->pre->ins[ir->pre->count-1] = n;
+  }
+  b->count = kept;
+}
+
+/* A parameter is loop invariant when every self tail call passes it
+   back unchanged. */
+void lir_licm(lir *ir) {
+  lir_ins **loops = NULL;
+  int count = 0;
+  lir_loops(ir->loop, &loops, &count);
+  char *pinv = malloc(ir->formals->count + 1);
+  for (int i = 0; i < ir->formals->count; i++) {
+    pinv[i] = 1;
+    for (int j = 0; j < count; j++) {
+      lir_ins *p = ir->defs[loops[j]->args[i+1]];
+      if (p->op != LIR_PARAM || p->index != i) { pinv[i] = 0; }
+    }
+  }
+  char *inv = calloc(ir->nvals, 1);
+  lir_hoist(ir, ir->loop, inv, pinv, count);
+  free(inv);
+  free(pinv);
+  free(loops);
+}
+
+void lir_uses(lir_block *b, int *uses) {
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->dead) { continue; }
+    for (int j = 0; j < n->argc; j++) { uses[n->args[j]]++; }
+    if (n->op == LIR_IF) {
+      lir_uses(n->then, uses);
+      lir_uses(n->els, uses);
+      uses[n->then->result]++;
+      uses[n->els->result]++;
+    }
+  }
+}
+
+int lir_sweep(lir *ir, lir_block *b, int *uses) {
+  int swept = 0;
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->op == LIR_IF) {
+      swept += lir_sweep(ir, n->then, uses);
+      swept += lir_sweep(ir, n->els, uses);
+    }
+    if (!n->dead && lir_pure_op(n) && uses[n->dst] == 0) {
+      n->dead = 1;
+      swept++;
+    }
+  }
+  return swept;
+}
+
+void lir_dce(lir *ir) {
+  int *uses = malloc(sizeof(int) * ir->nvals);
+  int swept;
+  do {
+    memset(uses, 0, sizeof(int) * ir->nvals);
+    uses[ir->loop->result]++;
+    lir_uses(ir->pre, uses);
+    lir_uses(ir->loop, uses);
+    swept = lir_sweep(ir, ir->pre, uses) + lir_sweep(ir, ir->loop, uses);
+    ir->dce += swept;
+  } while (swept);
+  free(uses);
+}
+
+/* Unchecked builtin variants, selected where every operand is proven to
+   have the listed type and the arity is fixed by the call site. Long
+   arithmetic may promote to a bignum or rational, so apart from % its
+   result type is unknown. */
+
+#define LIR_FAST_ARGS 8
+
+enum { LIR_ARITH, LIR_COMP };
+
+struct {
+  lbuiltin checked;
+  int type;
+  int kind;
+  int op;
+  int result;
+} lir_variants[] = {
+  { builtin_add, LVAL_LONG, LIR_ARITH, '+', -1 },
+  { builtin_sub, LVAL_LONG, LIR_ARITH, '-', -1 },
+  { builtin_mul, LVAL_LONG, LIR_ARITH, '*', -1 },
+  { builtin_div, LVAL_LONG, LIR_ARITH, '/', -1 },
+  { builtin_mod, LVAL_LONG, LIR_ARITH, '%', LVAL_LONG },
+  { builtin_pow, LVAL_LONG, LIR_ARITH, '^', -1 },
+  { builtin_add, LVAL_DOUBLE, LIR_ARITH, '+', LVAL_DOUBLE },
+  { builtin_sub, LVAL_DOUBLE, LIR_ARITH, '-', LVAL_DOUBLE },
+  { builtin_mul, LVAL_DOUBLE, LIR_ARITH, '*', LVAL_DOUBLE },
+  { builtin_div, LVAL_DOUBLE, LIR_ARITH, '/', -1 },
+  { builtin_mod, LVAL_DOUBLE, LIR_ARITH, '%', -1 },
+  { builtin_pow, LVAL_DOUBLE, LIR_ARITH, '^', LVAL_DOUBLE },
+  { builtin_gt, LVAL_LONG, LIR_COMP, GT, LVAL_BOOL },
+  { builtin_ge, LVAL_LONG, LIR_COMP, GE, LVAL_BOOL },
+  { builtin_eq, LVAL_LONG, LIR_COMP, EQ, LVAL_BOOL },
+  { builtin_ne, LVAL_LONG, LIR_COMP, NE, LVAL_BOOL },
+  { builtin_lt, LVAL_LONG, LIR_COMP, LT, LVAL_BOOL },
+  { builtin_le, LVAL_LONG, LIR_COMP, LE, LVAL_BOOL },
+  { builtin_gt, LVAL_DOUBLE, LIR_COMP, GT, LVAL_BOOL },
+  { builtin_ge, LVAL_DOUBLE, LIR_COMP, GE, LVAL_BOOL },
+  { builtin_eq, LVAL_DOUBLE, LIR_COMP, EQ, LVAL_BOOL },
+  { builtin_ne, LVAL_DOUBLE, LIR_COMP, NE, LVAL_BOOL },
+  { builtin_lt, LVAL_DOUBLE, LIR_COMP, LT, LVAL_BOOL },
+  { builtin_le, LVAL_DOUBLE, LIR_COMP, LE, LVAL_BOOL },
+  { builtin_eq, LVAL_STR, LIR_COMP, EQ, LVAL_BOOL },
+  { builtin_ne, LVAL_STR, LIR_COMP, NE, LVAL_BOOL },
+  { NULL, 0, 0, 0, 0 }
+};
+
+/* Folds x into the exact accumulator r, consuming r. */
+lval *lq_fold(int op, lq r, lval **x, int n) {
+  for (int i = 0; i < n; i++) {
+    lq y = lq_of(x[i]), t;
+    lbig *a, *b, *q;
+    if ((op == '/' || op == '%') && !y.n->len) {
+      lq_free(r);
+      lq_free(y);
+      return lval_err("Division By Zero!");
+    }
+    switch (op) {
+    case '+':
+    case '-':
+      a = lbig_mul(r.n, y.d);
+      b = lbig_mul(y.n, r.d);
+      t.n = lbig_add(a, b, op == '-');
+      t.d = lbig_mul(r.d, y.d);
+      lbig_release(a);
+      lbig_release(b);
+      break;
+    case '*':
+      t.n = lbig_mul(r.n, y.n);
+      t.d = lbig_mul(r.d, y.d);
+      break;
+    case '/':
+      t.n = lbig_mul(r.n, y.d);
+      t.d = lbig_mul(r.d, y.n);
+      break;
+    case '%':
+      a = lbig_mul(r.n, y.d);
+      b = lbig_mul(y.n, r.d);
+      lbig_divmod(a, b, &q, &t.n);
+      t.d = lbig_mul(r.d, y.d);
+      lbig_release(a);
+      lbig_release(b);
+      lbig_release(q);
+      break;
+    case '^':
+      if (x[i]->type != LVAL_LONG || (x[i]->value.l < 0 && !r.n->len)) {
+	lq_free(r);
+	lq_free(y);
+	return lval_err(x[i]->type != LVAL_LONG ? "Exponent too large!" : "Division By Zero!");
+      }
+      unsigned long k = x[i]->value.l < 0 ? -(unsigned long)x[i]->value.l : x[i]->value.l;
+      unsigned long bits = lbig_bits(r.n) > lbig_bits(r.d) ? lbig_bits(r.n) : lbig_bits(r.d);
+      if (bits > 1 && k > (unsigned long)LIZ_BIG_LIMBS * 32 / (bits - 1)) {
+	lq_free(r);
+	lq_free(y);
+	return lval_err("Exponent too large!");
+      }
+      t.n = lbig_pow(x[i]->value.l < 0 ? r.d : r.n, k);
+      t.d = lbig_pow(x[i]->value.l < 0 ? r.n : r.d, k);
+      break;
     }
+    lq_free(r);
+    lq_free(y);
+    r = lq_reduce(t);
   }
-  if (x->type == LVAL_STR) {
-    switch (func) {
-    case EQ:
-      return lval_booln(strcmp(x->value.str, y->value.str) == 0);
-    case NE:
-      return lval_booln(strcmp(x->value.str, y->value.str) != 0);
-    }
+  return lval_exact(r);
+}
+
+lval *lval_arith_exact(int op, lval **x, int n) {
+  if (op == '-' && n == 1) {
+    lq z = { lbig_new(0), lbig_from_long(1) };
+    return lq_fold(op, z, x, 1);
   }
-  
-  return lval_err("Type %s is not comparable.", ltype_name(x->type));
+  return lq_fold(op, lq_of(x[0]), x + 1, n - 1);
 }
 
-lval *builtin_gt(lenv *e, lval *a) {
-  LASSERT_NUM(">", a, 2);
-  return builtin_comp(a->value.cell[0], a->value.cell[1], GT);
+/* r^y in *t, unless y is negative or the result overflows. */
+int lpow_long(long r, long y, long *t) {
+  long p = 1;
+  if (y < 0) { return 1; }
+  while (y) {
+    if ((y & 1) && __builtin_mul_overflow(p, r, &p)) { return 1; }
+    y >>= 1;
+    if (y && __builtin_mul_overflow(r, r, &r)) { return 1; }
+  }
+  *t = p;
+  return 0;
 }
 
-lval *builtin_ge(lenv *e, lval *a) {
-  LASSERT_NUM(">=", a, 2);
-  return builtin_comp(a->value.cell[0], a->value.cell[1], GE);
+/* All-long operands stay unboxed until a step overflows or divides
+   inexactly; the rest of the fold then continues exactly. */
+lval *lval_arith_long(int op, lval **x, int n) {
+  long r = x[0]->value.l;
+  if (op == '-' && n == 1) {
+    return r != LONG_MIN ? lval_long(-r) : lval_arith_exact(op, x, n);
+  }
+  int i;
+  for (i = 1; i < n; i++) {
+    long y = x[i]->value.l, t = 0;
+    int spill = 0;
+    switch (op) {
+    case '+': spill = __builtin_add_overflow(r, y, &t); break;
+    case '-': spill = __builtin_sub_overflow(r, y, &t); break;
+    case '*': spill = __builtin_mul_overflow(r, y, &t); break;
+    case '/':
+      if (y == 0) { return lval_err("Division By Zero!"); }
+      if (y == -1) {
+	spill = __builtin_sub_overflow(0, r, &t);
+      } else {
+	spill = r % y != 0;
+	t = r / y;
+      }
+      break;
+    case '%':
+      if (y == 0) { return lval_err("Division By Zero!"); }
+      t = y == -1 ? 0 : r % y;
+      break;
+    case '^': spill = lpow_long(r, y, &t); break;
+    }
+    if (spill) { break; }
+    r = t;
+  }
+  if (i == n) { return lval_long(r); }
+  lq q = { lbig_from_long(r), lbig_from_long(1) };
+  return lq_fold(op, q, x + i, n - i);
 }
 
-lval *builtin_eq(lenv *e, lval *a) {
-  LASSERT_NUM("=", a, 2);
-  return builtin_comp(a->value.cell[0], a->value.cell[1], EQ);
+/* One step of a double fold; 0 on division by zero. */
+int ldouble_step(int op, double *r, double y) {
+  switch (op) {
+  case '+': *r += y; break;
+  case '-': *r -= y; break;
+  case '*': *r *= y; break;
+  case '/':
+    if (y == 0) { return 0; }
+    *r /= y; break;
+  case '%':
+    if (y == 0) { return 0; }
+    *r = fmod(*r, y); break;
+  case '^': *r = pow(*r, y); break;
+  }
+  return 1;
 }
 
-lval *builtin_ne(lenv *e, lval *a) {
-  LASSERT_NUM("!", a, 2);
-  return builtin_comp(a->value.cell[0], a->value.cell[1], NE);
+lval *lval_arith_double(int op, lval **x, int n) {
+  double r = x[0]->value.d;
+  if (op == '-' && n == 1) { return lval_double(-r); }
+  for (int i = 1; i < n; i++) {
+    if (!ldouble_step(op, &r, x[i]->value.d)) { return lval_err("Division By Zero!"); }
+  }
+  return lval_double(r);
 }
 
-lval *builtin_lt(lenv *e, lval *a) {
-  LASSERT_NUM("<", a, 2);
-  return builtin_comp(a->value.cell[0], a->value.cell[1], LT);
+/* A double anywhere makes the whole result inexact. */
+lval *lval_arith_inexact(int op, lval **x, int n) {
+  double r = lnum_double(x[0]);
+  if (op == '-' && n == 1) { return lval_double(-r); }
+  for (int i = 1; i < n; i++) {
+    if (!ldouble_step(op, &r, lnum_double(x[i]))) { return lval_err("Division By Zero!"); }
+  }
+  return lval_double(r);
 }
 
-lval *builtin_le(lenv *e, lval *a) {
-  LASSERT_NUM("<=", a, 2);
-  return builtin_comp(a->value.cell[0], a->value.cell[1], LE);
+int lir_type(lir *ir, int v) {
+  lir_ins *n = ir->defs[v];
+  if (n->op == LIR_PARAM) { return ir->ptypes[n->index]; }
+  if (n->op == LIR_CONST) { return n->k->type; }
+  if (n->op == LIR_SNAP) { return lir_type(ir, n->args[0]); }
+  return ir->types[v];
 }
 
-lval *builtin_load(lenv *e, lval *a) {
-  FILE *f = fopen(a->value.cell[0]->value.str, "r");
-  if (f == NULL) {
-    return lval_err("file failire\n");
+void lir_infer(lir *ir, lir_block *b) {
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->dead) { continue; }
+    ir->types[n->dst] = -1;
+    n->fast = -1;
+    if (n->op == LIR_IF) {
+      lir_infer(ir, n->then);
+      lir_infer(ir, n->els);
+      int t = lir_type(ir, n->then->result);
+      int x = lir_type(ir, n->args[1]);
+      int safe = n->index == LIR_TEST_BOOL ? x == LVAL_BOOL : x >= 0 && x != LVAL_ERR;
+      if (safe && t == lir_type(ir, n->els->result)) { ir->types[n->dst] = t; }
+    }
+    if (n->op != LIR_PCALL || n->argc < 2 || n->argc > LIR_FAST_ARGS + 1) { continue; }
+    int t = lir_type(ir, n->args[1]);
+    for (int j = 2; j < n->argc; j++) {
+      if (lir_type(ir, n->args[j]) != t) { t = -1; }
+    }
+    for (int j = 0; t >= 0 && lir_variants[j].checked; j++) {
+      if (lir_variants[j].checked != n->pure || lir_variants[j].type != t) { continue; }
+      if (lir_variants[j].kind == LIR_COMP && n->argc != 3) { continue; }
+      n->fast = j;
+      ir->types[n->dst] = lir_variants[j].result;
+      break;
+    }
   }
-  mpc_result_t r;
-  if (mpc_parse_file(a->value.cell[0]->value.str, f, Lisp64, &r)) { 
-    lval *x = lval_read(r.output);
-    mpc_ast_delete(r.output);
-    while (x->count) {
-      lval *y = lval_eval(e, lval_pop(x, 0));
-      if (y->type == LVAL_ERR) { lval_println(y); }
-      lval_del(y);
+}
+
+#define LIR_UNSEEN (-2)
+
+/* Warm-up calls record the union of their argument types. A parameter
+   seen with more than one type, or with one the variants do not cover,
+   stays generic. */
+void lir_observe(lir *ir, lval *f, lval *a) {
+  int n = f->formals->count;
+  if (!ir->ptypes) {
+    ir->ptypes = malloc(sizeof(int) * (n + 1));
+    for (int i = 0; i < n; i++) { ir->ptypes[i] = LIR_UNSEEN; }
+  }
+  for (int i = 0; i < n; i++) {
+    int t = a->count == n ? a->value.cell[i]->type : -1;
+    if (t != LVAL_LONG && t != LVAL_DOUBLE && t != LVAL_STR) { t = -1; }
+    if (ir->ptypes[i] == LIR_UNSEEN) {
+      ir->ptypes[i] = t;
+    } else if (ir->ptypes[i] != t) {
+      ir->ptypes[i] = -1;
     }
-    lval_del(x);    
-  } else {
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
-  } 
-  fclose(f);
-  return lval_sexp();
+  }
 }
 
-lval *builtin_print(lenv *e, lval *a) {
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->value.cell[i]); putchar(' ');
+/* Parameter types are speculated from the warm-up calls and guarded on
+   entry and on every back edge. */
+void lir_compile(lir *ir, lenv *e, lval *f, lval *a) {
+  lval *fs = f->formals;
+  ir->state = LIR_FAILED;
+  for (int i = 0; i < fs->count; i++) {
+    if (fs->value.cell[i]->type != LVAL_SYM) { return; }
+    if (strcmp(fs->value.cell[i]->value.sym, "&") == 0) { return; }
+    for (int j = 0; j < i; j++) {
+      if (strcmp(fs->value.cell[i]->value.sym, fs->value.cell[j]->value.sym) == 0) { return; }
+    }
   }
-  putchar('\n');
-  lval_del(a);
-  return lval_sexp();
+  while (e->par) { e = e->par; }
+  ir->formals = lval_copy(fs);
+  ir->body = lval_copy(f->body);
+  ir->pre = lir_block_new();
+  ir->loop = lir_block_new();
+  ir->loop->result = lir_lower_sexp(ir, ir->loop, e, ir->body, 1);
+  if (ir->unsupported) { return; }
+
+  int *alias = malloc(sizeof(int) * ir->nvals);
+  lir_ins **avail = malloc(sizeof(lir_ins*) * ir->nvals);
+  int navail = 0, wall = 0;
+  for (int i = 0; i < ir->nvals; i++) { alias[i] = i; }
+  lir_cse(ir, ir->loop, alias, avail, &navail, &wall);
+  free(alias);
+  free(avail);
+  lir_licm(ir);
+  lir_dce(ir);
+
+  if (!ir->ptypes) { ir->ptypes = malloc(sizeof(int) * (fs->count + 1)); }
+  for (int i = 0; i < fs->count; i++) {
+    if (!a || ir->ptypes[i] == LIR_UNSEEN) { ir->ptypes[i] = -1; }
+  }
+  ir->types = malloc(sizeof(int) * ir->nvals);
+  lir_infer(ir, ir->pre);
+  lir_infer(ir, ir->loop);
+  ir->state = LIR_READY;
 }
 
-lval *builtin_error(lenv *e, lval *a) {
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
-  lval *err = lval_err(a->value.cell[0]->value.str);
-  lval_del(a);
-  return err;
+int lir_ready(lir *ir, lenv *e, lval *f, lval *a) {
+  if (ir->state != LIR_COLD) { return ir->state == LIR_READY && a->count == ir->formals->count; }
+  lir_observe(ir, f, a);
+  if (++ir->calls >= LIZ_HOT_CALLS) { lir_compile(ir, e, f, a); }
+  return ir->state == LIR_READY && a->count == ir->formals->count;
 }
 
-lval *builtin_var(lenv *e, lval *a, char *func) {
-  LASSERT_TYPE(func, a, 0, LVAL_QEXP);
+typedef struct {
+  lir *ir;
+  lenv *e;
+  lval **regs;
+  unsigned long epoch;
+  int stale;
+  int typed;
+} lir_ctx;
 
-  lval *syms = a->value.cell[0];
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->value.cell[i]->type == LVAL_SYM),
-      "Function '%s' cannot define non-symbol. "
-      "Got %s, Expected %s.", func,
-      ltype_name(syms->value.cell[i]->type),
-      ltype_name(LVAL_SYM));
-  }
+lval *lir_peek(lir_ctx *c, int v) {
+  lir_ins *n = c->ir->defs[v];
+  if (n->op == LIR_PARAM) { return c->e->vals[n->index]; }
+  if (n->op == LIR_CONST) { return n->k; }
+  return c->regs[v];
+}
 
-  LASSERT(a, (syms->count == a->count-1),
-    "Function '%s' passed too many arguments for symbols. "
-    "Got %i, Expected %i.", func, syms->count, a->count-1);
-  
-  for (int i = 0; i < syms->count; i++) {
-    if (strcmp(func, "define") == 0) {
-      lenv_def(e, syms->value.cell[i], a->value.cell[i+1]);
-    }
-    if (strcmp(func, "set")   == 0) {
-      lenv_put(e, syms->value.cell[i], a->value.cell[i+1]);
-    }
+lval *lir_take(lir_ctx *c, int v, lir_block *b) {
+  lir_ins *n = c->ir->defs[v];
+  if (n->in != b || n->op == LIR_PARAM || n->op == LIR_CONST) {
+    return lval_copy(lir_peek(c, v));
   }
-  lval_del(a);
-  return lval_sexp();
+  lval *x = c->regs[v];
+  c->regs[v] = NULL;
+  return x;
 }
 
-lval *builtin_define(lenv *e, lval *a) {
-  return builtin_var(e, a, "define");
+void lir_set(lir_ctx *c, int v, lval *x) {
+  if (c->regs[v]) { lval_del(c->regs[v]); }
+  c->regs[v] = x;
 }
 
-lval *builtin_condn(lenv *e, lval *b, lval *t, lval *f) {
-  lval *x;
-  t->type = LVAL_SEXP;
-  f->type = LVAL_SEXP;
-  if (b->value.l) {
-    x = lval_eval(e, t);
-  } else {
-    x = lval_eval(e, f);
+lval *lir_operands(lir_ctx *c, lir_ins *n) {
+  lval *v = lval_sexp();
+  for (int i = 0; i < n->argc; i++) {
+    v = lval_add(v, lval_copy(lir_peek(c, n->args[i])));
   }
-  lval_del(b);
-  return x;
+  return v;
 }
 
-lval *builtin_cond(lenv *e, lval *a) {
-  LASSERT_NUM("cond", a, 3);
-  LASSERT_TYPE("cond", a, 0, LVAL_BOOL);
-  LASSERT_TYPE("cond", a, 1, LVAL_QEXP);
-  LASSERT_TYPE("cond", a, 2, LVAL_QEXP);
-  return builtin_condn(e, a->value.cell[0], a->value.cell[1], a->value.cell[2]);
+int lir_typed(lir_ctx *c) {
+  for (int i = 0; i < c->ir->formals->count; i++) {
+    int t = c->ir->ptypes[i];
+    if (t >= 0 && c->e->vals[i]->type != t) { return 0; }
+  }
+  return 1;
 }
 
-lval *builtin_set(lenv *e, lval *a) {
-  return builtin_var(e, a, "set");
+/* Counts a failed type guard. After LIZ_HOT_CALLS of them the guessed
+   types that keep failing are dropped and the variants picked again,
+   so the IR settles on code that fits the calls it actually gets. */
+void lir_deopt(lir_ctx *c) {
+  lir *ir = c->ir;
+  if (++ir->deopts < LIZ_HOT_CALLS) { return; }
+  ir->deopts = 0;
+  for (int i = 0; i < ir->formals->count; i++) {
+    if (ir->ptypes[i] >= 0 && c->e->vals[i]->type != ir->ptypes[i]) { ir->ptypes[i] = -1; }
+  }
+  lir_infer(ir, ir->pre);
+  lir_infer(ir, ir->loop);
+  c->typed = lir_typed(c);
 }
 
-lval *lval_call(lenv *e, lval *f, lval *a) {
-  if (f->value.builtin) { return f->value.builtin(e, a); }
-  int given = a->count;
-  int total = f->formals->count;
-  while (a->count) {
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err("Function passed too many arguments. " "Got %i, Expected %i.", given, total);
-    }
-    lval *sym = lval_pop(f->formals, 0);
-    if (strcmp(sym->value.sym, "&") == 0) {
-      if (f->formals->count != 1) {
-	lval_del(a);
-	return lval_err("Function format invalid. "
-			"Symbol '&' not followed by single symbol.");
+void lir_pcall(lir_ctx *c, lir_ins *n) {
+  lval *h = lir_peek(c, n->args[0]);
+  if (c->typed && n->fast >= 0 && h->type == LVAL_FUN && h->value.builtin == n->pure) {
+    lval *x[LIR_FAST_ARGS];
+    for (int i = 1; i < n->argc; i++) { x[i-1] = lir_peek(c, n->args[i]); }
+    switch (lir_variants[n->fast].kind) {
+    case LIR_COMP: lir_set(c, n->dst, builtin_comp(x[0], x[1], lir_variants[n->fast].op)); break;
+    case LIR_ARITH:
+      if (lir_variants[n->fast].type == LVAL_LONG) {
+	lir_set(c, n->dst, lval_arith_long(lir_variants[n->fast].op, x, n->argc-1));
+      } else {
+	lir_set(c, n->dst, lval_arith_double(lir_variants[n->fast].op, x, n->argc-1));
       }
-      lval *nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(nsym);
       break;
     }
-    lval *val = lval_pop(a, 0);
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+    return;
   }
-  lval_del(a);
-  if (f->formals->count > 0 &&
-      strcmp(f->formals->value.cell[0]->value.sym, "&") == 0) {
-    if (f->formals->count != 2) {
-      return lval_err("Function format invalid. "
-		      "Symbol '&' not followed by single symbol.");
-    }
-    lval_del(lval_pop(f->formals, 0));
-    lval *sym = lval_pop(f->formals, 0);
-    lval *val = lval_qexp();
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
+  lval *v = lir_operands(c, n);
+  h = v->value.cell[0];
+  int fast = h->type == LVAL_FUN && h->value.builtin == n->pure;
+  for (int i = 1; fast && i < v->count; i++) {
+    fast = v->value.cell[i]->type != LVAL_ERR && v->value.cell[i]->type != LVAL_RECUR;
   }
-  if (f->formals->count == 0) {
-    f->env->par = e;
-    return builtin_eval(f->env, lval_add(lval_sexp(), lval_copy(f->body)));
+  if (fast) {
+    lval_del(lval_pop(v, 0));
+    lir_set(c, n->dst, n->pure(c->e, v));
+  } else {
+    lir_set(c, n->dst, lval_apply(c->e, v));
   }
-  return lval_copy(f);
 }
 
-lval *lval_eval_sexp(lenv *e, lval *v) {
-  for (int i = 0; i < v->count; i++) {
-    v->value.cell[i] = lval_eval(e, v->value.cell[i]);
+/* Lookups and everything hoisted with them are recomputed whenever a
+   binding changes; a guarded builtin that got rebound forces a deopt. */
+int lir_prepare(lir_ctx *c) {
+  lir_block *b = c->ir->pre;
+  int ok = 1;
+  c->epoch = lenv_epoch;
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->dead || n->op != LIR_LOOKUP) { continue; }
+    lir_set(c, n->dst, lenv_get(c->e, n->k));
+    lval *x = c->regs[n->dst];
+    if (n->pure && ((x->type != LVAL_FUN && x->type != LVAL_FORM) || x->value.builtin != n->pure)) {
+      ok = 0;
+    }
   }
-  for (int i = 0; i < v->count; i++) {
-    if (v->value.cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+  for (int i = 0; ok && i < b->count; i++) {
+    if (!b->ins[i]->dead && b->ins[i]->op == LIR_PCALL) { lir_pcall(c, b->ins[i]); }
   }
-  if (v->count == 0) { return v; }
-  if (v->count == 1) { return lval_take(v, 0); }
+  return ok;
+}
 
-  lval *f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval *err = lval_err("S-Expression starts with incorrect type. " "Got %s, Expected %s.",
-			 ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f);
-    lval_del(v);
-    return err;
+void lir_sync(lir_ctx *c) {
+  if (c->epoch == lenv_epoch) { return; }
+  c->typed = lir_typed(c);
+  if (!lir_prepare(c)) { c->stale = 1; }
+}
+
+int lir_run(lir_ctx *c, lir_block *b);
+
+int lir_if(lir_ctx *c, lir_ins *n) {
+  lval *h = lir_peek(c, n->args[0]);
+  lval *x = lir_peek(c, n->args[1]);
+  lir_block *arm = NULL;
+  switch (n->index) {
+  case LIR_TEST_BOOL:
+    if (h->type == LVAL_FUN && h->value.builtin == builtin_cond && x->type == LVAL_BOOL) {
+      arm = x->value.l ? n->then : n->els;
+    }
+    break;
+  case LIR_TEST_TRUTHY:
+    if (x->type != LVAL_ERR && x->type != LVAL_RECUR) { arm = lval_truthy(x) ? n->then : n->els; }
+    break;
+  case LIR_TEST_ERROR:
+    if (x->type != LVAL_ERR && x->type != LVAL_RECUR) { arm = n->els; }
+    break;
   }
-  lval *result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+  if (arm) {
+    if (lir_run(c, arm)) { return 1; }
+    lir_set(c, n->dst, lir_take(c, arm->result, arm));
+    return 0;
+  }
+  if (n->index != LIR_TEST_BOOL) {
+    lir_set(c, n->dst, lval_used(lval_copy(x)));
+    return 0;
+  }
+  lval *v = lir_operands(c, n);
+  v = lval_add(v, lval_copy(n->k->value.cell[0]));
+  v = lval_add(v, lval_copy(n->k->value.cell[1]));
+  lir_set(c, n->dst, lval_apply(c->e, v));
+  lir_sync(c);
+  return 0;
 }
 
-lval *lval_eval(lenv *e, lval *v) {
-  if (v->type == LVAL_SYM) {
-    lval *x = lenv_get(e, v);
-    lval_del(v);
-    return x;
+int lir_loop(lir_ctx *c, lir_ins *n) {
+  lval *h = lir_peek(c, n->args[0]);
+  int self = h->type == LVAL_FUN && h->ir == c->ir && h->env->count == 0;
+  for (int i = 1; self && i < n->argc; i++) {
+    self = lir_peek(c, n->args[i])->type != LVAL_ERR;
   }
-  if (v->type == LVAL_SEXP) { return lval_eval_sexp(e, v); }
-  return v;
+  if (!self) {
+    lir_set(c, n->dst, lval_apply(c->e, lir_operands(c, n)));
+    return 0;
+  }
+  lval *x[n->argc];
+  for (int i = 1; i < n->argc; i++) {
+    x[i] = lval_copy(lir_peek(c, n->args[i]));
+  }
+  for (int i = 1; i < n->argc; i++) {
+    int t = c->ir->ptypes[i-1];
+    if (t >= 0 && lir_type(c->ir, n->args[i]) != t && x[i]->type != t) { c->typed = 0; }
+    lval_del(c->e->vals[i-1]);
+    c->e->vals[i-1] = x[i];
+  }
+  if (!c->typed) { lir_deopt(c); }
+  return 1;
 }
 
-lval *builtin_add(lenv *e, lval *a) {
-  return builtin_op(e, a, "+");
+int lir_run(lir_ctx *c, lir_block *b) {
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->dead) { continue; }
+    switch (n->op) {
+    case LIR_PCALL: lir_pcall(c, n); break;
+    case LIR_CALL:
+      lir_set(c, n->dst, lval_apply(c->e, lir_operands(c, n)));
+      lir_sync(c);
+      break;
+    case LIR_IF: if (lir_if(c, n)) { return 1; } break;
+    case LIR_LOOP: return lir_loop(c, n);
+    case LIR_SNAP: lir_set(c, n->dst, lval_copy(lir_peek(c, n->args[0]))); break;
+    }
+  }
+  return 0;
 }
 
-lval *builtin_sub(lenv *e, lval *a) {
-  return builtin_op(e, a, "-");
+lval *lir_exec(lir *ir, lenv *e) {
+  lir_ctx c;
+  c.ir = ir;
+  c.e = e;
+  c.regs = calloc(ir->nvals, sizeof(lval*));
+  c.typed = lir_typed(&c);
+  if (!c.typed) { lir_deopt(&c); }
+  c.stale = !lir_prepare(&c);
+  lval *r = NULL;
+  while (!r) {
+    lir_sync(&c);
+    if (c.stale) {
+      r = builtin_eval(e, lval_add(lval_sexp(), lval_copy(ir->body)));
+    } else if (!lir_run(&c, ir->loop)) {
+      r = lir_take(&c, ir->loop->result, ir->loop);
+    }
+  }
+  for (int i = 0; i < ir->nvals; i++) {
+    if (c.regs[i]) { lval_del(c.regs[i]); }
+  }
+  free(c.regs);
+  return r;
 }
 
-lval *builtin_mul(lenv *e, lval *a) {
-  return builtin_op(e, a, "*");
+void lir_print_args(lir_ins *n, int from) {
+  for (int i = from; i < n->argc; i++) { printf(" %%%i", n->args[i]); }
 }
 
-lval *builtin_div(lenv *e, lval *a) {
-  return builtin_op(e, a, "/");
+void lir_print_block(lir *ir, lir_block *b, int depth) {
+  for (int i = 0; i < b->count; i++) {
+    lir_ins *n = b->ins[i];
+    if (n->dead) { continue; }
+    printf("%*s%%%i = ", depth * 2, "", n->dst);
+    switch (n->op) {
+    case LIR_PARAM: printf("param %s", n->k->value.sym); break;
+    case LIR_CONST: printf("const "); lval_print(n->k); break;
+    case LIR_LOOKUP: printf("lookup %s%s", n->k->value.sym, n->pure ? " [guard]" : ""); break;
+    case LIR_PCALL:
+      printf("pcall");
+      lir_print_args(n, 0);
+      if (n->fast >= 0) { printf(" [unchecked]"); }
+      break;
+    case LIR_CALL: printf("call"); lir_print_args(n, 0); break;
+    case LIR_LOOP: printf("loop"); lir_print_args(n, 1); break;
+    case LIR_SNAP: printf("snap"); lir_print_args(n, 0); break;
+    case LIR_IF:
+      printf("if %%%i %s%%%i\n", n->args[0],
+	     n->index == LIR_TEST_ERROR ? "error? " : n->index == LIR_TEST_TRUTHY ? "truthy? " : "",
+	     n->args[1]);
+      printf("%*sthen:\n", depth * 2, "");
+      lir_print_block(ir, n->then, depth + 1);
+      printf("%*selse:\n", depth * 2, "");
+      lir_print_block(ir, n->els, depth + 1);
+      continue;
+    }
+    if (n->op != LIR_CONST && lir_type(ir, n->dst) >= 0) { printf(" : %s", ltype_name(lir_type(ir, n->dst))); }
+    putchar('\n');
+  }
+  if (b->result >= 0) { printf("%*sret %%%i\n", depth * 2, "", b->result); }
 }
 
-lval *builtin_mod(lenv *e, lval *a) {
-  return builtin_op(e, a, "%");
+lval *builtin_ir_dump(lenv *e, lval *a) {
+  LASSERT_NUM("ir-dump", a, 1);
+  LASSERT_TYPE("ir-dump", a, 0, LVAL_FUN);
+  lval *f = a->value.cell[0];
+  LASSERT(a, !f->value.builtin, "Function 'ir-dump' cannot lower a builtin.");
+  if (f->ir->state == LIR_COLD && f->env->count == 0) { lir_compile(f->ir, e, f, NULL); }
+  LASSERT(a, f->ir->state == LIR_READY, "Function 'ir-dump' could not lower this function.");
+  lir *ir = f->ir;
+  printf("ir %s ", ir->name ? ir->name : "lambda");
+  lval_println(ir->formals);
+  printf("; cse %i, licm %i, dce %i\n", ir->cse, ir->licm, ir->dce);
+  for (int i = 0; i < ir->formals->count; i++) {
+    if (ir->ptypes[i] >= 0) {
+      printf("; %s : %s\n", ir->formals->value.cell[i]->value.sym, ltype_name(ir->ptypes[i]));
+    }
+  }
+  printf("pre:\n");
+  lir_print_block(ir, ir->pre, 1);
+  printf("loop:\n");
+  lir_print_block(ir, ir->loop, 1);
+  lval_del(a);
+  return lval_nil();
 }
 
-lval *builtin_pow(lenv *e, lval *a) {
-  return builtin_op(e, a, "^");
+#ifdef LIZ_POOL_DEBUG
+/* (pool-stats "chunks") counts the chunks the lval pool holds and
+   (pool-stats "idle") those among them with no live lvals. Both are 0
+   when the pool is built out. Only builds with LIZ_POOL_DEBUG have it,
+   for the pool's own tests. */
+lval *builtin_pool_stats(lenv *e, lval *a) {
+  LASSERT_NUM("pool-stats", a, 1);
+  LASSERT_TYPE("pool-stats", a, 0, LVAL_STR);
+  char *k = a->value.cell[0]->value.str;
+  LASSERT(a, strcmp(k, "chunks") == 0 || strcmp(k, "idle") == 0,
+    "Function 'pool-stats' has no statistic '%s'. Expected chunks or idle.", k);
+  long n = 0;
+  for (lpool_chunk *c = lpool_chunks; c; c = c->next) { n += k[0] == 'c' || c->idle; }
+  lval_del(a);
+  return lval_long(n);
 }
+#endif
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
   lval *k = lval_sym(name);
@@ -798,12 +7130,114 @@ void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
   lval_del(k); lval_del(v);
 }
 
+void lenv_add_form(lenv *e, char *name, lbuiltin func) {
+  lval *k = lval_sym(name);
+  lval *v = lval_form(func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
 void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "list", builtin_list);
   lenv_add_builtin(e, "head", builtin_head);
   lenv_add_builtin(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "make-vec", builtin_make_vec);
+  lenv_add_builtin(e, "vec-ref", builtin_vec_ref);
+  lenv_add_builtin(e, "vec-set!", builtin_vec_set);
+  lenv_add_builtin(e, "vec-push!", builtin_vec_push);
+  lenv_add_builtin(e, "vec-len", builtin_vec_len);
+  lenv_add_builtin(e, "vec->list", builtin_vec_to_list);
+  lenv_add_builtin(e, "f64-array", builtin_f64_array);
+  lenv_add_builtin(e, "i64-array", builtin_i64_array);
+  lenv_add_builtin(e, "arr-len", builtin_arr_len);
+  lenv_add_builtin(e, "arr-ref", builtin_arr_ref);
+  lenv_add_builtin(e, "arr-set!", builtin_arr_set);
+  lenv_add_builtin(e, "arr->list", builtin_arr_to_list);
+  lenv_add_builtin(e, "arr-sum", builtin_arr_sum);
+  lenv_add_builtin(e, "arr-prod", builtin_arr_prod);
+  lenv_add_builtin(e, "arr-min", builtin_arr_min);
+  lenv_add_builtin(e, "arr-max", builtin_arr_max);
+  lenv_add_builtin(e, "arr-dot", builtin_arr_dot);
+  lenv_add_builtin(e, "arr+", builtin_arr_add);
+  lenv_add_builtin(e, "arr-", builtin_arr_sub);
+  lenv_add_builtin(e, "arr*", builtin_arr_mul);
+  lenv_add_builtin(e, "arr/", builtin_arr_div);
+  lenv_add_builtin(e, "arr>", builtin_arr_gt);
+  lenv_add_builtin(e, "arr>=", builtin_arr_ge);
+  lenv_add_builtin(e, "arr=", builtin_arr_eq);
+  lenv_add_builtin(e, "arr!", builtin_arr_ne);
+  lenv_add_builtin(e, "arr<", builtin_arr_lt);
+  lenv_add_builtin(e, "arr<=", builtin_arr_le);
+  lenv_add_builtin(e, "table", builtin_table);
+  lenv_add_builtin(e, "table-load-csv", builtin_table_load_csv);
+  lenv_add_builtin(e, "table-col", builtin_table_col);
+  lenv_add_builtin(e, "table-names", builtin_table_names);
+  lenv_add_builtin(e, "table-count", builtin_table_count);
+  lenv_add_builtin(e, "table-select", builtin_table_select);
+  lenv_add_builtin(e, "table-where", builtin_table_where);
+  lenv_add_builtin(e, "table-sort-by", builtin_table_sort_by);
+  lenv_add_builtin(e, "table-group-by", builtin_table_group_by);
+  lenv_add_builtin(e, "table-sum", builtin_table_sum);
+  lenv_add_builtin(e, "table-mean", builtin_table_mean);
+  lenv_add_builtin(e, "mat", builtin_mat);
+  lenv_add_builtin(e, "mat-zeros", builtin_mat_zeros);
+  lenv_add_builtin(e, "mat-identity", builtin_mat_identity);
+  lenv_add_builtin(e, "mat-ref", builtin_mat_ref);
+  lenv_add_builtin(e, "mat-set!", builtin_mat_set);
+  lenv_add_builtin(e, "mat-rows", builtin_mat_rows);
+  lenv_add_builtin(e, "mat-cols", builtin_mat_cols);
+  lenv_add_builtin(e, "mat->list", builtin_mat_to_list);
+  lenv_add_builtin(e, "mat-transpose", builtin_mat_transpose);
+  lenv_add_builtin(e, "mat-mul", builtin_mat_mul);
+  lenv_add_builtin(e, "mat+", builtin_mat_add);
+  lenv_add_builtin(e, "mat-", builtin_mat_sub);
+  lenv_add_builtin(e, "mat*", builtin_mat_mul_elem);
+  lenv_add_builtin(e, "mat/", builtin_mat_div);
+  lenv_add_builtin(e, "sort", builtin_sort);
+  lenv_add_builtin(e, "sort-by", builtin_sort_by);
+  lenv_add_builtin(e, "hash-map", builtin_hash_map);
+  lenv_add_builtin(e, "hash-set", builtin_hash_set);
+  lenv_add_builtin(e, "list->map", builtin_list_to_map);
+  lenv_add_builtin(e, "list->set", builtin_list_to_set);
+  lenv_add_builtin(e, "assoc", builtin_assoc);
+  lenv_add_builtin(e, "dissoc", builtin_dissoc);
+  lenv_add_builtin(e, "get", builtin_get);
+  lenv_add_builtin(e, "contains?", builtin_contains);
+  lenv_add_builtin(e, "keys", builtin_keys);
+  lenv_add_builtin(e, "vals", builtin_vals);
+  lenv_add_builtin(e, "map->list", builtin_map_to_list);
+  lenv_add_builtin(e, "defrecord", builtin_defrecord);
+  lenv_add_builtin(e, "make-pq", builtin_make_pq);
+  lenv_add_builtin(e, "pq-push", builtin_pq_push);
+  lenv_add_builtin(e, "pq-pop", builtin_pq_pop);
+  lenv_add_builtin(e, "pq-peek", builtin_pq_peek);
+  lenv_add_builtin(e, "pq-size", builtin_pq_size);
+  lenv_add_builtin(e, "make-bits", builtin_make_bits);
+  lenv_add_builtin(e, "bits-set!", builtin_bits_set);
+  lenv_add_builtin(e, "bits-clear!", builtin_bits_clear);
+  lenv_add_builtin(e, "bits-test", builtin_bits_test);
+  lenv_add_builtin(e, "bits-or", builtin_bits_or);
+  lenv_add_builtin(e, "bits-and", builtin_bits_and);
+  lenv_add_builtin(e, "bits-diff", builtin_bits_diff);
+  lenv_add_builtin(e, "bits-xor", builtin_bits_xor);
+  lenv_add_builtin(e, "bits-count", builtin_bits_count);
+  lenv_add_builtin(e, "bits->list", builtin_bits_to_list);
+  lenv_add_builtin(e, "range", builtin_range);
+  lenv_add_builtin(e, "iterate", builtin_iterate);
+  lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+  lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+  lenv_add_builtin(e, "take", builtin_take);
+  lenv_add_builtin(e, "drop", builtin_drop);
+  lenv_add_builtin(e, "seq->list", builtin_seq_to_list);
+  lenv_add_builtin(e, "reduce", builtin_reduce);
+  lenv_add_builtin(e, "mapping", builtin_mapping);
+  lenv_add_builtin(e, "filtering", builtin_filtering);
+  lenv_add_builtin(e, "taking-while", builtin_taking_while);
+  lenv_add_builtin(e, "pipeline", builtin_pipeline);
+  lenv_add_builtin(e, "transduce", builtin_transduce);
   lenv_add_builtin(e, "define", builtin_define);
   lenv_add_builtin(e, "+", builtin_add);
   lenv_add_builtin(e, "-", builtin_sub);
@@ -819,84 +7253,58 @@ void lenv_add_builtins(lenv *e) {
   lenv_add_builtin(e, "!", builtin_ne);
   lenv_add_builtin(e, "<", builtin_lt);
   lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_builtin(e, "empty?", builtin_empty);
+  lenv_add_builtin(e, "count", builtin_count);
+  lenv_add_builtin(e, "hash", builtin_hash);
   lenv_add_builtin(e, "cond", builtin_cond);
+  lenv_add_builtin(e, "not", builtin_not);
+  lenv_add_form(e, "if", builtin_if);
+  lenv_add_form(e, "when", builtin_when);
+  lenv_add_form(e, "unless", builtin_unless);
+  lenv_add_form(e, "and", builtin_and);
+  lenv_add_form(e, "or", builtin_or);
+  lenv_add_form(e, "let", builtin_let);
+  lenv_add_form(e, "let*", builtin_let_star);
+  lenv_add_form(e, "letrec", builtin_letrec);
+  lenv_add_form(e, "while", builtin_while);
+  lenv_add_form(e, "dotimes", builtin_dotimes);
+  lenv_add_form(e, "for-each", builtin_for_each);
+  lenv_add_form(e, "loop", builtin_loop);
+  lenv_add_builtin(e, "recur", builtin_recur);
   lenv_add_builtin(e, "load",  builtin_load);
   lenv_add_builtin(e, "error", builtin_error);
   lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "ir-dump", builtin_ir_dump);
+#ifdef LIZ_POOL_DEBUG
+  lenv_add_builtin(e, "pool-stats", builtin_pool_stats);
+#endif
 }
 
+/* The widest operand picks one loop for the whole call. A rational
+   exponent has no exact power, so it counts as a double. */
 lval *builtin_op(lenv *e, lval *a, char *op) {
+  int rank = 0, mixed = 0;
   for (int i = 0; i < a->count; i++) {
-    if (!(a->value.cell[i]->type == LVAL_LONG || a->value.cell[i]->type == LVAL_DOUBLE)) {
+    int t = lnum_rank(a->value.cell[i]->type);
+    if (t < 0) {
       lval_del(a);
       return lval_err("Cannot operate on non-number!");
     }
+    if (*op == '^' && i > 0 && t == 2) { t = 3; }
+    mixed |= t != lnum_rank(a->value.cell[0]->type);
+    if (t > rank) { rank = t; }
   }
-  lval *x = lval_pop(a, 0);
-  if (x->type == LVAL_LONG) {
-    if (strcmp(op, "-") == 0 && a->count == 0) {
-      x->value.l = -x->value.l;
-    }
-    while (a->count > 0) {
-      lval* y = lval_pop(a, 0);
-      if (strcmp(op, "+") == 0) { x->value.l += y->value.l; }
-      if (strcmp(op, "-") == 0) { x->value.l -= y->value.l; }
-      if (strcmp(op, "*") == 0) { x->value.l *= y->value.l; }
-      if (strcmp(op, "/") == 0) {
-	if (y->value.l == 0) {
-	  lval_del(x);
-	  lval_del(y);
-	  x = lval_err("Division By Zero!"); break;
-	}
-	x->value.l /= y->value.l;
-      }
-      if (strcmp(op, "%") == 0) {
-	if (y->value.l == 0) {
-	  lval_del(x);
-	  lval_del(y);
-	  x = lval_err("Division By Zero!"); break;
-	}
-	x->value.l %= y->value.l;
-      }
-      if (strcmp(op, "^") == 0) { x->value.l = pow(x->value.l, y->value.l); }
-      lval_del(y);
-    }
-  }
-  if (x->type == LVAL_DOUBLE) {
-    if (strcmp(op, "-") == 0 && a->count == 0) {
-      x->value.d = -x->value.d;
-    }
-    while (a->count > 0) {
-      lval* y = lval_pop(a, 0);
-      if (strcmp(op, "+") == 0) { x->value.d += y->value.d; }
-      if (strcmp(op, "-") == 0) { x->value.d -= y->value.d; }
-      if (strcmp(op, "*") == 0) { x->value.d *= y->value.d; }
-      if (strcmp(op, "/") == 0) {
-	if (y->value.d == 0) {
-	  lval_del(x);
-	  lval_del(y);
-	  x = lval_err("Division By Zero!"); break;
-	}
-	x->value.d /= y->value.d;
-      }
-      if (strcmp(op, "%") == 0) {
-	if (y->value.d == 0) {
-	  lval_del(x);
-	  lval_del(y);
-	  x = lval_err("Division By Zero!"); break;
-	}
-	x->value.d = fmod(x->value.d, y->value.d);
-      }
-      if (strcmp(op, "^") == 0) { x->value.d = pow(x->value.d, y->value.d); }
-      lval_del(y);
-    }
-  }
-
+  lval **x = a->value.cell;
+  lval *r = rank == 0 ? lval_arith_long(*op, x, a->count)
+    : rank < 3 ? lval_arith_exact(*op, x, a->count)
+    : mixed ? lval_arith_inexact(*op, x, a->count)
+    : lval_arith_double(*op, x, a->count);
   lval_del(a);
-  return x;
+  return r;
 }
 
 int main(int argc, char **argv) {
+  lval_fixed_init();
   Comment  = mpc_new("comment");
   String   = mpc_new("string");
   Boolean  = mpc_new("boolean");
@@ -917,12 +7325,13 @@ int main(int argc, char **argv) {
       double   : /-?[0-9]+\\.[0-9]+/ ;					\
       long     : /-?[0-9]+/ ;						\
       number   : <double> | <long> ;					\
-      symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&\\^%]+/ ;			\
+      symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!?&\\^%]+/ ;			\
       sexp     : '(' <expr>* ')' ;					\
       qexp     : '{' <expr>* '}' ;					\
       expr     : <string> | <comment> | <number> | <symbol> | <boolean> | <sexp> | <qexp> ; \
       lisp64   : /^/ <expr>* /$/ ;					\
     ", Comment, String, Boolean, Double, Long, Number, Symbol, Sexp, Qexp, Expr, Lisp64);
+  lk_init();
   lenv* e = lenv_new();
   lenv_add_builtins(e);
   
@@ -954,6 +7363,7 @@ int main(int argc, char **argv) {
 	lval_println(x);
 	lval_del(x);
 	mpc_ast_delete(r.output);
+	lpool_trim();
       } else {
 	mpc_err_print(r.error);
 	mpc_err_delete(r.error);
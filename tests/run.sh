@@ -0,0 +1,16 @@
+#!/bin/sh
+# Runs every .liz in the directory given as $2, tests by default,
+# through the interpreter given as $1 and compares what it prints with
+# the matching .out file.
+liz=${1:-./liz}
+dir=${2:-tests}
+fail=0
+for t in "$dir"/*.liz; do
+  if "$liz" "$t" 2>&1 | cmp -s - "${t%.liz}.out"; then
+    echo "ok   $t"
+  else
+    echo "FAIL $t"
+    fail=1
+  fi
+done
+exit $fail